@@ -0,0 +1,444 @@
+#define SDL_MAIN_HANDLED
+#include <SDL.h>
+#include <SDL_image.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Image.h"
+
+// Runs the editor's image kernels over many files without a window or renderer. Each worker thread takes one
+// file at a time, so only as many images as there are workers are ever held, and a memory budget holds workers
+// back while the files already in flight would take it past the limit.
+
+enum class BatchOp {
+	Palette, // Replace the palette with another image's, keeping the indices
+	Replace, // Every pixel of one index becomes another
+	Fill,    // Flood fill from a point
+	Sort,
+	Merge,
+	Compact,
+	Scale,   // Up by a whole number, with any of the resample modes
+	Shrink,  // Down by a whole number, majority vote
+	Resize   // To any size, nearest neighbour
+};
+
+struct batchStep {
+	BatchOp op;
+	int a = 0, b = 0, c = 0;
+	PaletteSortKey key = PaletteSortKey::Luminance;
+	ScaleMode mode = ScaleMode::Nearest;
+	SDL_Colour palette[256] = {};
+};
+
+struct batchOptions {
+	std::vector<batchStep> steps;
+	std::vector<std::string> inputs;
+	std::string outDir;
+	bool gif = false;
+	bool verify = false;
+	int threads = 0;
+	size_t memoryLimit = (size_t)512 << 20;
+	QuantiseOptions quantise;
+};
+
+class MemoryBudget {
+private:
+	std::mutex lock;
+	std::condition_variable freed;
+	size_t limit, used = 0;
+
+public:
+	MemoryBudget(size_t limit) : limit(limit) {}
+
+	// Waits until bytes fit. Something bigger than the whole budget waits for everything else, then runs alone.
+	void Acquire(size_t bytes) {
+		std::unique_lock<std::mutex> hold(lock);
+		freed.wait(hold, [&] { return used == 0 || used + bytes <= limit; });
+		used += bytes;
+	}
+
+	void Release(size_t bytes) {
+		{
+			std::lock_guard<std::mutex> hold(lock);
+			used -= bytes;
+		}
+		freed.notify_all();
+	}
+};
+
+static void Usage() {
+	fprintf(stderr,
+		"Usage: PixelBatch [options] <image or directory>... --out <directory>\n"
+		"Steps, run on every image in the order given:\n"
+		"  --palette <image>      Take the palette of a paletted image, keeping pixel indices\n"
+		"  --replace <from>:<to>  Change every pixel of one index to another\n"
+		"  --fill <x>,<y>,<index> Flood fill from a point\n"
+		"  --sort luminance|hue   Sort the palette, moving pixels with their colours\n"
+		"  --merge                Merge palette entries of the same colour\n"
+		"  --compact              Move the colours in use to the front of the palette\n"
+		"  --scale <n>[:<mode>]   Scale up n times. Modes are nearest, scale2x, scale3x, epx and xbr.\n"
+		"                         The pixel art modes repeat while n is a power of their own factor.\n"
+		"  --shrink <n>           Scale down n times, each block taking its most common index\n"
+		"  --resize <w>x<h>       Resize to w by h pixels, nearest neighbour, at any ratio\n"
+		"Options:\n"
+		"  --format png|gif       Output format, png by default\n"
+		"  --colours <n>          Palette size when quantising images that aren't paletted\n"
+		"  --dither               Dither when quantising\n"
+		"  --threads <n>          Worker threads, one per core by default\n"
+		"  --memory <MB>          Budget for images in flight, 512 by default\n"
+		"  --verify               Run every file again on one thread, last to first, and check each comes\n"
+		"                         out the same as in the parallel run\n");
+}
+
+static bool IsImagePath(const std::filesystem::path& path) {
+	std::string ext = path.extension().string();
+	for (char& ch : ext) ch = (char)tolower((unsigned char)ch);
+	return ext == ".png" || ext == ".gif" || ext == ".bmp" || ext == ".tga" || ext == ".jpg" || ext == ".jpeg";
+}
+
+static bool ParseArguments(int argc, char* argv[], batchOptions& options) {
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+		auto needs = [&](const char* what) {
+			if (value == NULL) fprintf(stderr, "%s needs %s\n", arg.c_str(), what);
+			return value != NULL;
+		};
+
+		batchStep step;
+		if (arg == "--palette") {
+			if (!needs("an image")) return false;
+			indexedImage source;
+			if (!LoadIndexedImage(value, source, options.quantise, true)) {
+				fprintf(stderr, "Unable to load palette %s: %s\n", value, SDL_GetError());
+				return false;
+			}
+			step.op = BatchOp::Palette;
+			memcpy(step.palette, source.palette, sizeof(step.palette));
+			options.steps.push_back(step);
+			i++;
+		}
+		else if (arg == "--replace") {
+			if (!needs("<from>:<to>") || sscanf(value, "%d:%d", &step.a, &step.b) != 2) return false;
+			step.op = BatchOp::Replace;
+			options.steps.push_back(step);
+			i++;
+		}
+		else if (arg == "--fill") {
+			if (!needs("<x>,<y>,<index>") || sscanf(value, "%d,%d,%d", &step.a, &step.b, &step.c) != 3) return false;
+			step.op = BatchOp::Fill;
+			options.steps.push_back(step);
+			i++;
+		}
+		else if (arg == "--sort") {
+			if (!needs("luminance or hue")) return false;
+			step.op = BatchOp::Sort;
+			step.key = strcmp(value, "hue") == 0 ? PaletteSortKey::Hue : PaletteSortKey::Luminance;
+			options.steps.push_back(step);
+			i++;
+		}
+		else if (arg == "--merge") {
+			step.op = BatchOp::Merge;
+			options.steps.push_back(step);
+		}
+		else if (arg == "--compact") {
+			step.op = BatchOp::Compact;
+			options.steps.push_back(step);
+		}
+		else if (arg == "--scale") {
+			if (!needs("a factor")) return false;
+			step.op = BatchOp::Scale;
+			step.a = std::max(1, atoi(value));
+
+			const char* mode = strchr(value, ':');
+			if (mode != NULL) {
+				mode++;
+				bool known = false;
+				for (ScaleMode m : { ScaleMode::Nearest, ScaleMode::Scale2x, ScaleMode::Scale3x, ScaleMode::EPX, ScaleMode::XBR })
+					if (SDL_strcasecmp(mode, ScaleModeName(m)) == 0) {
+						step.mode = m;
+						known = true;
+					}
+				if (!known) {
+					fprintf(stderr, "Unknown scale mode %s\n", mode);
+					return false;
+				}
+			}
+			options.steps.push_back(step);
+			i++;
+		}
+		else if (arg == "--shrink") {
+			if (!needs("a factor")) return false;
+			step.op = BatchOp::Shrink;
+			step.a = std::max(1, atoi(value));
+			options.steps.push_back(step);
+			i++;
+		}
+		else if (arg == "--resize") {
+			if (!needs("<w>x<h>") || sscanf(value, "%dx%d", &step.a, &step.b) != 2) return false;
+			if (step.a <= 0 || step.b <= 0) {
+				fprintf(stderr, "Resize needs a size above zero, not %s\n", value);
+				return false;
+			}
+			step.op = BatchOp::Resize;
+			options.steps.push_back(step);
+			i++;
+		}
+		else if (arg == "--format") {
+			if (!needs("png or gif")) return false;
+			options.gif = strcmp(value, "gif") == 0;
+			i++;
+		}
+		else if (arg == "--colours") {
+			if (!needs("a count")) return false;
+			options.quantise.colourCount = (unsigned)std::max(2, std::min(256, atoi(value)));
+			i++;
+		}
+		else if (arg == "--dither") {
+			options.quantise.dither = true;
+		}
+		else if (arg == "--threads") {
+			if (!needs("a count")) return false;
+			options.threads = std::max(1, atoi(value));
+			i++;
+		}
+		else if (arg == "--memory") {
+			if (!needs("a size in MB")) return false;
+			options.memoryLimit = (size_t)std::max(1, atoi(value)) << 20;
+			i++;
+		}
+		else if (arg == "--verify") {
+			options.verify = true;
+		}
+		else if (arg == "--out") {
+			if (!needs("a directory")) return false;
+			options.outDir = value;
+			i++;
+		}
+		else if (arg.size() > 1 && arg[0] == '-') {
+			fprintf(stderr, "Unknown option %s\n", arg.c_str());
+			return false;
+		}
+		else {
+			// Directories are expanded to the images directly inside them
+			std::error_code error;
+			if (std::filesystem::is_directory(arg, error)) {
+				for (const auto& entry : std::filesystem::directory_iterator(arg, error))
+					if (entry.is_regular_file(error) && IsImagePath(entry.path())) options.inputs.push_back(entry.path().string());
+			}
+			else options.inputs.push_back(arg);
+		}
+	}
+
+	return !options.outDir.empty() && !options.inputs.empty();
+}
+
+// Width and height from a PNG's header, without decoding it
+static bool PeekPNGSize(const std::string& path, int& w, int& h) {
+	Uint8 header[24];
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == NULL) return false;
+	bool read = fread(header, 1, sizeof(header), file) == sizeof(header);
+	fclose(file);
+
+	static const Uint8 signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	if (!read || memcmp(header, signature, 8) != 0) return false;
+	Uint32 size[2];
+	memcpy(size, header + 16, sizeof(size));
+	w = (int)SDL_SwapBE32(size[0]);
+	h = (int)SDL_SwapBE32(size[1]);
+	return w > 0 && h > 0;
+}
+
+// Bytes one file will take at its largest: the decoded and converted RGBA copies, the indices, and the biggest
+// the image gets after resampling along with the copy it was resampled from. Files that aren't PNG are guessed from their size.
+static size_t EstimateBytes(const std::string& path, const batchOptions& options) {
+	int w, h;
+	size_t pixels;
+	if (PeekPNGSize(path, w, h)) pixels = (size_t)w * h;
+	else {
+		std::error_code error;
+		auto size = std::filesystem::file_size(path, error);
+		pixels = error ? 0 : (size_t)size * 4;
+	}
+
+	size_t current = pixels, largest = pixels;
+	for (const batchStep& step : options.steps) {
+		if (step.op == BatchOp::Scale) current *= (size_t)step.a * step.a;
+		else if (step.op == BatchOp::Shrink) current = current / ((size_t)step.a * step.a) + 1;
+		else if (step.op == BatchOp::Resize) current = (size_t)step.a * step.b;
+		largest = std::max(largest, current);
+	}
+
+	// Resampling ping-pongs between two buffers of the largest size
+	return pixels * 9 + largest * 3;
+}
+
+static void RunStep(const batchStep& step, indexedImage& image, indexedImage& spare, SelectionMask& visited, std::vector<span>& spans) {
+	switch (step.op) {
+	case BatchOp::Palette:
+		memcpy(image.palette, step.palette, sizeof(image.palette));
+		break;
+	case BatchOp::Replace:
+		ReplaceIndex(image.pixels.data(), image.width, image.height, (Uint8)step.a, (Uint8)step.b);
+		break;
+	case BatchOp::Fill:
+		FloodFill(image.pixels.data(), image.width, image.height, step.a, step.b, (Uint8)step.c, visited, NULL, spans);
+		break;
+	case BatchOp::Sort:
+		ApplyRemap(image, SortPaletteRemap(image.palette, image.locked, step.key));
+		break;
+	case BatchOp::Merge:
+		ApplyRemap(image, MergePaletteRemap(image.palette, image.locked));
+		break;
+	case BatchOp::Compact: {
+		bool used[256];
+		UsedIndices(image.pixels.data(), image.pixels.size(), used);
+		ApplyRemap(image, CompactPaletteRemap(image.palette, image.locked, used));
+		break;
+	}
+	case BatchOp::Scale:
+		ScaleImage(image, step.mode, step.a, spare);
+		std::swap(image, spare);
+		break;
+	case BatchOp::Shrink:
+		ShrinkImage(image, step.a, spare);
+		std::swap(image, spare);
+		break;
+	case BatchOp::Resize:
+		ResizeImage(image, step.a, step.b, spare);
+		std::swap(image, spare);
+		break;
+	}
+}
+
+// What a worker keeps from one file to the next, so its buffers only grow to the largest image it sees
+struct batchWorkspace {
+	indexedImage image, spare;
+	SelectionMask visited;
+	std::vector<span> spans;
+};
+
+// Loads a file and runs every step on it. Loading fills only the palette entries the file has, so the palette
+// is cleared first, or the rest would keep the colours of whichever file the workspace had before.
+static bool ProcessFile(const std::string& path, const batchOptions& options, batchWorkspace& work) {
+	memset(work.image.palette, 0, sizeof(work.image.palette));
+	memset(work.image.locked, 0, sizeof(work.image.locked));
+	if (!LoadIndexedImage(path.c_str(), work.image, options.quantise, true)) {
+		fprintf(stderr, "Unable to load %s: %s\n", path.c_str(), SDL_GetError());
+		return false;
+	}
+
+	for (const batchStep& step : options.steps) RunStep(step, work.image, work.spare, work.visited, work.spans);
+	return true;
+}
+
+// FNV-1a over the size, pixels and palette of a result, so a verify run can compare without keeping them
+static Uint64 ImageHash(const indexedImage& image) {
+	Uint64 hash = 0xCBF29CE484222325ULL;
+	auto add = [&](const void* data, size_t size) {
+		const Uint8* bytes = (const Uint8*)data;
+		for (size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+	};
+
+	add(&image.width, sizeof(image.width));
+	add(&image.height, sizeof(image.height));
+	add(image.pixels.data(), image.pixels.size());
+	add(image.palette, sizeof(image.palette));
+	return hash;
+}
+
+int main(int argc, char* argv[]) {
+	SDL_SetMainReady();
+
+	batchOptions options;
+	if (!ParseArguments(argc, argv, options)) {
+		Usage();
+		return 1;
+	}
+
+	std::error_code error;
+	std::filesystem::create_directories(options.outDir, error);
+
+	int threads = options.threads > 0 ? options.threads : std::max(1, (int)std::thread::hardware_concurrency());
+	threads = std::min(threads, (int)options.inputs.size());
+
+	MemoryBudget budget(options.memoryLimit);
+	std::atomic<size_t> next{ 0 };
+	std::atomic<int> succeeded{ 0 }, failed{ 0 };
+	std::vector<double> busySeconds(threads, 0);
+	std::vector<Uint64> hashes(options.inputs.size(), 0);
+	std::vector<char> hashed(options.inputs.size(), 0);
+
+	auto worker = [&](int index) {
+		batchWorkspace work;
+
+		for (size_t i = next++; i < options.inputs.size(); i = next++) {
+			const std::string& path = options.inputs[i];
+			size_t bytes = EstimateBytes(path, options);
+			budget.Acquire(bytes);
+			auto start = std::chrono::steady_clock::now();
+
+			bool ok = ProcessFile(path, options, work);
+			if (ok) {
+				const indexedImage& image = work.image;
+				if (options.verify) {
+					hashes[i] = ImageHash(image);
+					hashed[i] = 1;
+				}
+
+				std::filesystem::path out = std::filesystem::path(options.outDir) / std::filesystem::path(path).filename();
+				out.replace_extension(options.gif ? ".gif" : ".png");
+				ok = options.gif ? SaveIndexedGIF(image, out.string().c_str()) : SaveIndexedPNG(image, out.string().c_str());
+				if (!ok) fprintf(stderr, "Unable to save %s: %s\n", out.string().c_str(), SDL_GetError());
+			}
+
+			busySeconds[index] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			budget.Release(bytes);
+			(ok ? succeeded : failed)++;
+		}
+	};
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> workers;
+	for (int t = 1; t < threads; t++) workers.emplace_back(worker, t);
+	worker(0);
+	for (std::thread& w : workers) w.join();
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	// Per core throughput divides by the time workers spent on files, so it holds whatever the thread count
+	double busy = 0;
+	for (double s : busySeconds) busy += s;
+	int processed = succeeded + failed;
+	printf("%d files (%d failed) in %.2fs on %d threads: %.1f files/s, %.1f files/s per core\n",
+		processed, (int)failed, elapsed, threads,
+		elapsed > 0 ? processed / elapsed : 0.0, busy > 0 ? processed / busy : 0.0);
+
+	// Going last to first on one thread gives every file a different file before it than the parallel run did
+	int differed = 0;
+	if (options.verify) {
+		batchWorkspace work;
+		for (size_t i = options.inputs.size(); i-- > 0;) {
+			if (!hashed[i]) continue;
+			if (!ProcessFile(options.inputs[i], options, work) || ImageHash(work.image) != hashes[i]) {
+				fprintf(stderr, "%s came out differently on a second run\n", options.inputs[i].c_str());
+				differed++;
+			}
+		}
+		printf("Verified: %d of %d files came out differently\n", differed, (int)succeeded);
+	}
+
+	SDLG::Jobs().Stop();
+	IMG_Quit();
+	SDL_Quit();
+	return failed > 0 ? 2 : differed > 0 ? 3 : 0;
+}
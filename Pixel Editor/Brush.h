@@ -0,0 +1,193 @@
+#pragma once
+
+#include <SDL.h>
+
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <climits>
+
+#include "Raster.h"
+
+enum class BrushShape {
+	Square,
+	Circle,
+	Custom
+};
+
+// A brush footprint as spans relative to the pixel it is centred on
+struct brushStamp {
+	std::vector<span> rows;
+	SDL_Rect extent;  // Bounding box of the rows, relative to the centre
+	bool convex;      // One span per row, so a swept stroke is one span per row too
+};
+
+class Brush {
+private:
+	BrushShape shape = BrushShape::Square;
+	int size = 1;
+
+	std::vector<Uint8> customMask;
+	int customW = 0, customH = 0;
+
+	// Stamps are built once per shape and size
+	std::map<int, brushStamp> stamps;
+
+	std::vector<span> lineSpans;
+	std::vector<int> rowMin, rowMax;
+
+	int StampKey() const {
+		return size * 3 + (int)shape;
+	}
+
+	bool Covered(int x, int y) const {
+		int half = (size - 1) / 2;
+		int dx = x + half, dy = y + half;
+
+		switch (shape) {
+		case BrushShape::Circle: {
+			float c = (size - 1) / 2.0f;
+			float r = size / 2.0f;
+			float fx = dx - c, fy = dy - c;
+			return fx * fx + fy * fy <= r * r - r * 0.5f;
+		}
+		case BrushShape::Custom: {
+			if (customW <= 0 || customH <= 0) return true;
+			// Nearest neighbour, scaled so the longer side of the mask spans the brush
+			int scale = std::max(customW, customH);
+			int mx = dx * scale / size - (scale - customW) / 2;
+			int my = dy * scale / size - (scale - customH) / 2;
+			return mx >= 0 && my >= 0 && mx < customW && my < customH && customMask[my * customW + mx];
+		}
+		default:
+			return true;
+		}
+	}
+
+	brushStamp BuildStamp() const {
+		brushStamp stamp;
+		stamp.convex = shape != BrushShape::Custom;
+
+		int lo = -(size - 1) / 2;
+		int hi = lo + size;
+		stamp.extent = { hi, hi, 0, 0 };
+		int right = lo, bottom = lo;
+
+		for (int y = lo; y < hi; y++) {
+			int x = lo;
+			while (x < hi) {
+				while (x < hi && !Covered(x, y)) x++;
+				if (x >= hi) break;
+				int start = x;
+				while (x < hi && Covered(x, y)) x++;
+				stamp.rows.push_back({ y, start, x });
+
+				stamp.extent.x = std::min(stamp.extent.x, start);
+				stamp.extent.y = std::min(stamp.extent.y, y);
+				right = std::max(right, x);
+				bottom = std::max(bottom, y + 1);
+			}
+		}
+
+		if (stamp.rows.empty()) {
+			stamp.rows.push_back({ 0, 0, 1 });
+			stamp.extent = { 0, 0, 1, 1 };
+		}
+		else {
+			stamp.extent.w = right - stamp.extent.x;
+			stamp.extent.h = bottom - stamp.extent.y;
+		}
+
+		return stamp;
+	}
+
+public:
+	BrushShape GetShape() const {
+		return shape;
+	}
+
+	int GetSize() const {
+		return size;
+	}
+
+	void SetShape(BrushShape s) {
+		shape = s;
+	}
+
+	void SetSize(int s) {
+		size = std::max(1, std::min(s, 256));
+	}
+
+	// Any non-zero byte of the w*h mask is painted. Replaces the cached custom stamps.
+	void SetCustomMask(const Uint8* mask, int w, int h) {
+		customMask.assign(mask, mask + w * h);
+		customW = w;
+		customH = h;
+
+		for (auto it = stamps.begin(); it != stamps.end();) {
+			if (it->first % 3 == (int)BrushShape::Custom) it = stamps.erase(it);
+			else ++it;
+		}
+	}
+
+	const brushStamp& GetStamp() {
+		auto it = stamps.find(StampKey());
+		if (it == stamps.end()) it = stamps.emplace(StampKey(), BuildStamp()).first;
+		return it->second;
+	}
+
+	// Sweeps the brush from one point to another, appending the covered spans clipped to clip.
+	// Convex brushes give at most one span per row.
+	void Stroke(int x0, int y0, int x1, int y1, SDL_Rect clip, std::vector<span>& out) {
+		const brushStamp& stamp = GetStamp();
+
+		// Clip the centre line against the area the brush could still reach
+		SDL_Rect reach = {
+			clip.x - (stamp.extent.x + stamp.extent.w - 1),
+			clip.y - (stamp.extent.y + stamp.extent.h - 1),
+			clip.w + stamp.extent.w - 1,
+			clip.h + stamp.extent.h - 1
+		};
+		int first, last;
+		if (!ClipLineSteps(x0, y0, x1, y1, reach, first, last)) return;
+
+		lineSpans.clear();
+		LineSpans(x0, y0, x1, y1, lineSpans, first, last);
+		if (lineSpans.empty()) return;
+
+		// Sweeping one stamp span along one run of the line covers a single interval
+		if (!stamp.convex) {
+			size_t begin = out.size();
+			for (const span& l : lineSpans)
+				for (const span& s : stamp.rows)
+					out.push_back({ l.y + s.y, l.x0 + s.x0, l.x1 - 1 + s.x1 });
+
+			ClipSpans(out, clip, begin);
+			return;
+		}
+
+		// A convex brush swept along a line is convex, so each row is the union of its intervals
+		int lineTop = std::min(lineSpans.front().y, lineSpans.back().y);
+		int lineBottom = std::max(lineSpans.front().y, lineSpans.back().y);
+		int top = lineTop + stamp.extent.y;
+		int rows = lineBottom - lineTop + stamp.extent.h;
+		rowMin.assign(rows, INT_MAX);
+		rowMax.assign(rows, INT_MIN);
+
+		for (const span& l : lineSpans)
+			for (const span& s : stamp.rows) {
+				int row = l.y + s.y - top;
+				rowMin[row] = std::min(rowMin[row], l.x0 + s.x0);
+				rowMax[row] = std::max(rowMax[row], l.x1 - 1 + s.x1);
+			}
+
+		for (int row = 0; row < rows; row++) {
+			int y = top + row;
+			if (rowMin[row] > rowMax[row] || y < clip.y || y >= clip.y + clip.h) continue;
+
+			int a = std::max(rowMin[row], clip.x);
+			int b = std::min(rowMax[row], clip.x + clip.w);
+			if (a < b) out.push_back({ y, a, b });
+		}
+	}
+};
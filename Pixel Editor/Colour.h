@@ -0,0 +1,119 @@
+#pragma once
+
+#include <SDL.h>
+
+#include "SIMD.h"
+
+// Hue runs over 6 sectors of 256 steps
+#define HUE_RANGE 1536
+
+// x * y / 255, rounded, exact for 0 <= x, y <= 255
+static inline int MulDiv255(int x, int y) {
+	int t = x * y + 128;
+	return (t + (t >> 8)) >> 8;
+}
+
+static inline Uint32 HSVPixel(int hue, int saturation, int value) {
+	//   _    _
+	//R:  \__/
+
+	//    __
+	//G: /  \__
+
+	//      __
+	//B: __/  \
+
+	//Hue ->
+
+	int r = abs(hue - 768) - 256;
+	int g = 512 - abs(hue - 512);
+	int b = 512 - abs(hue - 1024);
+	r = r < 0 ? 0 : r > 255 ? 255 : r;
+	g = g < 0 ? 0 : g > 255 ? 255 : g;
+	b = b < 0 ? 0 : b > 255 ? 255 : b;
+
+	r = MulDiv255(255 - MulDiv255(255 - r, saturation), value);
+	g = MulDiv255(255 - MulDiv255(255 - g, saturation), value);
+	b = MulDiv255(255 - MulDiv255(255 - b, saturation), value);
+
+	return (Uint32)r | (Uint32)g << 8 | (Uint32)b << 16 | 0xFF000000;
+}
+
+#ifdef SIMD_SSE2
+static inline __m128i MulDiv255(__m128i x, __m128i y) {
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(x, y), _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static inline __m128i ClampChannel(__m128i x) {
+	return _mm_min_epi16(_mm_max_epi16(x, _mm_setzero_si128()), _mm_set1_epi16(255));
+}
+
+static inline __m128i Abs16(__m128i x) {
+	return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+#endif
+
+// Converts a run of pixels to RGBA32. Hue (0 to HUE_RANGE-1) and saturation (0 to 255) vary per pixel, value is shared.
+// Eight pixels are converted per iteration where SSE2 is available.
+static void HSVToRGBA(const Sint16* hue, const Sint16* saturation, int value, Uint32* out, int count) {
+	int i = 0;
+
+#ifdef SIMD_SSE2
+	const __m128i v = _mm_set1_epi16((short)value);
+	const __m128i full = _mm_set1_epi16(255);
+	const __m128i alpha = _mm_set1_epi16((short)0xFF00);
+
+	for (; i + 8 <= count; i += 8) {
+		__m128i h = _mm_loadu_si128((const __m128i*)(hue + i));
+		__m128i s = _mm_loadu_si128((const __m128i*)(saturation + i));
+
+		__m128i r = ClampChannel(_mm_sub_epi16(Abs16(_mm_sub_epi16(h, _mm_set1_epi16(768))), _mm_set1_epi16(256)));
+		__m128i g = ClampChannel(_mm_sub_epi16(_mm_set1_epi16(512), Abs16(_mm_sub_epi16(h, _mm_set1_epi16(512)))));
+		__m128i b = ClampChannel(_mm_sub_epi16(_mm_set1_epi16(512), Abs16(_mm_sub_epi16(h, _mm_set1_epi16(1024)))));
+
+		r = MulDiv255(_mm_sub_epi16(full, MulDiv255(_mm_sub_epi16(full, r), s)), v);
+		g = MulDiv255(_mm_sub_epi16(full, MulDiv255(_mm_sub_epi16(full, g), s)), v);
+		b = MulDiv255(_mm_sub_epi16(full, MulDiv255(_mm_sub_epi16(full, b), s)), v);
+
+		__m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+		__m128i ba = _mm_or_si128(b, alpha);
+
+		_mm_storeu_si128((__m128i*)(out + i), _mm_unpacklo_epi16(rg, ba));
+		_mm_storeu_si128((__m128i*)(out + i + 4), _mm_unpackhi_epi16(rg, ba));
+	}
+#endif
+
+	for (; i < count; i++)
+		out[i] = HSVPixel(hue[i], saturation[i], value);
+}
+
+// h is a fraction of a full turn, saturation and value run from 0 to 1
+static SDL_Colour HSVColour(float h, float saturation, float value) {
+	int hue = (int)floor(h * HUE_RANGE) % HUE_RANGE;
+	if (hue < 0) hue += HUE_RANGE;
+
+	Uint32 pixel = HSVPixel(hue, (int)(saturation * 255 + 0.5f), (int)(value * 255 + 0.5f));
+	return { (Uint8)pixel, (Uint8)(pixel >> 8), (Uint8)(pixel >> 16), 255 };
+}
+
+// Inverse of HSVPixel, giving hue in 0 to HUE_RANGE-1 and saturation and value in 0 to 255
+static void RGBToHSV(SDL_Colour c, int& hue, int& saturation, int& value) {
+	int max = c.r > c.g ? (c.r > c.b ? c.r : c.b) : (c.g > c.b ? c.g : c.b);
+	int min = c.r < c.g ? (c.r < c.b ? c.r : c.b) : (c.g < c.b ? c.g : c.b);
+	int delta = max - min;
+
+	value = max;
+	saturation = max == 0 ? 0 : (delta * 255 + max / 2) / max;
+
+	if (delta == 0) {
+		hue = 0;
+		return;
+	}
+
+	if (max == c.r) hue = (c.g - c.b) * 256 / delta;
+	else if (max == c.g) hue = 512 + (c.b - c.r) * 256 / delta;
+	else hue = 1024 + (c.r - c.g) * 256 / delta;
+
+	if (hue < 0) hue += HUE_RANGE;
+}
@@ -0,0 +1,444 @@
+#pragma once
+
+#include <SDL.h>
+#include <SDL_image.h>
+
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <climits>
+#include <mutex>
+
+#include "Jobs.h"
+#include "Packed.h"
+#include "Skyline.h"
+#include "Timeline.h"
+
+// GIF
+
+// Variable width codes packed least significant bit first, then cut into sub-blocks of up to 255 bytes
+class LZWBitWriter {
+private:
+	std::vector<Uint8> bytes;
+	Uint32 buffer = 0;
+	int bits = 0;
+
+public:
+	void Write(int code, int size) {
+		buffer |= (Uint32)code << bits;
+		bits += size;
+		while (bits >= 8) {
+			bytes.push_back((Uint8)buffer);
+			buffer >>= 8;
+			bits -= 8;
+		}
+	}
+
+	void Finish(std::vector<Uint8>& out) {
+		if (bits > 0) bytes.push_back((Uint8)buffer);
+
+		for (size_t i = 0; i < bytes.size(); i += 255) {
+			size_t n = std::min<size_t>(255, bytes.size() - i);
+			out.push_back((Uint8)n);
+			out.insert(out.end(), bytes.begin() + i, bytes.begin() + i + n);
+		}
+		out.push_back(0);
+	}
+};
+
+#define LZW_MAX_CODES 4096
+#define LZW_HASH_SIZE 8192
+
+// GIF flavoured LZW of indices below 1 << minCodeSize, appending the minimum code size byte, the sub-blocks and the
+// terminator. Strings are looked up in an open addressed table of (prefix, byte) pairs that is cleared with the dictionary.
+static void LZWEncode(const Uint8* pixels, size_t count, std::vector<Uint8>& out, int minCodeSize = 8) {
+	const int clearCode = 1 << minCodeSize;
+	const int endCode = clearCode + 1;
+
+	std::vector<Sint32> keys(LZW_HASH_SIZE);
+	std::vector<Uint16> codes(LZW_HASH_SIZE);
+
+	LZWBitWriter writer;
+	int codeSize = minCodeSize + 1;
+	int nextCode = endCode + 1;
+
+	auto reset = [&]() {
+		std::fill(keys.begin(), keys.end(), -1);
+		codeSize = minCodeSize + 1;
+		nextCode = endCode + 1;
+	};
+
+	out.push_back(minCodeSize);
+	reset();
+	writer.Write(clearCode, codeSize);
+
+	if (count == 0) {
+		writer.Write(endCode, codeSize);
+		writer.Finish(out);
+		return;
+	}
+
+	int prefix = pixels[0];
+	for (size_t i = 1; i < count; i++) {
+		Uint8 c = pixels[i];
+		Sint32 key = prefix << 8 | c;
+
+		size_t slot = ((Uint32)key * 2654435761u) >> 19;
+		while (keys[slot] != -1 && keys[slot] != key) slot = (slot + 1) & (LZW_HASH_SIZE - 1);
+
+		if (keys[slot] == key) {
+			prefix = codes[slot];
+			continue;
+		}
+
+		writer.Write(prefix, codeSize);
+
+		// The decoder adds its entries a code behind, so the width grows one code later than the table does
+		keys[slot] = key;
+		codes[slot] = (Uint16)nextCode++;
+		if (nextCode > (1 << codeSize) && codeSize < 12) codeSize++;
+
+		if (nextCode >= LZW_MAX_CODES) {
+			writer.Write(clearCode, codeSize);
+			reset();
+		}
+
+		prefix = c;
+	}
+
+	writer.Write(prefix, codeSize);
+	writer.Write(endCode, codeSize);
+	writer.Finish(out);
+}
+
+struct gifFrame {
+	SDL_Rect area;             // Part of the image this frame redraws
+	int delay;                 // Centiseconds
+	bool skip;                 // Identical to the frame before, its time is added to that frame
+	std::vector<Uint8> pixels; // area.w * area.h indices, the transparent index where nothing changed
+	std::vector<Uint8> encoded;
+};
+
+static void PutLE16(std::vector<Uint8>& out, int value) {
+	out.push_back((Uint8)value);
+	out.push_back((Uint8)(value >> 8));
+}
+
+// Smallest rectangle holding every pixel that differs between two frames.
+// Tiles the two frames share are skipped without looking at their pixels.
+static SDL_Rect FrameDifference(const Timeline& timeline, int a, int b, const Uint8* imageA, const Uint8* imageB) {
+	const std::vector<int>& tilesA = timeline.GetFrame(a).tiles;
+	const std::vector<int>& tilesB = timeline.GetFrame(b).tiles;
+	int width = timeline.GetWidth();
+
+	int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+	for (int ty = 0; ty < timeline.GetTilesY(); ty++)
+		for (int tx = 0; tx < timeline.GetTilesX(); tx++) {
+			size_t t = (size_t)ty * timeline.GetTilesX() + tx;
+			if (tilesA[t] == tilesB[t]) continue;
+
+			SDL_Rect r = timeline.TileRect(tx, ty);
+			for (int y = r.y; y < r.y + r.h; y++) {
+				const Uint8* rowA = imageA + (size_t)y * width;
+				const Uint8* rowB = imageB + (size_t)y * width;
+				for (int x = r.x; x < r.x + r.w; x++) {
+					if (rowA[x] == rowB[x]) continue;
+					x0 = std::min(x0, x);
+					x1 = std::max(x1, x + 1);
+					y0 = std::min(y0, y);
+					y1 = std::max(y1, y + 1);
+				}
+			}
+		}
+
+	if (x0 > x1) return { 0,0,0,0 };
+	return { x0, y0, x1 - x0, y1 - y0 };
+}
+
+// Writes every frame of the timeline as a looping GIF. After the first, each frame only redraws the rectangle
+// that changed, with unchanged pixels inside it set to a palette index the animation never uses, when there is one.
+// Diffing and compression run a band of frames per core.
+static bool ExportGIF(const Timeline& timeline, const SDL_Colour* palette, const char* path) {
+	int width = timeline.GetWidth();
+	int height = timeline.GetHeight();
+	int count = timeline.GetFrameCount();
+	size_t frameSize = (size_t)width * height;
+
+	std::vector<Uint8> images(frameSize * count);
+	std::vector<gifFrame> frames(count);
+
+	// Expand the frames and count which indices appear
+	std::vector<int> usage(256, 0);
+	std::mutex usageLock;
+	SDLG::ParallelFor(0, count, [&](int f0, int f1) {
+		int used[256] = {};
+		for (int f = f0; f < f1; f++) {
+			Uint8* image = images.data() + frameSize * f;
+			timeline.Extract(f, image);
+			for (size_t i = 0; i < frameSize; i++) used[image[i]] = 1;
+		}
+
+		std::lock_guard<std::mutex> hold(usageLock);
+		for (int i = 0; i < 256; i++) usage[i] |= used[i];
+	});
+
+	// The lowest free index keeps the colour table, and the codes, as small as the art allows
+	int transparent = -1;
+	int highest = 0;
+	for (int i = 0; i < 256; i++) {
+		if (usage[i]) highest = i;
+		else if (transparent < 0) transparent = i;
+	}
+
+	int depth = PackedDepth(std::max(highest, transparent) + 1);
+	int codeSize = std::max(2, depth); // GIF has no 1-bit code size
+
+	// Delays are rounded from the running time, so long animations keep their length
+	int elapsed = 0;
+	for (int f = 0; f < count; f++) {
+		int start = (elapsed + 5) / 10;
+		elapsed += timeline.GetFrame(f).duration;
+		frames[f].delay = (elapsed + 5) / 10 - start;
+	}
+
+	SDLG::ParallelFor(0, count, [&](int f0, int f1) {
+		for (int f = f0; f < f1; f++) {
+			gifFrame& frame = frames[f];
+			const Uint8* image = images.data() + frameSize * f;
+			const Uint8* previous = f > 0 ? image - frameSize : NULL;
+
+			frame.area = f == 0 ? SDL_Rect{ 0, 0, width, height } : FrameDifference(timeline, f - 1, f, previous, image);
+			frame.skip = frame.area.w <= 0;
+			if (frame.skip) continue;
+
+			SDL_Rect a = frame.area;
+			frame.pixels.resize((size_t)a.w * a.h);
+			for (int y = 0; y < a.h; y++) {
+				const Uint8* in = image + (size_t)(a.y + y) * width + a.x;
+				Uint8* out = frame.pixels.data() + (size_t)y * a.w;
+				memcpy(out, in, a.w);
+
+				if (previous != NULL && transparent >= 0) {
+					const Uint8* before = previous + (size_t)(a.y + y) * width + a.x;
+					for (int x = 0; x < a.w; x++)
+						if (out[x] == before[x]) out[x] = (Uint8)transparent;
+				}
+			}
+
+			LZWEncode(frame.pixels.data(), frame.pixels.size(), frame.encoded, codeSize);
+			std::vector<Uint8>().swap(frame.pixels);
+		}
+	});
+
+	// Frames that changed nothing lend their time to the frame before
+	for (int f = count - 1; f > 0; f--)
+		if (frames[f].skip) {
+			int g = f - 1;
+			while (g > 0 && frames[g].skip) g--;
+			frames[g].delay += frames[f].delay;
+			frames[f].delay = 0;
+		}
+
+	std::vector<Uint8> out;
+	const char* header = "GIF89a";
+	out.insert(out.end(), header, header + 6);
+	PutLE16(out, width);
+	PutLE16(out, height);
+	out.push_back((Uint8)(0xF0 | (depth - 1))); // Global colour table of 1 << depth entries, 8 bits per channel
+	out.push_back(0);
+	out.push_back(0);
+	for (int i = 0; i < 1 << depth; i++) {
+		out.push_back(palette[i].r);
+		out.push_back(palette[i].g);
+		out.push_back(palette[i].b);
+	}
+
+	// Loop forever
+	const Uint8 loop[] = { 0x21, 0xFF, 0x0B, 'N','E','T','S','C','A','P','E','2','.','0', 0x03, 0x01, 0x00, 0x00, 0x00 };
+	out.insert(out.end(), loop, loop + sizeof(loop));
+
+	SDL_RWops* file = SDL_RWFromFile(path, "wb");
+	if (file == NULL) return false;
+
+	bool written = SDL_RWwrite(file, out.data(), 1, out.size()) == out.size();
+
+	for (int f = 0; f < count && written; f++) {
+		const gifFrame& frame = frames[f];
+		if (frame.skip) continue;
+
+		out.clear();
+
+		// Graphic control: leave the frame in place, optionally with a transparent index
+		bool hasTransparency = f > 0 && transparent >= 0;
+		out.push_back(0x21);
+		out.push_back(0xF9);
+		out.push_back(4);
+		out.push_back((Uint8)(1 << 2 | (hasTransparency ? 1 : 0)));
+		PutLE16(out, frame.delay);
+		out.push_back(hasTransparency ? (Uint8)transparent : 0);
+		out.push_back(0);
+
+		out.push_back(0x2C);
+		PutLE16(out, frame.area.x);
+		PutLE16(out, frame.area.y);
+		PutLE16(out, frame.area.w);
+		PutLE16(out, frame.area.h);
+		out.push_back(0);
+
+		written = SDL_RWwrite(file, out.data(), 1, out.size()) == out.size() &&
+			SDL_RWwrite(file, frame.encoded.data(), 1, frame.encoded.size()) == frame.encoded.size();
+	}
+
+	const Uint8 trailer = 0x3B;
+	written = written && SDL_RWwrite(file, &trailer, 1, 1) == 1;
+	SDL_RWclose(file);
+	return written;
+}
+
+// Sprite sheets
+
+struct sheetSprite {
+	SDL_Rect trim;  // Part of the frame kept, in frame coordinates
+	SDL_Point at;   // Position in the sheet
+	int sameAs;     // Earlier frame with identical pixels sharing its placement, or -1
+};
+
+// Smallest rectangle of a frame holding anything other than the background index
+static SDL_Rect TrimFrame(const Uint8* image, int width, int height, Uint8 background) {
+	int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+	for (int y = 0; y < height; y++) {
+		const Uint8* row = image + (size_t)y * width;
+		int first = 0, last = width - 1;
+		while (first < width && row[first] == background) first++;
+		if (first == width) continue;
+		while (row[last] == background) last--;
+
+		x0 = std::min(x0, first);
+		x1 = std::max(x1, last + 1);
+		y0 = std::min(y0, y);
+		y1 = y + 1;
+	}
+
+	if (x0 > x1) return { 0,0,1,1 };
+	return { x0, y0, x1 - x0, y1 - y0 };
+}
+
+// Packs every frame, trimmed of the background index, into one indexed PNG and writes a JSON atlas beside it
+// describing where each frame went. Identical frames share a sprite. Trimming and copying run across cores.
+static bool ExportSpriteSheet(const Timeline& timeline, const SDL_Colour* palette, Uint8 background, const char* imagePath, const char* jsonPath) {
+	int width = timeline.GetWidth();
+	int height = timeline.GetHeight();
+	int count = timeline.GetFrameCount();
+	size_t frameSize = (size_t)width * height;
+
+	std::vector<Uint8> images(frameSize * count);
+	std::vector<sheetSprite> sprites(count);
+
+	std::map<std::vector<int>, int> firstWithTiles;
+	for (int f = 0; f < count; f++) {
+		auto found = firstWithTiles.emplace(timeline.GetFrame(f).tiles, f);
+		sprites[f].sameAs = found.second ? -1 : found.first->second;
+	}
+
+	SDLG::ParallelFor(0, count, [&](int f0, int f1) {
+		for (int f = f0; f < f1; f++) {
+			if (sprites[f].sameAs >= 0) continue;
+			Uint8* image = images.data() + frameSize * f;
+			timeline.Extract(f, image);
+			sprites[f].trim = TrimFrame(image, width, height, background);
+		}
+	});
+
+	// Tallest first packs tightest, into a power of two wide enough for the widest sprite and about square
+	std::vector<int> order;
+	long long area = 0;
+	int widest = 1;
+	for (int f = 0; f < count; f++) {
+		if (sprites[f].sameAs >= 0) continue;
+		order.push_back(f);
+		area += (long long)(sprites[f].trim.w + 1) * (sprites[f].trim.h + 1);
+		widest = std::max(widest, sprites[f].trim.w + 1);
+	}
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+		return sprites[a].trim.h > sprites[b].trim.h;
+	});
+
+	int sheetW = 1;
+	while (sheetW < widest || (long long)sheetW * sheetW < area) sheetW *= 2;
+
+	SkylinePacker packer(sheetW);
+	for (int f : order) sprites[f].at = packer.Insert(sprites[f].trim.w + 1, sprites[f].trim.h + 1);
+	for (int f = 0; f < count; f++)
+		if (sprites[f].sameAs >= 0) {
+			sprites[f].trim = sprites[sprites[f].sameAs].trim;
+			sprites[f].at = sprites[sprites[f].sameAs].at;
+		}
+	int sheetH = std::max(1, packer.Height());
+
+	SDL_Surface* sheet = SDL_CreateRGBSurfaceWithFormat(0, sheetW, sheetH, 8, SDL_PIXELFORMAT_INDEX8);
+	if (sheet == NULL) return false;
+	SDL_SetPaletteColors(sheet->format->palette, palette, 0, 256);
+	SDL_FillRect(sheet, NULL, background);
+
+	SDLG::ParallelFor(0, (int)order.size(), [&](int i0, int i1) {
+		for (int i = i0; i < i1; i++) {
+			const sheetSprite& s = sprites[order[i]];
+			const Uint8* image = images.data() + frameSize * order[i];
+			for (int y = 0; y < s.trim.h; y++)
+				memcpy((Uint8*)sheet->pixels + (size_t)(s.at.y + y) * sheet->pitch + s.at.x,
+					image + (size_t)(s.trim.y + y) * width + s.trim.x, s.trim.w);
+		}
+	});
+
+	bool saved = IMG_SavePNG(sheet, imagePath) == 0;
+	SDL_FreeSurface(sheet);
+	if (!saved) return false;
+
+	// Same layout as TexturePacker's JSON hash format, which most engines read
+	std::string image = imagePath;
+	size_t slash = image.find_last_of("/\\");
+	if (slash != std::string::npos) image = image.substr(slash + 1);
+
+	std::string json = "{\n\t\"frames\": {\n";
+	for (int f = 0; f < count; f++) {
+		const sheetSprite& s = sprites[f];
+		char entry[512];
+		snprintf(entry, sizeof(entry),
+			"\t\t\"frame%d\": {\n"
+			"\t\t\t\"frame\": { \"x\": %d, \"y\": %d, \"w\": %d, \"h\": %d },\n"
+			"\t\t\t\"rotated\": false,\n"
+			"\t\t\t\"trimmed\": %s,\n"
+			"\t\t\t\"spriteSourceSize\": { \"x\": %d, \"y\": %d, \"w\": %d, \"h\": %d },\n"
+			"\t\t\t\"sourceSize\": { \"w\": %d, \"h\": %d },\n"
+			"\t\t\t\"duration\": %d\n"
+			"\t\t}%s\n",
+			f, s.at.x, s.at.y, s.trim.w, s.trim.h,
+			(s.trim.w != width || s.trim.h != height) ? "true" : "false",
+			s.trim.x, s.trim.y, s.trim.w, s.trim.h,
+			width, height,
+			timeline.GetFrame(f).duration,
+			f + 1 < count ? "," : "");
+		json += entry;
+	}
+
+	char meta[512];
+	snprintf(meta, sizeof(meta),
+		"\t},\n"
+		"\t\"meta\": {\n"
+		"\t\t\"image\": \"%s\",\n"
+		"\t\t\"format\": \"I8\",\n"
+		"\t\t\"size\": { \"w\": %d, \"h\": %d },\n"
+		"\t\t\"scale\": \"1\"\n"
+		"\t}\n"
+		"}\n",
+		image.c_str(), sheetW, sheetH);
+	json += meta;
+
+	SDL_RWops* file = SDL_RWFromFile(jsonPath, "wb");
+	if (file == NULL) return false;
+	bool written = SDL_RWwrite(file, json.data(), 1, json.size()) == json.size();
+	SDL_RWclose(file);
+	return written;
+}
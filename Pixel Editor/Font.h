@@ -0,0 +1,191 @@
+#pragma once
+
+#include <SDL.h>
+#include <SDL_image.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "SDLG.h"
+
+using namespace SDLG;
+
+struct textCharacter {
+	SDL_Rect src;
+	SDL_FRect dst; // x/y is the offset, and w/h is a proportion of the scale, both relative to the scale of the text.
+	float advance; // Distance the pen moves after this character, relative to the scale of the text.
+};
+
+struct textLayout {
+	textCharacter characters[256];
+};
+
+struct textFont {
+	SDL_Texture* atlas = NULL;
+	textLayout layout;
+};
+
+// Built in 3x5 font, one glyph per printable ASCII character from ' ' to '`'.
+// Rows are 3 bits each, top row in the highest bits. Lower case letters borrow the upper case glyphs.
+#define BUILTIN_GLYPH_FIRST ' '
+#define BUILTIN_GLYPH_COUNT 65
+#define BUILTIN_GLYPH_W 3
+#define BUILTIN_GLYPH_H 5
+
+static const Uint16 builtinGlyphs[BUILTIN_GLYPH_COUNT] = {
+	0x0000, 0x2482, 0x5A00, 0x5F7D, 0x3C9E, 0x42A1, 0x2AAB, 0x2400, //  !"#$%&'
+	0x1491, 0x4494, 0x0AA8, 0x05D0, 0x0014, 0x01C0, 0x0002, 0x12A4, // ()*+,-./
+	0x7B6F, 0x2C97, 0x73E7, 0x73CF, 0x5BC9, 0x79CF, 0x79EF, 0x7252, // 01234567
+	0x7BEF, 0x7BCF, 0x0410, 0x0414, 0x1511, 0x0E38, 0x4454, 0x72C2, // 89:;<=>?
+	0x7B67, 0x2BED, 0x6BAE, 0x3923, 0x6B6E, 0x79A7, 0x79A4, 0x396B, // @ABCDEFG
+	0x5BED, 0x7497, 0x126A, 0x5BAD, 0x4927, 0x5FED, 0x6B6D, 0x2B6A, // HIJKLMNO
+	0x6BA4, 0x2B73, 0x6BAD, 0x388E, 0x7492, 0x5B6F, 0x5B6A, 0x5BFD, // PQRSTUVW
+	0x5AAD, 0x5A92, 0x72A7, 0x6926, 0x4889, 0x324B, 0x2A00, 0x0007, // XYZ[\]^_
+	0x4400,                                                         // `
+};
+
+struct glyphPlacement {
+	int character;
+	SDL_Rect cell; // Trimmed glyph within the sheet
+};
+
+// Packs every trimmed glyph of a font sheet into one texture and fills in the layout.
+// The sheet is a grid of cols*rows equal cells, cell i holding character i. Glyphs are taken from the alpha channel.
+static bool BuildFontFromSheet(SDL_Surface* sheet, int cols, int rows, textFont& font) {
+	SDL_Surface* rgba = SDL_ConvertSurfaceFormat(sheet, SDL_PIXELFORMAT_RGBA32, 0);
+	if (rgba == NULL) return false;
+
+	int cellW = rgba->w / cols;
+	int cellH = rgba->h / rows;
+	if (cellW <= 0 || cellH <= 0) {
+		SDL_FreeSurface(rgba);
+		return false;
+	}
+
+	SDL_LockSurface(rgba);
+	auto alpha = [&](int x, int y) { return ((Uint8*)rgba->pixels)[y * rgba->pitch + x * 4 + 3]; };
+
+	std::vector<glyphPlacement> glyphs;
+	memset(&font.layout, 0, sizeof(font.layout));
+
+	for (int c = 0; c < 256 && c < cols * rows; c++) {
+		int x0 = (c % cols) * cellW;
+		int y0 = (c / cols) * cellH;
+
+		SDL_Rect trim = { cellW, cellH, -1, -1 };
+		for (int y = 0; y < cellH; y++)
+			for (int x = 0; x < cellW; x++) {
+				if (alpha(x0 + x, y0 + y) == 0) continue;
+				trim.x = std::min(trim.x, x);
+				trim.y = std::min(trim.y, y);
+				trim.w = std::max(trim.w, x);
+				trim.h = std::max(trim.h, y);
+			}
+
+		textCharacter& character = font.layout.characters[c];
+
+		// Empty cells still advance, so spaces work
+		if (trim.w < 0) {
+			character.advance = (cellW / 2) / (float)cellH;
+			continue;
+		}
+
+		trim.w = trim.w - trim.x + 1;
+		trim.h = trim.h - trim.y + 1;
+
+		character.dst = { 0, trim.y / (float)cellH, trim.w / (float)cellH, trim.h / (float)cellH };
+		character.advance = (trim.w + 1) / (float)cellH;
+
+		glyphs.push_back({ c, { x0 + trim.x, y0 + trim.y, trim.w, trim.h } });
+	}
+
+	// Shelf packing, tallest glyphs first, with a pixel of padding so filtering never bleeds
+	std::sort(glyphs.begin(), glyphs.end(), [](const glyphPlacement& a, const glyphPlacement& b) {
+		return a.cell.h > b.cell.h;
+	});
+
+	int area = 0;
+	for (auto& g : glyphs) area += (g.cell.w + 1) * (g.cell.h + 1);
+	int atlasW = 64;
+	while (atlasW * atlasW < area) atlasW *= 2;
+
+	int penX = 0, penY = 0, shelfH = 0;
+	for (auto& g : glyphs) {
+		if (penX + g.cell.w > atlasW) {
+			penX = 0;
+			penY += shelfH + 1;
+			shelfH = 0;
+		}
+		font.layout.characters[g.character].src = { penX, penY, g.cell.w, g.cell.h };
+		penX += g.cell.w + 1;
+		shelfH = std::max(shelfH, g.cell.h);
+	}
+	int atlasH = std::max(1, penY + shelfH);
+
+	SDL_Surface* atlas = SDL_CreateRGBSurfaceWithFormat(0, atlasW, atlasH, 32, SDL_PIXELFORMAT_RGBA32);
+	SDL_FillRect(atlas, NULL, 0);
+
+	// Glyphs are stored white so the vertex colour tints them
+	for (auto& g : glyphs) {
+		SDL_Rect dst = font.layout.characters[g.character].src;
+		for (int y = 0; y < g.cell.h; y++) {
+			Uint32* out = (Uint32*)((Uint8*)atlas->pixels + (dst.y + y) * atlas->pitch) + dst.x;
+			for (int x = 0; x < g.cell.w; x++) {
+				Uint8 a = alpha(g.cell.x + x, g.cell.y + y);
+				Uint8* px = (Uint8*)(out + x);
+				px[0] = px[1] = px[2] = 255;
+				px[3] = a;
+			}
+		}
+	}
+
+	SDL_UnlockSurface(rgba);
+	SDL_FreeSurface(rgba);
+
+	if (font.atlas != NULL) SDL_DestroyTexture(font.atlas);
+	font.atlas = SDL_CreateTextureFromSurface(gameRenderer, atlas);
+	SDL_SetTextureBlendMode(font.atlas, SDL_BLENDMODE_BLEND);
+	SDL_FreeSurface(atlas);
+
+	return font.atlas != NULL;
+}
+
+static bool LoadFontSheet(const char* path, int cols, int rows, textFont& font) {
+	SDL_Surface* sheet = IMG_Load(path);
+	if (sheet == NULL) return false;
+
+	bool loaded = BuildFontFromSheet(sheet, cols, rows, font);
+	SDL_FreeSurface(sheet);
+	return loaded;
+}
+
+// Expands the built in glyphs into a 16x16 sheet with a 4x6 cell and packs it like any other font
+static bool CreateBuiltinFont(textFont& font) {
+	const int cellW = BUILTIN_GLYPH_W + 1;
+	const int cellH = BUILTIN_GLYPH_H + 1;
+
+	SDL_Surface* sheet = SDL_CreateRGBSurfaceWithFormat(0, cellW * 16, cellH * 16, 32, SDL_PIXELFORMAT_RGBA32);
+	SDL_FillRect(sheet, NULL, 0);
+
+	for (int c = 0; c < 256; c++) {
+		int glyph = c;
+		if (glyph >= 'a' && glyph <= 'z') glyph -= 'a' - 'A';
+		glyph -= BUILTIN_GLYPH_FIRST;
+		if (glyph < 0 || glyph >= BUILTIN_GLYPH_COUNT) continue;
+
+		Uint16 bits = builtinGlyphs[glyph];
+		int x0 = (c % 16) * cellW;
+		int y0 = (c / 16) * cellH;
+
+		for (int y = 0; y < BUILTIN_GLYPH_H; y++)
+			for (int x = 0; x < BUILTIN_GLYPH_W; x++) {
+				int bit = (BUILTIN_GLYPH_H - 1 - y) * BUILTIN_GLYPH_W + (BUILTIN_GLYPH_W - 1 - x);
+				if ((bits >> bit) & 1)
+					((Uint32*)((Uint8*)sheet->pixels + (y0 + y) * sheet->pitch))[x0 + x] = 0xFFFFFFFF;
+			}
+	}
+
+	bool built = BuildFontFromSheet(sheet, 16, 16, font);
+	SDL_FreeSurface(sheet);
+	return built;
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <SDL.h>
+#include <SDL_image.h>
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#include "Jobs.h"
+#include "Palette.h"
+#include "Quantise.h"
+#include "Raster.h"
+#include "Resample.h"
+#include "Selection.h"
+#include "Timeline.h"
+#include "Export.h"
+
+// Indexed images and the operations on them that need no window or renderer. The canvas runs these on its own
+// buffers and the batch tool on images loaded straight from disk, so both go through the same kernels.
+// Nothing here may include SDLG.h.
+
+struct indexedImage {
+	int width = 0, height = 0;
+	std::vector<Uint8> pixels;
+	SDL_Colour palette[256] = {};
+	bool locked[256] = {};
+};
+
+// Loads any image SDL_image understands. With keepIndices, paletted images keep their indices and palette as they
+// are, so palette swaps line up with them. Anything else is quantised onto the palette, keeping its locked entries.
+static bool LoadIndexedImage(const char* path, indexedImage& image, QuantiseOptions options, bool keepIndices) {
+	SDL_Surface* loaded = IMG_Load(path);
+	if (loaded == NULL) return false;
+
+	int w = loaded->w, h = loaded->h;
+	image.width = w;
+	image.height = h;
+	image.pixels.resize((size_t)w * h);
+
+	const SDL_Palette* colours = loaded->format->palette;
+	if (keepIndices && loaded->format->format == SDL_PIXELFORMAT_INDEX8 && colours != NULL) {
+		SDL_LockSurface(loaded);
+		for (int y = 0; y < h; y++)
+			memcpy(image.pixels.data() + (size_t)y * w, (const Uint8*)loaded->pixels + (size_t)y * loaded->pitch, w);
+		SDL_UnlockSurface(loaded);
+
+		for (int i = 0; i < std::min(256, colours->ncolors); i++) image.palette[i] = colours->colors[i];
+		SDL_FreeSurface(loaded);
+		return true;
+	}
+
+	SDL_Surface* rgba = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_RGBA32, 0);
+	SDL_FreeSurface(loaded);
+	if (rgba == NULL) return false;
+
+	options.locked = image.locked;
+
+	SDL_LockSurface(rgba);
+	QuantiseImage((const Uint8*)rgba->pixels, w, h, rgba->pitch, image.pixels.data(), image.palette, options);
+	SDL_UnlockSurface(rgba);
+	SDL_FreeSurface(rgba);
+	return true;
+}
+
+// 8-bit paletted PNG. The surface wraps the pixels rather than copying them.
+static bool SaveIndexedPNG(const indexedImage& image, const char* path) {
+	SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormatFrom((void*)image.pixels.data(), image.width, image.height, 8, image.width, SDL_PIXELFORMAT_INDEX8);
+	if (surface == NULL) return false;
+
+	SDL_SetPaletteColors(surface->format->palette, image.palette, 0, 256);
+	bool saved = IMG_SavePNG(surface, path) == 0;
+	SDL_FreeSurface(surface);
+	return saved;
+}
+
+// Single frame GIF, through the same encoder as animation export
+static bool SaveIndexedGIF(const indexedImage& image, const char* path) {
+	Timeline timeline;
+	timeline.Reset(image.pixels.data(), image.width, image.height);
+	return ExportGIF(timeline, image.palette, path);
+}
+
+// Fills the region sharing (x,y)'s colour, stopping at the edge of limit if given. Returns the area changed.
+static SDL_Rect FloodFill(Uint8* pixels, int width, int height, int x, int y, Uint8 colour,
+	SelectionMask& visited, const SelectionMask* limit, std::vector<span>& spans) {
+	spans.clear();
+	FloodSpans(pixels, width, height, x, y, visited, limit, spans);
+	FillSpans(pixels, width, spans, colour);
+	return SpanBounds(spans);
+}
+
+// Every pixel of index from becomes to, rows spread over the job system
+static void ReplaceIndex(Uint8* pixels, int width, int height, Uint8 from, Uint8 to) {
+	SDLG::ParallelFor(0, height, [&](int y0, int y1) {
+		for (int y = y0; y < y1; y++) {
+			Uint8* row = pixels + (size_t)y * width;
+			for (int x = 0; x < width; x += 64) ReplaceRow(row + x, std::min(64, width - x), from, to, ~0ULL);
+		}
+	}, std::max(1, 16384 / std::max(1, width)));
+}
+
+// Which indices appear in the pixels
+static void UsedIndices(const Uint8* pixels, size_t count, bool* used) {
+	Uint8 seen[256] = {};
+	for (size_t i = 0; i < count; i++) seen[pixels[i]] = 1;
+	for (int i = 0; i < 256; i++) used[i] = seen[i] != 0;
+}
+
+// Moves the pixels onto their new indices and takes the remapped palette, leaving the image looking the same
+static void ApplyRemap(indexedImage& image, const paletteRemap& remap) {
+	if (RemapsPixels(remap)) RemapIndices(image.pixels.data(), image.pixels.size(), remap.lut);
+	memcpy(image.palette, remap.colours, sizeof(image.palette));
+	memcpy(image.locked, remap.locked, sizeof(image.locked));
+}
+
+// Scales up by a whole number with one of the resample modes. The palette comes along unchanged.
+static void ScaleImage(const indexedImage& src, ScaleMode mode, int factor, indexedImage& dst) {
+	std::vector<Uint8> scratch;
+	UpscaleIndices(mode, src.pixels.data(), src.width, src.height, factor, dst.pixels, scratch);
+	dst.width = src.width * std::max(1, factor);
+	dst.height = src.height * std::max(1, factor);
+	memcpy(dst.palette, src.palette, sizeof(dst.palette));
+	memcpy(dst.locked, src.locked, sizeof(dst.locked));
+}
+
+// Any size at all, nearest neighbour, at whatever ratio that takes
+static void ResizeImage(const indexedImage& src, int w, int h, indexedImage& dst) {
+	dst.width = std::max(1, w);
+	dst.height = std::max(1, h);
+	dst.pixels.resize((size_t)dst.width * dst.height);
+	ResampleNearest(src.pixels.data(), src.width, src.height, dst.pixels.data(), dst.width, dst.height);
+	memcpy(dst.palette, src.palette, sizeof(dst.palette));
+	memcpy(dst.locked, src.locked, sizeof(dst.locked));
+}
+
+// Scales down by a whole number, each block of pixels taking the index most of it has
+static void ShrinkImage(const indexedImage& src, int factor, indexedImage& dst) {
+	factor = std::max(1, factor);
+	dst.width = (src.width + factor - 1) / factor;
+	dst.height = (src.height + factor - 1) / factor;
+	dst.pixels.resize((size_t)dst.width * dst.height);
+	DownscaleMajority(src.pixels.data(), src.width, src.height, factor, dst.pixels.data());
+	memcpy(dst.palette, src.palette, sizeof(dst.palette));
+	memcpy(dst.locked, src.locked, sizeof(dst.locked));
+}
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <SDL.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+namespace SDLG
+{
+
+	// Counts the unfinished jobs of a batch
+	struct jobCounter {
+		std::atomic<int> remaining{ 0 };
+	};
+
+	struct job {
+		std::function<void()> work;
+		jobCounter* counter = nullptr;
+	};
+
+	// A worker thread per core, each with its own deque of jobs. Threads push and pop at the back of their own deque,
+	// so nested work stays where it was made, and idle threads steal the oldest jobs from the front of the others.
+	// A thread waiting on a batch runs jobs itself rather than blocking.
+	class JobSystem {
+	private:
+		struct jobQueue {
+			std::mutex lock;
+			std::deque<job> jobs;
+		};
+
+		// Queue 0 is shared by every thread that isn't a worker, the main thread included
+		std::vector<std::unique_ptr<jobQueue>> queues;
+		std::vector<std::thread> workers;
+		std::atomic<int> queued{ 0 };
+
+		std::mutex sleepLock;
+		std::condition_variable wake;
+		bool stopping = false;
+
+		Uint32 completionEvent = (Uint32)-1;
+
+		static int& ThreadQueue() {
+			static thread_local int index = 0;
+			return index;
+		}
+
+		bool Pop(int index, job& out) {
+			{
+				jobQueue& own = *queues[index];
+				std::lock_guard<std::mutex> hold(own.lock);
+				if (!own.jobs.empty()) {
+					out = std::move(own.jobs.back());
+					own.jobs.pop_back();
+					queued--;
+					return true;
+				}
+			}
+
+			int n = (int)queues.size();
+			for (int i = 1; i < n; i++) {
+				jobQueue& other = *queues[(index + i) % n];
+				std::lock_guard<std::mutex> hold(other.lock);
+				if (!other.jobs.empty()) {
+					out = std::move(other.jobs.front());
+					other.jobs.pop_front();
+					queued--;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		static void Run(job& j) {
+			j.work();
+			if (j.counter != nullptr) j.counter->remaining.fetch_sub(1, std::memory_order_release);
+		}
+
+		void Work(int index) {
+			ThreadQueue() = index;
+
+			while (true) {
+				job j;
+				if (Pop(index, j)) {
+					Run(j);
+					continue;
+				}
+
+				// Jobs left behind at shutdown are still finished before the worker leaves
+				std::unique_lock<std::mutex> hold(sleepLock);
+				if (stopping) return;
+				wake.wait(hold, [&] { return stopping || queued > 0; });
+			}
+		}
+
+	public:
+		JobSystem() {
+			unsigned cores = std::thread::hardware_concurrency();
+			int count = cores > 1 ? (int)cores - 1 : 0; // The waiting thread makes up the last core
+
+			for (int i = 0; i <= count; i++) queues.emplace_back(new jobQueue);
+			for (int i = 1; i <= count; i++) workers.emplace_back(&JobSystem::Work, this, i);
+
+			completionEvent = SDL_RegisterEvents(1);
+		}
+
+		~JobSystem() {
+			Stop();
+		}
+
+		JobSystem(const JobSystem&) = delete;
+		JobSystem& operator=(const JobSystem&) = delete;
+
+		// Finishes whatever is queued and joins the workers. Jobs pushed afterwards run on the pushing thread.
+		void Stop() {
+			{
+				std::lock_guard<std::mutex> hold(sleepLock);
+				stopping = true;
+			}
+			wake.notify_all();
+
+			for (auto& w : workers) w.join();
+			workers.clear();
+		}
+
+		// Threads that take part in a ParallelFor, the calling one included
+		int ThreadCount() const {
+			return (int)workers.size() + 1;
+		}
+
+		// SDL event type that RunAsync completions arrive as
+		Uint32 CompletionEvent() const {
+			return completionEvent;
+		}
+
+		void Push(job j) {
+			if (workers.empty()) {
+				Run(j);
+				return;
+			}
+
+			{
+				jobQueue& own = *queues[ThreadQueue()];
+				std::lock_guard<std::mutex> hold(own.lock);
+				own.jobs.push_back(std::move(j));
+				queued++;
+			}
+
+			// Taking the lock keeps a worker from missing the wake between checking for jobs and sleeping
+			{ std::lock_guard<std::mutex> hold(sleepLock); }
+			wake.notify_one();
+		}
+
+		// Runs other jobs until every job of the batch has finished
+		void Wait(jobCounter& counter) {
+			int index = ThreadQueue();
+			while (counter.remaining.load(std::memory_order_acquire) > 0) {
+				job j;
+				if (Pop(index, j)) Run(j);
+				else std::this_thread::yield();
+			}
+		}
+
+		// Calls fn(pieceBegin, pieceEnd) over pieces of [begin, end) at least grain long, and returns once all are done.
+		// There are a few pieces per thread, so threads that finish early can steal from ones given costlier rows.
+		template <class F>
+		void ParallelFor(int begin, int end, F&& fn, int grain = 1) {
+			int count = end - begin;
+			if (count <= 0) return;
+			grain = std::max(grain, 1);
+
+			int pieces = std::min((count + grain - 1) / grain, ThreadCount() * 4);
+			if (pieces <= 1 || workers.empty()) {
+				fn(begin, end);
+				return;
+			}
+
+			jobCounter counter;
+			counter.remaining = pieces - 1;
+
+			auto pieceStart = [&](int i) { return begin + (int)((long long)count * i / pieces); };
+			for (int i = pieces - 1; i >= 1; i--) {
+				int a = pieceStart(i), b = pieceStart(i + 1);
+				Push({ [&fn, a, b] { fn(a, b); }, &counter });
+			}
+
+			fn(begin, pieceStart(1));
+			Wait(counter);
+		}
+
+		// Runs work on a worker, then done on the main thread once the event loop reaches its completion event
+		void RunAsync(std::function<void()> work, std::function<void()> done) {
+			auto* finished = new std::function<void()>(std::move(done));
+			Uint32 type = completionEvent;
+
+			Push({ [work, finished, type] {
+				work();
+
+				SDL_Event e;
+				SDL_zero(e);
+				e.type = type;
+				e.user.data1 = finished;
+				if (type == (Uint32)-1 || SDL_PushEvent(&e) < 1) {
+#ifdef ERROR_LOGGING
+					SDL_Log("Unable to deliver job completion: %s", SDL_GetError());
+#endif
+					delete finished;
+				}
+			}, nullptr });
+		}
+
+		// Calls the continuation carried by a completion event
+		static void Complete(SDL_Event& e) {
+			auto* finished = (std::function<void()>*)e.user.data1;
+			if (*finished) (*finished)();
+			delete finished;
+		}
+	};
+
+	// The job system every kernel shares. Workers start the first time it's used.
+	inline JobSystem& Jobs() {
+		static JobSystem system;
+		return system;
+	}
+
+	template <class F>
+	static void ParallelFor(int begin, int end, F&& fn, int grain = 1) {
+		Jobs().ParallelFor(begin, end, std::forward<F>(fn), grain);
+	}
+
+	// Calls fn(tile) for every tileW*tileH tile of area, clipped to it, a row of tiles per job
+	template <class F>
+	static void ParallelForTiles(SDL_Rect area, int tileW, int tileH, F&& fn) {
+		if (area.w <= 0 || area.h <= 0) return;
+		int tilesX = (area.w + tileW - 1) / tileW;
+		int tilesY = (area.h + tileH - 1) / tileH;
+
+		Jobs().ParallelFor(0, tilesY, [&](int ty0, int ty1) {
+			for (int ty = ty0; ty < ty1; ty++)
+				for (int tx = 0; tx < tilesX; tx++) {
+					int x = tx * tileW, y = ty * tileH;
+					SDL_Rect tile = { area.x + x, area.y + y, std::min(tileW, area.w - x), std::min(tileH, area.h - y) };
+					fn(tile);
+				}
+		});
+	}
+
+	static void RunAsync(std::function<void()> work, std::function<void()> done) {
+		Jobs().RunAsync(std::move(work), std::move(done));
+	}
+
+}
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <SDL.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+namespace SDLG
+{
+
+	// There's no undo history to count. Frames, the tile pool of stored animation frames, is the nearest thing,
+	// and the canvas's applied copy of the image, which edits are previewed against, is counted under Canvas.
+	enum class MemoryTag {
+		Canvas,   // Image buffers
+		Frames,   // Stored animation frames
+		Textures, // Canvas, frame, onion skin and transform textures
+		UI,       // Palette, colour picker and font textures
+		Tilemap,  // Unique tiles and cell links of tilemap mode
+		Scratch,  // Kernel scratch buffers
+		Arena,    // Frame arena blocks
+		Count
+	};
+
+	struct memoryCounter {
+		std::atomic<Sint64> current{ 0 };
+		std::atomic<Sint64> peak{ 0 };
+		std::atomic<Sint64> allocations{ 0 };
+	};
+
+	// Shared between translation units, like Jobs()
+	inline memoryCounter* MemoryCounters() {
+		static memoryCounter counters[(int)MemoryTag::Count];
+		return counters;
+	}
+
+	static const char* MemoryTagName(MemoryTag tag) {
+		static const char* names[] = { "Canvas", "Frames", "Textures", "UI", "Tilemap", "Scratch", "Arena" };
+		return names[(int)tag];
+	}
+
+	// Counts bytes taken, or given back when negative
+	static void TrackMemory(MemoryTag tag, Sint64 bytes) {
+		memoryCounter& counter = MemoryCounters()[(int)tag];
+		Sint64 now = counter.current += bytes;
+		if (bytes > 0) counter.allocations++;
+
+		Sint64 peak = counter.peak;
+		while (now > peak && !counter.peak.compare_exchange_weak(peak, now));
+	}
+
+	static Sint64 TextureBytes(SDL_Texture* texture) {
+		Uint32 format;
+		int w, h;
+		if (texture == NULL || SDL_QueryTexture(texture, &format, NULL, &w, &h) != 0) return 0;
+		return (Sint64)w * h * SDL_BYTESPERPIXEL(format);
+	}
+
+	// Call after creating a texture, and before destroying it
+	static void TrackTexture(SDL_Texture* texture, MemoryTag tag, bool created) {
+		Sint64 bytes = TextureBytes(texture);
+		if (bytes > 0) TrackMemory(tag, created ? bytes : -bytes);
+	}
+
+	// One line per subsystem: current use, peak and number of allocations
+	static std::string MemoryReport() {
+		std::string report;
+		char line[96];
+		for (int i = 0; i < (int)MemoryTag::Count; i++) {
+			const memoryCounter& counter = MemoryCounters()[i];
+			snprintf(line, sizeof(line), "%-8s %9.2f MB  peak %9.2f MB  %lld allocations\n", MemoryTagName((MemoryTag)i),
+				counter.current / 1048576.0, counter.peak / 1048576.0, (long long)counter.allocations);
+			report += line;
+		}
+		return report;
+	}
+
+	static bool DumpMemory(const char* path) {
+		SDL_RWops* file = SDL_RWFromFile(path, "wb");
+		if (file == NULL) {
+#ifdef ERROR_LOGGING
+			SDL_Log("Unable to write memory report: %s", SDL_GetError());
+#endif
+			return false;
+		}
+
+		std::string report = MemoryReport();
+		SDL_RWwrite(file, report.data(), 1, report.size());
+		SDL_RWclose(file);
+		return true;
+	}
+
+	// Bump allocator for temporaries that live no longer than the frame they were made in. Reset gives every block
+	// back at once, and folds them into one block big enough for the whole frame, so a steady frame loop stops
+	// allocating after its first few frames. Main thread only; jobs should use ScratchBuffer instead.
+	class FrameArena {
+	private:
+		struct block {
+			std::unique_ptr<Uint8[]> data;
+			size_t size;
+		};
+
+		std::vector<block> blocks;
+		size_t used = 0;     // Within the last block
+		size_t capacity = 0; // Across every block
+		size_t frameUsed = 0, peakUsed = 0;
+
+		static const size_t minimumBlock = 64 * 1024;
+
+		void AddBlock(size_t size) {
+			blocks.push_back({ std::unique_ptr<Uint8[]>(new Uint8[size]), size });
+			capacity += size;
+			used = 0;
+			TrackMemory(MemoryTag::Arena, (Sint64)size);
+		}
+
+		void FreeBlocks() {
+			TrackMemory(MemoryTag::Arena, -(Sint64)capacity);
+			blocks.clear();
+			capacity = 0;
+			used = 0;
+		}
+
+	public:
+		~FrameArena() {
+			FreeBlocks();
+		}
+
+		void* Allocate(size_t bytes, size_t align = alignof(std::max_align_t)) {
+			if (!blocks.empty()) {
+				block& last = blocks.back();
+				size_t start = (used + align - 1) & ~(align - 1);
+				if (start + bytes <= last.size) {
+					used = start + bytes;
+					frameUsed += bytes;
+					return last.data.get() + start;
+				}
+			}
+
+			AddBlock(std::max(minimumBlock, bytes + align));
+			size_t start = ((size_t)blocks.back().data.get() + align - 1) & ~(align - 1);
+			used = start - (size_t)blocks.back().data.get() + bytes;
+			frameUsed += bytes;
+			return (Uint8*)start;
+		}
+
+		// Uninitialised space for count objects, which must not need destructing
+		template <class T>
+		T* Allocate(size_t count) {
+			return (T*)Allocate(count * sizeof(T), alignof(T));
+		}
+
+		void Reset() {
+			peakUsed = std::max(peakUsed, frameUsed);
+			frameUsed = 0;
+
+			if (blocks.size() > 1) {
+				size_t total = capacity;
+				FreeBlocks();
+				AddBlock(total);
+			}
+			used = 0;
+		}
+
+		size_t Capacity() const {
+			return capacity;
+		}
+
+		// Most bytes handed out in a single frame
+		size_t PeakUse() const {
+			return std::max(peakUsed, frameUsed);
+		}
+	};
+
+	inline FrameArena& FrameMemory() {
+		static FrameArena arena;
+		return arena;
+	}
+
+	// Lets standard containers live in the frame arena. Freeing is a no-op; the memory comes back at the end of the frame.
+	template <class T>
+	struct ArenaAllocator {
+		typedef T value_type;
+
+		ArenaAllocator() = default;
+		template <class U> ArenaAllocator(const ArenaAllocator<U>&) {}
+
+		T* allocate(size_t n) {
+			return FrameMemory().Allocate<T>(n);
+		}
+
+		void deallocate(T*, size_t) {}
+
+		template <class U> bool operator==(const ArenaAllocator<U>&) const { return true; }
+		template <class U> bool operator!=(const ArenaAllocator<U>&) const { return false; }
+	};
+
+	template <class T>
+	using frameVector = std::vector<T, ArenaAllocator<T>>;
+
+	// Working space for kernels that need some on every call, resized to count. Each thread has its own, which keeps
+	// its capacity between calls. Separate slots keep buffers of one type apart within a kernel. Growth from pushing
+	// onto a buffer is counted the next time it's asked for.
+	template <class T, int Slot = 0>
+	static std::vector<T>& ScratchBuffer(size_t count) {
+		static thread_local std::vector<T> buffer;
+		static thread_local size_t counted = 0;
+
+		buffer.resize(count);
+		if (buffer.capacity() != counted) {
+			TrackMemory(MemoryTag::Scratch, ((Sint64)buffer.capacity() - (Sint64)counted) * (Sint64)sizeof(T));
+			counted = buffer.capacity();
+		}
+		return buffer;
+	}
+
+}
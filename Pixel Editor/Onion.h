@@ -0,0 +1,102 @@
+#pragma once
+
+#include <SDL.h>
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "Jobs.h"
+#include "Memory.h"
+#include "Timeline.h"
+
+struct onionSettings {
+	bool enabled = false;
+	int before = 1, after = 1; // Frames ghosted either side of the current one
+	SDL_Colour beforeTint = { 255,  64,  64, 255 };
+	SDL_Colour afterTint  = {  64, 160, 255, 255 };
+	float opacity = 0.5f;      // Of the nearest ghosts
+	float falloff = 0.5f;      // Each further frame is this much fainter again
+};
+
+struct onionGhost {
+	int frame;
+	Uint8 colours[256][4]; // Tinted palette, alpha included
+};
+
+// Source over destination, both straight alpha
+static inline void BlendOver(Uint8* dst, const Uint8* src) {
+	int a = src[3];
+	int inverse = dst[3] * (255 - a) / 255;
+	int alpha = a + inverse;
+	if (alpha == 0) return;
+
+	for (int c = 0; c < 3; c++) dst[c] = (Uint8)((src[c] * a + dst[c] * inverse) / alpha);
+	dst[3] = (Uint8)alpha;
+}
+
+// Composites ghosts of the frames around current into RGBA32, nearer frames over further ones.
+// Ghost pixels matching the current frame are left clear, and tiles a ghost shares with it are skipped outright.
+static void ComposeOnionSkin(const Timeline& timeline, int current, const SDL_Colour* palette, const onionSettings& settings, Uint32* out, int pitch) {
+	SDLG::frameVector<onionGhost> ghosts;
+	int count = timeline.GetFrameCount();
+
+	auto addGhost = [&](int frame, int distance, SDL_Colour tint) {
+		if (frame < 0 || frame >= count) return;
+
+		float opacity = settings.opacity * powf(settings.falloff, (float)(distance - 1));
+		Uint8 alpha = (Uint8)std::max(0.0f, std::min(255.0f, opacity * 255 + 0.5f));
+
+		ghosts.emplace_back();
+		onionGhost& g = ghosts.back();
+		g.frame = frame;
+		for (int i = 0; i < 256; i++) {
+			g.colours[i][0] = (Uint8)((palette[i].r + tint.r) / 2);
+			g.colours[i][1] = (Uint8)((palette[i].g + tint.g) / 2);
+			g.colours[i][2] = (Uint8)((palette[i].b + tint.b) / 2);
+			g.colours[i][3] = alpha;
+		}
+	};
+
+	for (int d = std::max(settings.before, settings.after); d >= 1; d--) {
+		if (d <= settings.before) addGhost(current - d, d, settings.beforeTint);
+		if (d <= settings.after) addGhost(current + d, d, settings.afterTint);
+	}
+
+	const std::vector<int>& currentTiles = timeline.GetFrame(current).tiles;
+	int tilesX = timeline.GetTilesX();
+
+	SDLG::ParallelFor(0, timeline.GetTilesY(), [&](int ty0, int ty1) {
+		for (int ty = ty0; ty < ty1; ty++)
+			for (int tx = 0; tx < tilesX; tx++) {
+				SDL_Rect r = timeline.TileRect(tx, ty);
+				size_t tile = (size_t)ty * tilesX + tx;
+
+				for (int y = 0; y < r.h; y++)
+					memset((Uint8*)out + (size_t)(r.y + y) * pitch + r.x * 4, 0, r.w * 4);
+
+				std::vector<Uint8>& now = SDLG::ScratchBuffer<Uint8, 0>(FRAME_TILE_BYTES);
+				std::vector<Uint8>& then = SDLG::ScratchBuffer<Uint8, 1>(FRAME_TILE_BYTES);
+				bool unpacked = false;
+
+				for (const onionGhost& g : ghosts) {
+					int id = timeline.GetFrame(g.frame).tiles[tile];
+					if (id == currentTiles[tile]) continue;
+
+					if (!unpacked) {
+						timeline.UnpackTile(currentTiles[tile], now.data());
+						unpacked = true;
+					}
+					timeline.UnpackTile(id, then.data());
+					for (int y = 0; y < r.h; y++) {
+						Uint8* row = (Uint8*)out + (size_t)(r.y + y) * pitch + r.x * 4;
+						for (int x = 0; x < r.w; x++) {
+							int i = y * FRAME_TILE + x;
+							if (then[i] != now[i]) BlendOver(row + x * 4, g.colours[then[i]]);
+						}
+					}
+				}
+			}
+	});
+}
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <SDL.h>
+
+#include <cstring>
+
+#include "SIMD.h"
+
+// Images of few colours are stored packed, several pixels to a byte with the leftmost pixel in the most
+// significant bits, as in PNG and BMP. Rows start on a byte boundary and leave their unused low bits clear.
+// Only the timeline's stored tiles are packed, at the depth the palette size needs. The live canvas buffers stay at a
+// byte per pixel, as every tool and the 8-bit canvas surface work on plain indices, so the frame being edited and a
+// document of a single frame take no less memory.
+
+// Smallest of 1, 2, 4 and 8 bits per pixel that can hold indices below colours
+static int PackedDepth(int colours) {
+	if (colours <= 2) return 1;
+	if (colours <= 4) return 2;
+	if (colours <= 16) return 4;
+	return 8;
+}
+
+static size_t PackedRowBytes(int count, int depth) {
+	return ((size_t)count * depth + 7) / 8;
+}
+
+// Highest index in a run of pixels
+static Uint8 MaxIndex(const Uint8* pixels, size_t count) {
+	size_t i = 0;
+	Uint8 highest = 0;
+
+#ifdef SIMD_SSE2
+	__m128i m = _mm_setzero_si128();
+	for (; i + 16 <= count; i += 16) m = _mm_max_epu8(m, _mm_loadu_si128((const __m128i*)(pixels + i)));
+
+	Uint8 lanes[16];
+	_mm_storeu_si128((__m128i*)lanes, m);
+	for (int k = 0; k < 16; k++) highest = lanes[k] > highest ? lanes[k] : highest;
+#endif
+
+	for (; i < count; i++) highest = pixels[i] > highest ? pixels[i] : highest;
+	return highest;
+}
+
+struct packTables {
+	Uint8 reverse[256];  // Bit order of each byte reversed
+	Uint32 unpack2[256]; // The four 2-bit pixels of a byte
+	Uint64 unpack1[256]; // The eight 1-bit pixels of a byte
+
+	packTables() {
+		for (int b = 0; b < 256; b++) {
+			Uint8 r = 0;
+			for (int k = 0; k < 8; k++) r |= ((b >> k) & 1) << (7 - k);
+			reverse[b] = r;
+
+			Uint8 two[4], one[8];
+			for (int k = 0; k < 4; k++) two[k] = (b >> (6 - k * 2)) & 3;
+			for (int k = 0; k < 8; k++) one[k] = (b >> (7 - k)) & 1;
+			memcpy(&unpack2[b], two, 4);
+			memcpy(&unpack1[b], one, 8);
+		}
+	}
+};
+
+static const packTables& PackTables() {
+	static packTables tables;
+	return tables;
+}
+
+// Packs count 8-bit indices, each below 1 << depth, into dst
+static void PackRow(const Uint8* src, int count, int depth, Uint8* dst) {
+	int i = 0;
+
+	switch (depth) {
+	case 8:
+		memcpy(dst, src, count);
+		return;
+
+	case 4:
+#ifdef SIMD_SSE2
+		// Pairs of pixels as 16-bit lanes become (first << 4 | second) in the low byte, then narrow to bytes
+		for (; i + 16 <= count; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+			__m128i high = _mm_and_si128(_mm_slli_epi16(v, 4), _mm_set1_epi16(0x00F0));
+			__m128i low = _mm_srli_epi16(v, 8);
+			_mm_storel_epi64((__m128i*)(dst + i / 2), _mm_packus_epi16(_mm_or_si128(high, low), _mm_setzero_si128()));
+		}
+#endif
+		for (; i < count; i += 2) {
+			Uint8 second = i + 1 < count ? src[i + 1] : 0;
+			dst[i / 2] = (Uint8)(src[i] << 4 | second);
+		}
+		return;
+
+	case 2:
+#ifdef SIMD_SSE2
+		// Four pixels as a 32-bit lane shift into place in its low byte
+		for (; i + 16 <= count; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+			__m128i b0 = _mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32(0x03)), 6);
+			__m128i b1 = _mm_and_si128(_mm_srli_epi32(v, 4), _mm_set1_epi32(0x30));
+			__m128i b2 = _mm_and_si128(_mm_srli_epi32(v, 14), _mm_set1_epi32(0x0C));
+			__m128i b3 = _mm_srli_epi32(v, 24);
+			__m128i bytes = _mm_or_si128(_mm_or_si128(b0, b1), _mm_or_si128(b2, b3));
+			bytes = _mm_packs_epi32(bytes, bytes);
+			bytes = _mm_packus_epi16(bytes, bytes);
+			int packed = _mm_cvtsi128_si32(bytes);
+			memcpy(dst + i / 4, &packed, 4);
+		}
+#endif
+		for (; i < count; i += 4) {
+			Uint8 b = 0;
+			for (int k = 0; k < 4 && i + k < count; k++) b |= src[i + k] << (6 - k * 2);
+			dst[i / 4] = b;
+		}
+		return;
+
+	case 1: {
+#ifdef SIMD_SSE2
+		// Moving each pixel's bit to the top of its byte lets movemask gather sixteen at once, least significant first
+		const Uint8* reverse = PackTables().reverse;
+		for (; i + 16 <= count; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+			int bits = _mm_movemask_epi8(_mm_slli_epi16(v, 7));
+			dst[i / 8] = reverse[bits & 0xFF];
+			dst[i / 8 + 1] = reverse[bits >> 8];
+		}
+#endif
+		for (; i < count; i += 8) {
+			Uint8 b = 0;
+			for (int k = 0; k < 8 && i + k < count; k++) b |= src[i + k] << (7 - k);
+			dst[i / 8] = b;
+		}
+		return;
+	}
+	}
+}
+
+// Unpacks count pixels of the given depth into 8-bit indices
+static void UnpackRow(const Uint8* src, int count, int depth, Uint8* dst) {
+	int i = 0;
+
+	switch (depth) {
+	case 8:
+		memcpy(dst, src, count);
+		return;
+
+	case 4:
+#ifdef SIMD_SSE2
+		for (; i + 16 <= count; i += 16) {
+			__m128i v = _mm_loadl_epi64((const __m128i*)(src + i / 2));
+			__m128i mask = _mm_set1_epi8(0x0F);
+			__m128i high = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+			__m128i low = _mm_and_si128(v, mask);
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi8(high, low));
+		}
+#endif
+		for (; i < count; i++) dst[i] = (src[i / 2] >> (i & 1 ? 0 : 4)) & 0x0F;
+		return;
+
+	case 2: {
+		const Uint32* table = PackTables().unpack2;
+		for (; i + 4 <= count; i += 4) memcpy(dst + i, &table[src[i / 4]], 4);
+		for (; i < count; i++) dst[i] = (src[i / 4] >> (6 - (i & 3) * 2)) & 3;
+		return;
+	}
+
+	case 1: {
+#ifdef SIMD_SSE2
+		// Each byte is spread over eight lanes, and each lane tests its own bit
+		const __m128i bits = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128);
+		const __m128i one = _mm_set1_epi8(1);
+		for (; i + 16 <= count; i += 16) {
+			Uint64 a = src[i / 8] * 0x0101010101010101ULL;
+			Uint64 b = src[i / 8 + 1] * 0x0101010101010101ULL;
+			__m128i v = _mm_set_epi64x((long long)b, (long long)a);
+			__m128i set = _mm_cmpeq_epi8(_mm_and_si128(v, bits), bits);
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_and_si128(set, one));
+		}
+#endif
+		const Uint64* table = PackTables().unpack1;
+		for (; i + 8 <= count; i += 8) memcpy(dst + i, &table[src[i / 8]], 8);
+		for (; i < count; i++) dst[i] = (src[i / 8] >> (7 - (i & 7))) & 1;
+		return;
+	}
+	}
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <SDL.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "Colour.h"
+#include "Jobs.h"
+
+// Palette operations never change what the image looks like. Each is a remap: a table giving every old index its
+// new one, applied to every pixel of every frame, along with the palette that goes with the new indices.
+struct paletteRemap {
+	Uint8 lut[256];
+	SDL_Colour colours[256];
+	bool locked[256];
+};
+
+enum class PaletteSortKey {
+	Luminance,
+	Hue
+};
+
+#define REMAP_CHUNK 65536
+
+static paletteRemap IdentityRemap(const SDL_Colour* palette, const bool* locked) {
+	paletteRemap remap;
+	for (int i = 0; i < 256; i++) remap.lut[i] = (Uint8)i;
+	memcpy(remap.colours, palette, sizeof(remap.colours));
+	memcpy(remap.locked, locked, sizeof(remap.locked));
+	return remap;
+}
+
+// Entries up to the last one holding a colour. Entries never set are left all zero.
+static int PaletteSize(const SDL_Colour* palette) {
+	for (int i = 255; i > 0; i--)
+		if (palette[i].r != 0 || palette[i].g != 0 || palette[i].b != 0 || palette[i].a != 0) return i + 1;
+	return 1;
+}
+
+static bool RemapsPixels(const paletteRemap& remap) {
+	for (int i = 0; i < 256; i++)
+		if (remap.lut[i] != i) return true;
+	return false;
+}
+
+// Puts the unlocked entries into the unlocked slots in the given order. Locked entries stay where they are.
+static paletteRemap ReorderUnlocked(const SDL_Colour* palette, const bool* locked, const Uint8* order) {
+	paletteRemap remap = IdentityRemap(palette, locked);
+
+	int slot = 0;
+	for (int k = 0; k < 256; k++) {
+		int from = order[k];
+		if (locked[from]) continue;
+		while (locked[slot]) slot++;
+
+		remap.lut[from] = (Uint8)slot;
+		remap.colours[slot] = palette[from];
+		slot++;
+	}
+	return remap;
+}
+
+static int Luminance(SDL_Colour c) {
+	return c.r * 2126 + c.g * 7152 + c.b * 722;
+}
+
+// Greys come first, darkest first, then colours around the hue circle from red
+static paletteRemap SortPaletteRemap(const SDL_Colour* palette, const bool* locked, PaletteSortKey key) {
+	int primary[256], secondary[256];
+	for (int i = 0; i < 256; i++) {
+		int hue, saturation, value;
+		RGBToHSV(palette[i], hue, saturation, value);
+		bool grey = saturation == 0;
+
+		if (key == PaletteSortKey::Hue) {
+			primary[i] = grey ? -1 : hue;
+			secondary[i] = Luminance(palette[i]);
+		}
+		else {
+			primary[i] = Luminance(palette[i]);
+			secondary[i] = grey ? -1 : hue;
+		}
+	}
+
+	Uint8 order[256];
+	for (int i = 0; i < 256; i++) order[i] = (Uint8)i;
+	std::stable_sort(order, order + 256, [&](Uint8 a, Uint8 b) {
+		if (primary[a] != primary[b]) return primary[a] < primary[b];
+		return secondary[a] < secondary[b];
+	});
+	return ReorderUnlocked(palette, locked, order);
+}
+
+// Pixels of entries repeating an earlier colour move onto the earlier entry. The palette itself is unchanged,
+// leaving the repeats unused.
+static paletteRemap MergePaletteRemap(const SDL_Colour* palette, const bool* locked) {
+	paletteRemap remap = IdentityRemap(palette, locked);
+
+	Uint32 colours[256];
+	memcpy(colours, palette, sizeof(colours));
+	for (int i = 1; i < 256; i++)
+		for (int j = 0; j < i; j++)
+			if (colours[i] == colours[j]) {
+				remap.lut[i] = (Uint8)j;
+				break;
+			}
+	return remap;
+}
+
+// Moves the entries in use to the front, keeping their order, and the unused ones after them
+static paletteRemap CompactPaletteRemap(const SDL_Colour* palette, const bool* locked, const bool* used) {
+	Uint8 order[256];
+	int n = 0;
+	for (int i = 0; i < 256; i++)
+		if (used[i]) order[n++] = (Uint8)i;
+	for (int i = 0; i < 256; i++)
+		if (!used[i]) order[n++] = (Uint8)i;
+	return ReorderUnlocked(palette, locked, order);
+}
+
+// Swapped entries take their locks with them
+static paletteRemap SwapPaletteRemap(const SDL_Colour* palette, const bool* locked, Uint8 a, Uint8 b) {
+	paletteRemap remap = IdentityRemap(palette, locked);
+	remap.lut[a] = b;
+	remap.lut[b] = a;
+	std::swap(remap.colours[a], remap.colours[b]);
+	std::swap(remap.locked[a], remap.locked[b]);
+	return remap;
+}
+
+// Takes an entry out and reinserts it at another index, shifting the entries between along by one
+static paletteRemap MovePaletteRemap(const SDL_Colour* palette, const bool* locked, Uint8 from, Uint8 to) {
+	paletteRemap remap = IdentityRemap(palette, locked);
+	int step = from < to ? 1 : -1;
+	for (int i = from; i != to; i += step) {
+		remap.lut[i + step] = (Uint8)i;
+		remap.colours[i] = palette[i + step];
+		remap.locked[i] = locked[i + step];
+	}
+	remap.lut[from] = to;
+	remap.colours[to] = palette[from];
+	remap.locked[to] = locked[from];
+	return remap;
+}
+
+// Table lookup of count indices in place. SSE2 has no byte shuffle to look up with, so four independent
+// loads at a time keep the lookups overlapping instead.
+static void RemapRow(Uint8* pixels, size_t count, const Uint8* lut) {
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		Uint8 a = lut[pixels[i]], b = lut[pixels[i + 1]], c = lut[pixels[i + 2]], d = lut[pixels[i + 3]];
+		pixels[i] = a;
+		pixels[i + 1] = b;
+		pixels[i + 2] = c;
+		pixels[i + 3] = d;
+	}
+	for (; i < count; i++) pixels[i] = lut[pixels[i]];
+}
+
+// RemapRow over a whole image, in chunks spread over the job system
+static void RemapIndices(Uint8* pixels, size_t count, const Uint8* lut) {
+	int chunks = (int)((count + REMAP_CHUNK - 1) / REMAP_CHUNK);
+	SDLG::ParallelFor(0, chunks, [&](int c0, int c1) {
+		size_t begin = (size_t)c0 * REMAP_CHUNK;
+		size_t end = std::min(count, (size_t)c1 * REMAP_CHUNK);
+		RemapRow(pixels + begin, end - begin, lut);
+	});
+}
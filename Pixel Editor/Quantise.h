@@ -0,0 +1,360 @@
+#pragma once
+
+#include <SDL.h>
+
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <cmath>
+
+#include "Jobs.h"
+#include "Memory.h"
+#include "SIMD.h"
+
+// Colours are bucketed at 5 bits per channel, both for the median-cut histogram and the lookup cube
+#define QUANTISE_BITS 5
+#define QUANTISE_SIDE (1 << QUANTISE_BITS)
+#define QUANTISE_CELLS (QUANTISE_SIDE * QUANTISE_SIDE * QUANTISE_SIDE)
+
+struct QuantiseOptions {
+	unsigned colourCount = 256;  // Palette entries the result may use, locked entries included
+	bool dither = false;         // Ordered dithering, so it parallelises by row like the plain mapping
+	const bool* locked = NULL;   // 256 flags. Locked entries keep their colour but can still be mapped to
+	int transparentIndex = -1;   // Pixels with alpha < 128 map here. -1 treats every pixel as opaque
+};
+
+static constexpr unsigned QuantiseCell(Uint8 r, Uint8 g, Uint8 b) {
+	return
+		((r >> (8 - QUANTISE_BITS)) << (QUANTISE_BITS * 2)) |
+		((g >> (8 - QUANTISE_BITS)) << QUANTISE_BITS) |
+		(b >> (8 - QUANTISE_BITS));
+}
+
+// Maps any RGB colour to its nearest palette entry through a precomputed cube of 5-bit cells
+class PaletteLookup {
+private:
+	Uint8 cube[QUANTISE_CELLS];
+
+	// Palette laid out for the distance kernel: (r,g) pairs and (b,0) pairs, padded to a multiple of 4 entries
+	std::vector<Sint16> rg;
+	std::vector<Sint16> b0;
+	std::vector<Uint8> indices;
+
+	Uint8 Nearest(int r, int g, int b) const {
+		size_t count = indices.size();
+		size_t best = 0;
+
+#ifdef SIMD_SSE2
+		const __m128i crg = _mm_set1_epi32((g << 16) | r);
+		const __m128i cb = _mm_set1_epi32(b);
+		const __m128i step = _mm_set1_epi32(4);
+
+		__m128i bestDist = _mm_set1_epi32(0x7FFFFFFF);
+		__m128i bestLane = _mm_setzero_si128();
+		__m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+
+		for (size_t i = 0; i < count; i += 4) {
+			__m128i drg = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(rg.data() + i * 2)), crg);
+			__m128i db = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(b0.data() + i * 2)), cb);
+			__m128i dist = _mm_add_epi32(_mm_madd_epi16(drg, drg), _mm_madd_epi16(db, db));
+
+			__m128i closer = _mm_cmplt_epi32(dist, bestDist);
+			bestDist = _mm_or_si128(_mm_and_si128(closer, dist), _mm_andnot_si128(closer, bestDist));
+			bestLane = _mm_or_si128(_mm_and_si128(closer, lane), _mm_andnot_si128(closer, bestLane));
+			lane = _mm_add_epi32(lane, step);
+		}
+
+		alignas(16) Sint32 dists[4];
+		alignas(16) Sint32 lanes[4];
+		_mm_store_si128((__m128i*)dists, bestDist);
+		_mm_store_si128((__m128i*)lanes, bestLane);
+
+		best = lanes[0];
+		for (int i = 1; i < 4; i++)
+			if (dists[i] < dists[0] || (dists[i] == dists[0] && (size_t)lanes[i] < best)) {
+				dists[0] = dists[i];
+				best = lanes[i];
+			}
+#else
+		int bestDist = 0x7FFFFFFF;
+		for (size_t i = 0; i < count; i++) {
+			int dr = rg[i * 2] - r;
+			int dg = rg[i * 2 + 1] - g;
+			int db = b0[i * 2] - b;
+			int dist = dr * dr + dg * dg + db * db;
+			if (dist < bestDist) {
+				bestDist = dist;
+				best = i;
+			}
+		}
+#endif
+
+		return indices[best];
+	}
+
+public:
+	// usable flags which palette entries pixels may be mapped to
+	void Build(const SDL_Colour palette[256], const bool usable[256]) {
+		indices.clear();
+		for (int i = 0; i < 256; i++)
+			if (usable[i]) indices.push_back(i);
+		if (indices.empty()) indices.push_back(0);
+
+		size_t padded = (indices.size() + 3) & ~(size_t)3;
+		rg.assign(padded * 2, 0);
+		b0.assign(padded * 2, 0);
+		for (size_t i = 0; i < padded; i++) {
+			// Padding repeats the first entry, which can never beat it
+			SDL_Colour c = palette[indices[i < indices.size() ? i : 0]];
+			rg[i * 2] = c.r;
+			rg[i * 2 + 1] = c.g;
+			b0[i * 2] = c.b;
+		}
+		indices.resize(padded, indices[0]);
+
+		const int half = 1 << (7 - QUANTISE_BITS);
+		SDLG::ParallelFor(0, QUANTISE_SIDE, [&](int r0, int r1) {
+			for (int r = r0; r < r1; r++)
+				for (int g = 0; g < QUANTISE_SIDE; g++)
+					for (int b = 0; b < QUANTISE_SIDE; b++)
+						cube[(r << (QUANTISE_BITS * 2)) | (g << QUANTISE_BITS) | b] = Nearest(
+							(r << (8 - QUANTISE_BITS)) + half,
+							(g << (8 - QUANTISE_BITS)) + half,
+							(b << (8 - QUANTISE_BITS)) + half
+						);
+		});
+	}
+
+	Uint8 Map(Uint8 r, Uint8 g, Uint8 b) const {
+		return cube[QuantiseCell(r, g, b)];
+	}
+};
+
+struct QuantiseBucket {
+	Uint64 r = 0, g = 0, b = 0;
+	Uint32 count = 0;
+};
+
+struct QuantiseBox {
+	int lo[3], hi[3];
+	Uint64 count;
+};
+
+// Weighted histogram of the opaque pixels in an RGBA32 image, built in parallel row bands
+static std::vector<QuantiseBucket> BuildHistogram(const Uint8* rgba, unsigned w, unsigned h, int pitch, bool skipTransparent) {
+	std::vector<QuantiseBucket> histogram(QUANTISE_CELLS);
+	std::mutex merge;
+
+	SDLG::ParallelFor(0, (int)h, [&](int y0, int y1) {
+		std::vector<QuantiseBucket>& local = SDLG::ScratchBuffer<QuantiseBucket>(QUANTISE_CELLS);
+		std::fill(local.begin(), local.end(), QuantiseBucket());
+		for (int y = y0; y < y1; y++) {
+			const Uint8* p = rgba + (size_t)y * pitch;
+			for (unsigned x = 0; x < w; x++, p += 4) {
+				if (skipTransparent && p[3] < 128) continue;
+				QuantiseBucket& bucket = local[QuantiseCell(p[0], p[1], p[2])];
+				bucket.r += p[0];
+				bucket.g += p[1];
+				bucket.b += p[2];
+				bucket.count++;
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(merge);
+		for (int i = 0; i < QUANTISE_CELLS; i++) {
+			histogram[i].r += local[i].r;
+			histogram[i].g += local[i].g;
+			histogram[i].b += local[i].b;
+			histogram[i].count += local[i].count;
+		}
+	}, 64);
+
+	return histogram;
+}
+
+static const QuantiseBucket& BoxCell(const std::vector<QuantiseBucket>& histogram, int r, int g, int b) {
+	return histogram[(r << (QUANTISE_BITS * 2)) | (g << QUANTISE_BITS) | b];
+}
+
+// Tightens a box to the cells it actually contains and recounts it. Returns false if it is empty.
+static bool ShrinkBox(const std::vector<QuantiseBucket>& histogram, QuantiseBox& box) {
+	int lo[3] = { QUANTISE_SIDE, QUANTISE_SIDE, QUANTISE_SIDE };
+	int hi[3] = { -1, -1, -1 };
+	box.count = 0;
+
+	for (int r = box.lo[0]; r <= box.hi[0]; r++)
+		for (int g = box.lo[1]; g <= box.hi[1]; g++)
+			for (int b = box.lo[2]; b <= box.hi[2]; b++) {
+				Uint32 n = BoxCell(histogram, r, g, b).count;
+				if (n == 0) continue;
+				box.count += n;
+				int c[3] = { r, g, b };
+				for (int a = 0; a < 3; a++) {
+					if (c[a] < lo[a]) lo[a] = c[a];
+					if (c[a] > hi[a]) hi[a] = c[a];
+				}
+			}
+
+	if (box.count == 0) return false;
+	for (int a = 0; a < 3; a++) {
+		box.lo[a] = lo[a];
+		box.hi[a] = hi[a];
+	}
+	return true;
+}
+
+// Splits a box at the population median of its longest axis
+static bool SplitBox(const std::vector<QuantiseBucket>& histogram, QuantiseBox& box, QuantiseBox& other) {
+	int axis = 0;
+	for (int a = 1; a < 3; a++)
+		if (box.hi[a] - box.lo[a] > box.hi[axis] - box.lo[axis]) axis = a;
+	if (box.hi[axis] == box.lo[axis]) return false;
+
+	Uint64 slices[QUANTISE_SIDE] = {};
+	for (int r = box.lo[0]; r <= box.hi[0]; r++)
+		for (int g = box.lo[1]; g <= box.hi[1]; g++)
+			for (int b = box.lo[2]; b <= box.hi[2]; b++) {
+				int c[3] = { r, g, b };
+				slices[c[axis]] += BoxCell(histogram, r, g, b).count;
+			}
+
+	int cut = box.lo[axis];
+	Uint64 total = 0;
+	for (; cut < box.hi[axis] - 1; cut++) {
+		total += slices[cut];
+		if (total * 2 >= box.count) break;
+	}
+
+	other = box;
+	box.hi[axis] = cut;
+	other.lo[axis] = cut + 1;
+
+	ShrinkBox(histogram, box);
+	ShrinkBox(histogram, other);
+	return true;
+}
+
+static SDL_Colour BoxColour(const std::vector<QuantiseBucket>& histogram, const QuantiseBox& box) {
+	Uint64 r = 0, g = 0, b = 0, n = 0;
+	for (int cr = box.lo[0]; cr <= box.hi[0]; cr++)
+		for (int cg = box.lo[1]; cg <= box.hi[1]; cg++)
+			for (int cb = box.lo[2]; cb <= box.hi[2]; cb++) {
+				const QuantiseBucket& bucket = BoxCell(histogram, cr, cg, cb);
+				r += bucket.r;
+				g += bucket.g;
+				b += bucket.b;
+				n += bucket.count;
+			}
+	if (n == 0) return { 0,0,0,255 };
+	return { (Uint8)((r + n / 2) / n), (Uint8)((g + n / 2) / n), (Uint8)((b + n / 2) / n), 255 };
+}
+
+// Median-cut over the histogram. Fills the unlocked entries of palette and flags every entry pixels may map to.
+static void BuildPalette(const std::vector<QuantiseBucket>& histogram, SDL_Colour palette[256], bool usable[256], const QuantiseOptions& options) {
+	std::vector<int> freeEntries;
+	unsigned lockedCount = 0;
+
+	for (int i = 0; i < 256; i++) {
+		usable[i] = false;
+		if (i == options.transparentIndex) continue;
+		if (options.locked != NULL && options.locked[i]) {
+			usable[i] = true;
+			lockedCount++;
+		}
+		else freeEntries.push_back(i);
+	}
+
+	unsigned wanted = options.colourCount > 256 ? 256 : options.colourCount;
+	if (options.transparentIndex >= 0 && wanted > 0) wanted--;
+	wanted = wanted > lockedCount ? wanted - lockedCount : 0;
+	if (wanted > freeEntries.size()) wanted = (unsigned)freeEntries.size();
+
+	std::vector<QuantiseBox> boxes;
+	QuantiseBox all = { { 0,0,0 }, { QUANTISE_SIDE - 1, QUANTISE_SIDE - 1, QUANTISE_SIDE - 1 }, 0 };
+	if (wanted > 0 && ShrinkBox(histogram, all)) boxes.push_back(all);
+
+	while (boxes.size() < wanted) {
+		// Favour boxes that are both populous and wide, so flat areas and gradients each get entries
+		int pick = -1;
+		Uint64 bestScore = 0;
+		for (size_t i = 0; i < boxes.size(); i++) {
+			const QuantiseBox& b = boxes[i];
+			int extent = std::max(b.hi[0] - b.lo[0], std::max(b.hi[1] - b.lo[1], b.hi[2] - b.lo[2]));
+			Uint64 score = b.count * (Uint64)extent;
+			if (score > bestScore) {
+				bestScore = score;
+				pick = (int)i;
+			}
+		}
+		if (pick < 0) break;
+
+		QuantiseBox other;
+		if (!SplitBox(histogram, boxes[pick], other)) break;
+		boxes.push_back(other);
+	}
+
+	for (size_t i = 0; i < boxes.size(); i++) {
+		palette[freeEntries[i]] = BoxColour(histogram, boxes[i]);
+		usable[freeEntries[i]] = true;
+	}
+
+	if (options.transparentIndex >= 0) palette[options.transparentIndex] = { 0,0,0,0 };
+}
+
+static const Uint8 bayer8x8[64] = {
+	 0, 32,  8, 40,  2, 34, 10, 42,
+	48, 16, 56, 24, 50, 18, 58, 26,
+	12, 44,  4, 36, 14, 46,  6, 38,
+	60, 28, 52, 20, 62, 30, 54, 22,
+	 3, 35, 11, 43,  1, 33,  9, 41,
+	51, 19, 59, 27, 49, 17, 57, 25,
+	15, 47,  7, 39, 13, 45,  5, 37,
+	63, 31, 55, 23, 61, 29, 53, 21
+};
+
+static inline Uint8 ClampChannel(int v) {
+	return v < 0 ? 0 : v > 255 ? 255 : (Uint8)v;
+}
+
+// Writes one palette index per pixel of an RGBA32 image into dst (tightly packed, w bytes per row)
+static void MapPixels(const Uint8* rgba, unsigned w, unsigned h, int pitch, Uint8* dst, const PaletteLookup& lookup, const QuantiseOptions& options, unsigned colours) {
+	// Dither amplitude roughly matches the spacing between palette entries
+	int spread = colours > 1 ? (int)(255.0 / std::cbrt((double)colours)) : 0;
+
+	SDLG::ParallelFor(0, (int)h, [&](int y0, int y1) {
+		for (int y = y0; y < y1; y++) {
+			const Uint8* p = rgba + (size_t)y * pitch;
+			Uint8* out = dst + (size_t)y * w;
+			const Uint8* threshold = bayer8x8 + (y & 7) * 8;
+
+			for (unsigned x = 0; x < w; x++, p += 4) {
+				if (options.transparentIndex >= 0 && p[3] < 128) {
+					out[x] = (Uint8)options.transparentIndex;
+					continue;
+				}
+
+				if (options.dither) {
+					int offset = ((int)threshold[x & 7] * 2 - 63) * spread / 128;
+					out[x] = lookup.Map(ClampChannel(p[0] + offset), ClampChannel(p[1] + offset), ClampChannel(p[2] + offset));
+				}
+				else out[x] = lookup.Map(p[0], p[1], p[2]);
+			}
+		}
+	}, 16);
+}
+
+// Reduces an RGBA32 image to indexed colour. Unlocked entries of palette are replaced by the built palette.
+static void QuantiseImage(const Uint8* rgba, unsigned w, unsigned h, int pitch, Uint8* dst, SDL_Colour palette[256], const QuantiseOptions& options) {
+	bool usable[256];
+
+	BuildPalette(BuildHistogram(rgba, w, h, pitch, options.transparentIndex >= 0), palette, usable, options);
+
+	unsigned colours = 0;
+	for (int i = 0; i < 256; i++) colours += usable[i];
+
+	// The cube is 32KB, so it lives on the heap rather than the caller's stack
+	std::unique_ptr<PaletteLookup> lookup(new PaletteLookup());
+	lookup->Build(palette, usable);
+
+	MapPixels(rgba, w, h, pitch, dst, *lookup, options, colours);
+}
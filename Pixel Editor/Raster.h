@@ -0,0 +1,451 @@
+#pragma once
+
+#include <SDL.h>
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <climits>
+
+#include "Memory.h"
+#include "SIMD.h"
+
+// A horizontal run of pixels, x0 <= x < x1 on row y
+struct span {
+	int y;
+	int x0, x1;
+};
+
+// Number of steps along the major axis of a line, which is one less than its pixel count
+static int LineSteps(int x0, int y0, int x1, int y1) {
+	return std::max(abs(x1 - x0), abs(y1 - y0));
+}
+
+// Bresenham, with each row's run of pixels merged into one span. Only steps first to last along the major axis
+// are produced, and the minor axis is found from the step index, so a clipped line keeps exactly the pixels
+// the whole line would have there.
+// https://en.wikipedia.org/wiki/Bresenham%27s_line_algorithm
+static void LineSpans(int x0, int y0, int x1, int y1, std::vector<span>& out, int first = 0, int last = INT_MAX) {
+	int dx = abs(x1 - x0);
+	int dy = abs(y1 - y0);
+	int sx = x0 < x1 ? 1 : -1;
+	int sy = y0 < y1 ? 1 : -1;
+	int steps = std::max(dx, dy);
+
+	first = std::max(first, 0);
+	last = std::min(last, steps);
+	if (first > last) return;
+
+	if (steps == 0) {
+		out.push_back({ y0, x0, x0 + 1 });
+		return;
+	}
+
+	bool xMajor = dx >= dy;
+	int minorDelta = xMajor ? dy : dx;
+
+	// Minor offset at step i is floor((2 * i * minorDelta + steps) / (2 * steps)), kept as quotient and remainder
+	long long numerator = 2LL * first * minorDelta + steps;
+	int offset = (int)(numerator / (2LL * steps));
+	long long remainder = numerator % (2LL * steps);
+
+	span run = { 0, 0, 0 };
+	bool open = false;
+
+	for (int i = first; i <= last; i++) {
+		int x = xMajor ? x0 + sx * i : x0 + sx * offset;
+		int y = xMajor ? y0 + sy * offset : y0 + sy * i;
+
+		if (open && y == run.y) {
+			run.x0 = std::min(run.x0, x);
+			run.x1 = std::max(run.x1, x + 1);
+		}
+		else {
+			if (open) out.push_back(run);
+			run = { y, x, x + 1 };
+			open = true;
+		}
+
+		remainder += 2LL * minorDelta;
+		if (remainder >= 2LL * steps) {
+			remainder -= 2LL * steps;
+			offset++;
+		}
+	}
+	out.push_back(run);
+}
+
+// Trims spans from begin onwards to a rectangle, dropping any that fall outside it
+static void ClipSpans(std::vector<span>& spans, SDL_Rect bounds, size_t begin = 0) {
+	size_t kept = begin;
+	for (size_t i = begin; i < spans.size(); i++) {
+		span s = spans[i];
+		if (s.y < bounds.y || s.y >= bounds.y + bounds.h) continue;
+		s.x0 = std::max(s.x0, bounds.x);
+		s.x1 = std::min(s.x1, bounds.x + bounds.w);
+		if (s.x0 < s.x1) spans[kept++] = s;
+	}
+	spans.resize(kept);
+}
+
+#define CLIP_INSIDE 0
+#define CLIP_LEFT 1
+#define CLIP_RIGHT 2
+#define CLIP_BOTTOM 4
+#define CLIP_TOP 8
+
+static int ClipCode(double x, double y, SDL_Rect r) {
+	int code = CLIP_INSIDE;
+	if (x < r.x) code |= CLIP_LEFT;
+	else if (x > r.x + r.w - 1) code |= CLIP_RIGHT;
+	if (y < r.y) code |= CLIP_TOP;
+	else if (y > r.y + r.h - 1) code |= CLIP_BOTTOM;
+	return code;
+}
+
+// Cohen-Sutherland. Trims the segment to the rectangle, returning false if none of it is inside.
+// The clipped endpoints are left unrounded so callers can map them back onto the original line.
+// https://en.wikipedia.org/wiki/Cohen%E2%80%93Sutherland_algorithm
+static bool ClipLine(double& ax, double& ay, double& bx, double& by, SDL_Rect r) {
+	if (r.w <= 0 || r.h <= 0) return false;
+
+	double left = r.x, right = r.x + r.w - 1, top = r.y, bottom = r.y + r.h - 1;
+
+	int codeA = ClipCode(ax, ay, r);
+	int codeB = ClipCode(bx, by, r);
+
+	while (1) {
+		if (!(codeA | codeB)) return true;
+		if (codeA & codeB) return false;
+
+		int code = codeA ? codeA : codeB;
+		double x, y;
+
+		if (code & CLIP_TOP) {
+			x = ax + (bx - ax) * (top - ay) / (by - ay);
+			y = top;
+		}
+		else if (code & CLIP_BOTTOM) {
+			x = ax + (bx - ax) * (bottom - ay) / (by - ay);
+			y = bottom;
+		}
+		else if (code & CLIP_RIGHT) {
+			y = ay + (by - ay) * (right - ax) / (bx - ax);
+			x = right;
+		}
+		else {
+			y = ay + (by - ay) * (left - ax) / (bx - ax);
+			x = left;
+		}
+
+		if (code == codeA) {
+			ax = x;
+			ay = y;
+			codeA = ClipCode(ax, ay, r);
+		}
+		else {
+			bx = x;
+			by = y;
+			codeB = ClipCode(bx, by, r);
+		}
+	}
+}
+
+// Finds which steps of a line (see LineSpans) lie inside a rectangle, with a step of slack either side for rounding.
+// Returns false if the line misses the rectangle.
+static bool ClipLineSteps(int x0, int y0, int x1, int y1, SDL_Rect r, int& first, int& last) {
+	// Pixels stray up to half a pixel from the true line, so clip against a slightly larger rectangle
+	double ax = x0, ay = y0, bx = x1, by = y1;
+	if (!ClipLine(ax, ay, bx, by, { r.x - 1, r.y - 1, r.w + 2, r.h + 2 })) return false;
+
+	int steps = LineSteps(x0, y0, x1, y1);
+	first = 0;
+	last = steps;
+	if (steps == 0) return true;
+
+	bool xMajor = abs(x1 - x0) >= abs(y1 - y0);
+	double start = xMajor ? x0 : y0;
+	double dir = xMajor ? (x1 > x0 ? 1 : -1) : (y1 > y0 ? 1 : -1);
+	double a = ((xMajor ? ax : ay) - start) * dir;
+	double b = ((xMajor ? bx : by) - start) * dir;
+
+	first = (int)floor(std::min(a, b)) - 1;
+	last = (int)ceil(std::max(a, b)) + 1;
+	return true;
+}
+
+// Appends the spans of the part of a line inside a rectangle
+static void ClippedLineSpans(int x0, int y0, int x1, int y1, SDL_Rect r, std::vector<span>& out) {
+	int first, last;
+	if (!ClipLineSteps(x0, y0, x1, y1, r, first, last)) return;
+
+	size_t begin = out.size();
+	LineSpans(x0, y0, x1, y1, out, first, last);
+	ClipSpans(out, r, begin);
+}
+
+// Writes a colour into every span of an 8-bit image. Spans must already be clipped to it.
+static void FillSpans(Uint8* pixels, unsigned pitch, const std::vector<span>& spans, Uint8 colour) {
+	for (const span& s : spans)
+		memset(pixels + (size_t)s.y * pitch + s.x0, colour, s.x1 - s.x0);
+}
+
+// Non-contiguous fill of up to 64 pixels: each pixel of index from whose bit is set in allowed becomes to.
+// A whole row is compared in four vectors before anything is written, and rows without a match are left
+// untouched. Returns the bits of the pixels changed.
+static Uint64 ReplaceRow(Uint8* row, int count, Uint8 from, Uint8 to, Uint64 allowed) {
+	Uint64 matched = 0;
+	int x = 0;
+
+#ifdef SIMD_SSE2
+	const __m128i target = _mm_set1_epi8((char)from);
+	for (; x + 16 <= count; x += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(row + x));
+		matched |= (Uint64)(Uint16)_mm_movemask_epi8(_mm_cmpeq_epi8(v, target)) << x;
+	}
+#endif
+	for (; x < count; x++)
+		if (row[x] == from) matched |= 1ULL << x;
+
+	matched &= allowed;
+	if (matched == 0) return 0;
+
+	x = 0;
+#ifdef SIMD_SSE2
+	// Each lane picks out its own bit of the match mask, then blends the new index in where it is set
+	const __m128i value = _mm_set1_epi8((char)to);
+	const __m128i lanes = _mm_set_epi8((char)128, 64, 32, 16, 8, 4, 2, 1, (char)128, 64, 32, 16, 8, 4, 2, 1);
+	for (; x + 16 <= count; x += 16) {
+		Uint64 bits = (matched >> x) & 0xFFFF;
+		if (bits == 0) continue;
+
+		__m128i spread = _mm_set_epi64x((long long)((bits >> 8) * 0x0101010101010101ULL), (long long)((bits & 0xFF) * 0x0101010101010101ULL));
+		__m128i blend = _mm_cmpeq_epi8(_mm_and_si128(spread, lanes), lanes);
+		__m128i v = _mm_loadu_si128((const __m128i*)(row + x));
+		_mm_storeu_si128((__m128i*)(row + x), _mm_or_si128(_mm_andnot_si128(blend, v), _mm_and_si128(blend, value)));
+	}
+#endif
+	for (; x < count; x++)
+		if ((matched >> x) & 1) row[x] = to;
+
+	return matched;
+}
+
+// Smallest rectangle holding every span, or an empty one if there are none
+static SDL_Rect SpanBounds(const std::vector<span>& spans) {
+	if (spans.empty()) return { 0,0,0,0 };
+
+	int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+	for (const span& s : spans) {
+		x0 = std::min(x0, s.x0);
+		x1 = std::max(x1, s.x1);
+		y0 = std::min(y0, s.y);
+		y1 = std::max(y1, s.y + 1);
+	}
+	return { x0, y0, x1 - x0, y1 - y0 };
+}
+
+// Sorts spans from begin onwards by row and joins any that touch, so each pixel is covered once
+static void MergeSpans(std::vector<span>& spans, size_t begin = 0) {
+	if (spans.size() < begin + 2) return;
+
+	std::sort(spans.begin() + begin, spans.end(), [](const span& a, const span& b) {
+		return a.y != b.y ? a.y < b.y : a.x0 < b.x0;
+	});
+
+	size_t kept = begin;
+	for (size_t i = begin + 1; i < spans.size(); i++) {
+		span& last = spans[kept];
+		if (spans[i].y == last.y && spans[i].x0 <= last.x1) last.x1 = std::max(last.x1, spans[i].x1);
+		else spans[++kept] = spans[i];
+	}
+	spans.resize(kept + 1);
+}
+
+// Rectangle with corners (x0,y0) and (x1,y1), both included. Only rows inside clip are produced.
+static void RectSpans(int x0, int y0, int x1, int y1, bool filled, SDL_Rect clip, std::vector<span>& out) {
+	if (x0 > x1) std::swap(x0, x1);
+	if (y0 > y1) std::swap(y0, y1);
+
+	size_t begin = out.size();
+	int top = std::max(y0, clip.y);
+	int bottom = std::min(y1, clip.y + clip.h - 1);
+
+	for (int y = top; y <= bottom; y++) {
+		if (filled || y == y0 || y == y1 || x1 - x0 < 2) out.push_back({ y, x0, x1 + 1 });
+		else {
+			out.push_back({ y, x0, x0 + 1 });
+			out.push_back({ y, x1, x1 + 1 });
+		}
+	}
+
+	ClipSpans(out, clip, begin);
+}
+
+// Ellipse fitting the rectangle with corners (x0,y0) and (x1,y1), using integer midpoint stepping.
+// Even sized ellipses are handled, so the shape always fills the dragged rectangle.
+// http://members.chello.at/easyfilter/bresenham.html
+static void EllipseSpans(int x0, int y0, int x1, int y1, bool filled, SDL_Rect clip, std::vector<span>& out) {
+	long long a = abs(x1 - x0), b = abs(y1 - y0), b1 = b & 1;
+	long long dx = 4 * (1 - a) * b * b, dy = 4 * (b1 + 1) * a * a;
+	long long err = dx + dy + b1 * a * a, e2;
+
+	if (x0 > x1) {
+		x0 = x1;
+		x1 += (int)a;
+	}
+	if (y0 > y1) y0 = y1;
+
+	int top = y0;
+	int rows = (int)b + 1;
+
+	// Leftmost and rightmost outline pixels of each half, per row. Shape previews redo this every frame.
+	std::vector<int>& leftMin = SDLG::ScratchBuffer<int, 0>(rows);
+	std::vector<int>& leftMax = SDLG::ScratchBuffer<int, 1>(rows);
+	std::vector<int>& rightMin = SDLG::ScratchBuffer<int, 2>(rows);
+	std::vector<int>& rightMax = SDLG::ScratchBuffer<int, 3>(rows);
+	std::fill(leftMin.begin(), leftMin.end(), INT_MAX);
+	std::fill(leftMax.begin(), leftMax.end(), INT_MIN);
+	std::fill(rightMin.begin(), rightMin.end(), INT_MAX);
+	std::fill(rightMax.begin(), rightMax.end(), INT_MIN);
+	auto plot = [&](int x, int y, bool left) {
+		int row = y - top;
+		if (row < 0 || row >= rows) return;
+		if (left) {
+			leftMin[row] = std::min(leftMin[row], x);
+			leftMax[row] = std::max(leftMax[row], x);
+		}
+		else {
+			rightMin[row] = std::min(rightMin[row], x);
+			rightMax[row] = std::max(rightMax[row], x);
+		}
+	};
+
+	y0 += (int)(b + 1) / 2;
+	y1 = y0 - (int)b1;
+	a *= 8 * a;
+	b1 = 8 * b * b;
+
+	do {
+		plot(x1, y0, false);
+		plot(x0, y0, true);
+		plot(x0, y1, true);
+		plot(x1, y1, false);
+		e2 = 2 * err;
+		if (e2 <= dy) {
+			y0++;
+			y1--;
+			err += dy += a;
+		}
+		if (e2 >= dx || 2 * err > dy) {
+			x0++;
+			x1--;
+			err += dx += b1;
+		}
+	} while (x0 <= x1);
+
+	// Flat ellipses stop early, so finish their tips
+	while (y0 - y1 < b) {
+		plot(x0 - 1, y0, true);
+		plot(x1 + 1, y0++, false);
+		plot(x0 - 1, y1, true);
+		plot(x1 + 1, y1--, false);
+	}
+
+	size_t begin = out.size();
+	int first = std::max(0, clip.y - top);
+	int last = std::min(rows - 1, clip.y + clip.h - 1 - top);
+
+	for (int row = first; row <= last; row++) {
+		int l0 = leftMin[row], l1 = leftMax[row], r0 = rightMin[row], r1 = rightMax[row];
+		if (l0 > l1) {
+			l0 = r0;
+			l1 = r1;
+		}
+		if (r0 > r1) {
+			r0 = l0;
+			r1 = l1;
+		}
+		if (l0 > l1) continue;
+
+		if (filled || l1 + 1 >= r0) out.push_back({ top + row, l0, r1 + 1 });
+		else {
+			out.push_back({ top + row, l0, l1 + 1 });
+			out.push_back({ top + row, r0, r1 + 1 });
+		}
+	}
+
+	ClipSpans(out, clip, begin);
+}
+
+struct polygonEdge {
+	int yTop, yBottom; // Rows yTop <= y < yBottom cross the edge
+	double x, slope;   // x at the current row, and its change per row
+};
+
+// Closed polygon through the points. The fill uses the even-odd rule at pixel centres, with the outline
+// added so the filled and outlined shapes share edges. Rows are walked with an active edge table.
+static void PolygonSpans(const std::vector<SDL_Point>& points, bool filled, SDL_Rect clip, std::vector<span>& out) {
+	size_t n = points.size();
+	if (n == 0) return;
+
+	size_t begin = out.size();
+
+	for (size_t i = 0; i < n; i++) {
+		const SDL_Point& a = points[i];
+		const SDL_Point& b = points[(i + 1) % n];
+		ClippedLineSpans(a.x, a.y, b.x, b.y, clip, out);
+	}
+
+	if (filled && n >= 3) {
+		std::vector<polygonEdge>& edges = SDLG::ScratchBuffer<polygonEdge, 0>(0);
+		int top = INT_MAX, bottom = INT_MIN;
+
+		for (size_t i = 0; i < n; i++) {
+			SDL_Point a = points[i];
+			SDL_Point b = points[(i + 1) % n];
+			if (a.y == b.y) continue;
+			if (a.y > b.y) std::swap(a, b);
+
+			double slope = (b.x - a.x) / (double)(b.y - a.y);
+			edges.push_back({ a.y, b.y, (double)a.x, slope });
+			top = std::min(top, a.y);
+			bottom = std::max(bottom, b.y);
+		}
+
+		std::sort(edges.begin(), edges.end(), [](const polygonEdge& a, const polygonEdge& b) {
+			return a.yTop < b.yTop;
+		});
+
+		std::vector<polygonEdge>& active = SDLG::ScratchBuffer<polygonEdge, 1>(0);
+		std::vector<double>& crossings = SDLG::ScratchBuffer<double>(0);
+		size_t next = 0;
+
+		int last = std::min(bottom, clip.y + clip.h) - 1;
+		for (int y = top; y <= last; y++) {
+			// Move edges starting on this row into the table, and drop finished ones
+			while (next < edges.size() && edges[next].yTop == y) active.push_back(edges[next++]);
+			active.erase(std::remove_if(active.begin(), active.end(), [y](const polygonEdge& e) {
+				return e.yBottom <= y;
+			}), active.end());
+
+			if (y >= clip.y) {
+				crossings.clear();
+				for (const polygonEdge& e : active) crossings.push_back(e.x);
+				std::sort(crossings.begin(), crossings.end());
+
+				for (size_t i = 0; i + 1 < crossings.size(); i += 2) {
+					int x0 = (int)ceil(crossings[i]);
+					int x1 = (int)ceil(crossings[i + 1]);
+					if (x0 < x1) out.push_back({ y, x0, x1 });
+				}
+			}
+
+			for (polygonEdge& e : active) e.x += e.slope;
+		}
+	}
+
+	ClipSpans(out, clip, begin);
+	MergeSpans(out, begin);
+}
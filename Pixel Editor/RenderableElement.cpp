@@ -1,4 +1,5 @@
 #include "RenderableElement.h"
+#include "Memory.h"
 std::vector<RenderableElement*> RenderableElement::elements = std::vector<RenderableElement*>();
 
 RenderableElement::RenderableElement() {
@@ -6,6 +7,7 @@ RenderableElement::RenderableElement() {
 }
 
 RenderableElement::~RenderableElement() {
+	ReleaseCache();
 	auto iter = std::find(elements.begin(), elements.end(), this);
 	if (iter != elements.end())
 		elements.erase(iter);
@@ -19,6 +21,67 @@ void RenderableElement::UpdateAllElements() {
 
 void RenderableElement::RenderAllElements(SDL_Renderer* r) {
 	for (RenderableElement* e : elements)
-		if (e->visible)
-			e->render(r);
+		if (e->visible) {
+			if (e->cached) e->RenderCached(r);
+			else e->render(r);
+		}
+}
+
+void RenderableElement::InvalidateCaches() {
+	for (RenderableElement* e : elements) e->cacheDirty = true;
+}
+
+void RenderableElement::ReleaseCache() {
+	if (cache == NULL) return;
+	SDLG::TrackTexture(cache, SDLG::MemoryTag::UI, false);
+	SDL_DestroyTexture(cache);
+	cache = NULL;
+}
+
+void RenderableElement::RenderCached(SDL_Renderer* r) {
+	SDL_Rect bounds = GetCacheBounds();
+	if (bounds.w <= 0 || bounds.h <= 0) return;
+	if (CacheChanged()) cacheDirty = true;
+
+	if (cache == NULL || bounds.w != cacheBounds.w || bounds.h != cacheBounds.h) {
+		ReleaseCache();
+		if (SDL_RenderTargetSupported(r))
+			cache = SDL_CreateTexture(r, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_TARGET, bounds.w, bounds.h);
+
+		// Without render targets the element is drawn directly, as if it weren't cached
+		if (cache == NULL) {
+			render(r);
+			return;
+		}
+		// Drawing into the cache already multiplied colours by their alpha, so copying it out must not do so again
+		static const SDL_BlendMode premultiplied = SDL_ComposeCustomBlendMode(
+			SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD,
+			SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD);
+		if (SDL_SetTextureBlendMode(cache, premultiplied) != 0) SDL_SetTextureBlendMode(cache, SDL_BLENDMODE_BLEND);
+		SDLG::TrackTexture(cache, SDLG::MemoryTag::UI, true);
+		cacheDirty = true;
+	}
+	if (bounds.x != cacheBounds.x || bounds.y != cacheBounds.y) cacheDirty = true;
+	cacheBounds = bounds;
+
+	if (cacheDirty) {
+		SDL_Texture* target = SDL_GetRenderTarget(r);
+		SDL_Rect viewport;
+		SDL_RenderGetViewport(r, &viewport);
+
+		SDL_SetRenderTarget(r, cache);
+		SDL_SetRenderDrawColor(r, 0, 0, 0, 0);
+		SDL_RenderClear(r);
+
+		// Offset rather than a negative viewport, which some renderers can't hold
+		renderOrigin = { bounds.x, bounds.y };
+		render(r);
+		renderOrigin = { 0,0 };
+
+		SDL_SetRenderTarget(r, target);
+		SDL_RenderSetViewport(r, &viewport);
+		cacheDirty = false;
+	}
+
+	SDL_RenderCopy(r, cache, NULL, &bounds);
 }
\ No newline at end of file
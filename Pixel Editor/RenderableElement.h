@@ -18,9 +18,31 @@ class RenderableElement {
 protected:
 	static std::vector<RenderableElement*> elements;
 
+	// Retained rendering: a cached element's last drawing, and the window area it covers
+	SDL_Texture* cache = NULL;
+	SDL_Rect cacheBounds = { 0,0,0,0 };
+	bool cacheDirty = true;
+
+	// Window point at the target's top left while drawing into the cache, and 0,0 otherwise.
+	// Cached elements subtract it from what they draw.
+	SDL_Point renderOrigin = { 0,0 };
+
 	void TryCall(callback c) {
 		if (c != NULL) c(this);
 	}
+
+	void RenderCached(SDL_Renderer*);
+	void ReleaseCache();
+
+	// Window area a cached element draws into, shadows and borders included. A change redraws the cache.
+	virtual SDL_Rect GetCacheBounds() {
+		return { 0,0,0,0 };
+	}
+
+	// Polled each frame before a cached element is drawn, for inputs it can't be told about. True redraws the cache.
+	virtual bool CacheChanged() {
+		return false;
+	}
 public:
 	callback OnUpdate = NULL;
 	callback OnRender = NULL;
@@ -28,6 +50,15 @@ public:
 	bool active = true;
 	bool visible = true;
 
+	// Cached elements draw into a texture only when dirty, and copy it out every frame. render() draws in window
+	// coordinates less renderOrigin.
+	bool cached = false;
+
+	// Redraws the cache before it is next shown
+	void MarkDirty() {
+		cacheDirty = true;
+	}
+
 	RenderableElement();
 	~RenderableElement();
 
@@ -40,6 +71,9 @@ public:
 
 	static void UpdateAllElements();
 	static void RenderAllElements(SDL_Renderer*);
+
+	// Render targets lose their contents when the device is reset
+	static void InvalidateCaches();
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,458 @@
+#pragma once
+
+#include <SDL.h>
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#include "Jobs.h"
+#include "Memory.h"
+#include "SIMD.h"
+
+// Resizing of indexed images. Everything works on palette indices, telling colours apart only by whether they're
+// the same index, so no new colours are made and the palette is left alone. Output rows are split into bands
+// over the job system, and the pixel art kernels do 16 pixels at a time with SSE2.
+
+enum class ScaleMode {
+	Nearest,
+	Scale2x,
+	Scale3x,
+	EPX,
+	XBR      // Edge detection over the 5x5 neighbourhood of 2xBR, filling whole corners rather than blending
+};
+
+static const char* ScaleModeName(ScaleMode mode) {
+	switch (mode) {
+	case ScaleMode::Nearest: return "Nearest";
+	case ScaleMode::Scale2x: return "Scale2x";
+	case ScaleMode::Scale3x: return "Scale3x";
+	case ScaleMode::EPX:     return "EPX";
+	case ScaleMode::XBR:     return "xBR";
+	}
+	return "";
+}
+
+// The factor each pass of a mode scales by, or 0 for one that takes any factor
+static int ScaleModeFactor(ScaleMode mode) {
+	switch (mode) {
+	case ScaleMode::Scale2x:
+	case ScaleMode::EPX:
+	case ScaleMode::XBR:
+		return 2;
+	case ScaleMode::Scale3x:
+		return 3;
+	default:
+		return 0;
+	}
+}
+
+// Rows a band of the job system should have, so each band writes about 16K pixels
+static int ResampleGrain(int rowPixels) {
+	return std::max(1, 16384 / std::max(1, rowPixels));
+}
+
+#ifdef SIMD_SSE2
+static inline __m128i SelectBytes(__m128i mask, __m128i a, __m128i b) {
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// 1 in each byte where a and b differ, 0 where they match
+static inline __m128i DifferBytes(__m128i a, __m128i b) {
+	return _mm_andnot_si128(_mm_cmpeq_epi8(a, b), _mm_set1_epi8(1));
+}
+#endif
+
+// Samples the pixel under the centre of each destination pixel, so any ratio works, shrinking included.
+// Destination rows that take the same source row are copied from the first rather than sampled again.
+static void ResampleNearest(const Uint8* src, int sw, int sh, Uint8* dst, int dw, int dh) {
+	if (sw <= 0 || sh <= 0 || dw <= 0 || dh <= 0) return;
+
+	std::vector<int> columns(dw);
+	for (int x = 0; x < dw; x++) columns[x] = (int)(((Sint64)x * 2 + 1) * sw / ((Sint64)dw * 2));
+	bool whole = dw % sw == 0;
+	int factor = dw / sw;
+
+	auto sourceRow = [&](int y) { return (int)(((Sint64)y * 2 + 1) * sh / ((Sint64)dh * 2)); };
+
+	SDLG::ParallelFor(0, dh, [&](int y0, int y1) {
+		for (int y = y0; y < y1; y++) {
+			Uint8* out = dst + (size_t)y * dw;
+			int sy = sourceRow(y);
+			if (y > y0 && sourceRow(y - 1) == sy) {
+				memcpy(out, out - dw, dw);
+				continue;
+			}
+
+			const Uint8* in = src + (size_t)sy * sw;
+			int x = 0;
+#ifdef SIMD_SSE2
+			// Doubling and quadrupling are byte unpacks of the source row with itself
+			if (whole && (factor == 2 || factor == 4)) {
+				for (int sx = 0; sx + 16 <= sw; sx += 16, x += 16 * factor) {
+					__m128i v = _mm_loadu_si128((const __m128i*)(in + sx));
+					__m128i lo = _mm_unpacklo_epi8(v, v), hi = _mm_unpackhi_epi8(v, v);
+					if (factor == 2) {
+						_mm_storeu_si128((__m128i*)(out + x), lo);
+						_mm_storeu_si128((__m128i*)(out + x + 16), hi);
+						continue;
+					}
+					_mm_storeu_si128((__m128i*)(out + x), _mm_unpacklo_epi8(lo, lo));
+					_mm_storeu_si128((__m128i*)(out + x + 16), _mm_unpackhi_epi8(lo, lo));
+					_mm_storeu_si128((__m128i*)(out + x + 32), _mm_unpacklo_epi8(hi, hi));
+					_mm_storeu_si128((__m128i*)(out + x + 48), _mm_unpackhi_epi8(hi, hi));
+				}
+			}
+#endif
+			if (whole && factor > 4)
+				for (; x < dw; x += factor) memset(out + x, in[x / factor], factor);
+			for (; x < dw; x++) out[x] = in[columns[x]];
+		}
+	}, ResampleGrain(dw));
+}
+
+// Scale2x decides each quarter of a pixel from the four pixels beside it. EPX is the same rules written another
+// way, so both modes come here. Edge pixels repeat themselves as their missing neighbours. T is Uint8 for
+// indices, or Uint16 where a value outside the palette stands for transparency.
+template <class T>
+static void Scale2xRow(const T* up, const T* row, const T* down, int w, T* out0, T* out1) {
+	auto scalar = [&](int x) {
+		T p = row[x];
+		T a = up[x];
+		T d = down[x];
+		T c = row[x > 0 ? x - 1 : x];
+		T b = row[x < w - 1 ? x + 1 : x];
+
+		out0[x * 2]     = (c == a && c != d && a != b) ? a : p;
+		out0[x * 2 + 1] = (a == b && a != c && b != d) ? b : p;
+		out1[x * 2]     = (d == c && d != b && c != a) ? c : p;
+		out1[x * 2 + 1] = (b == d && b != a && d != c) ? d : p;
+	};
+
+	if (w <= 0) return;
+	scalar(0);
+	int x = 1;
+
+#ifdef SIMD_SSE2
+	static_assert(sizeof(T) == 1 || sizeof(T) == 2, "Scale2x works on 8 or 16 bit values");
+	const int lanes = 16 / sizeof(T);
+	auto equal = [](__m128i a, __m128i b) {
+		if constexpr (sizeof(T) == 1) return _mm_cmpeq_epi8(a, b);
+		else return _mm_cmpeq_epi16(a, b);
+	};
+	auto interleaveLow = [](__m128i a, __m128i b) {
+		if constexpr (sizeof(T) == 1) return _mm_unpacklo_epi8(a, b);
+		else return _mm_unpacklo_epi16(a, b);
+	};
+	auto interleaveHigh = [](__m128i a, __m128i b) {
+		if constexpr (sizeof(T) == 1) return _mm_unpackhi_epi8(a, b);
+		else return _mm_unpackhi_epi16(a, b);
+	};
+
+	for (; x + lanes < w; x += lanes) {
+		__m128i p = _mm_loadu_si128((const __m128i*)(row + x));
+		__m128i a = _mm_loadu_si128((const __m128i*)(up + x));
+		__m128i d = _mm_loadu_si128((const __m128i*)(down + x));
+		__m128i c = _mm_loadu_si128((const __m128i*)(row + x - 1));
+		__m128i b = _mm_loadu_si128((const __m128i*)(row + x + 1));
+
+		__m128i ca = equal(c, a), cd = equal(c, d);
+		__m128i ab = equal(a, b), bd = equal(b, d);
+
+		__m128i e0 = SelectBytes(_mm_andnot_si128(_mm_or_si128(cd, ab), ca), a, p);
+		__m128i e1 = SelectBytes(_mm_andnot_si128(_mm_or_si128(ca, bd), ab), b, p);
+		__m128i e2 = SelectBytes(_mm_andnot_si128(_mm_or_si128(bd, ca), cd), c, p);
+		__m128i e3 = SelectBytes(_mm_andnot_si128(_mm_or_si128(ab, cd), bd), d, p);
+
+		_mm_storeu_si128((__m128i*)(out0 + x * 2), interleaveLow(e0, e1));
+		_mm_storeu_si128((__m128i*)(out0 + x * 2 + lanes), interleaveHigh(e0, e1));
+		_mm_storeu_si128((__m128i*)(out1 + x * 2), interleaveLow(e2, e3));
+		_mm_storeu_si128((__m128i*)(out1 + x * 2 + lanes), interleaveHigh(e2, e3));
+	}
+#endif
+
+	for (; x < w; x++) scalar(x);
+}
+
+template <class T>
+static void Scale2xIndices(const T* src, int w, int h, T* dst) {
+	SDLG::ParallelFor(0, h, [&](int y0, int y1) {
+		for (int y = y0; y < y1; y++) {
+			const T* row = src + (size_t)y * w;
+			T* out0 = dst + (size_t)y * 2 * (w * 2);
+			Scale2xRow(y > 0 ? row - w : row, row, y < h - 1 ? row + w : row, w, out0, out0 + w * 2);
+		}
+	}, ResampleGrain(w * 4));
+}
+
+// Scale3x, with the neighbours named
+//   a b c
+//   d e f
+//   g h i
+// Its masks are worked out 16 pixels at a time. SSE2 has no byte shuffle to spread them three apart, so
+// each output row is interleaved from the stored results.
+static void Scale3xRow(const Uint8* up, const Uint8* row, const Uint8* down, int w, Uint8* out0, Uint8* out1, Uint8* out2) {
+	auto scalar = [&](int x) {
+		int l = x > 0 ? x - 1 : x, r = x < w - 1 ? x + 1 : x;
+		Uint8 a = up[l], b = up[x], c = up[r];
+		Uint8 d = row[l], e = row[x], f = row[r];
+		Uint8 g = down[l], h = down[x], i = down[r];
+
+		Uint8* o0 = out0 + x * 3;
+		Uint8* o1 = out1 + x * 3;
+		Uint8* o2 = out2 + x * 3;
+		if (b == h || d == f) {
+			memset(o0, e, 3);
+			memset(o1, e, 3);
+			memset(o2, e, 3);
+			return;
+		}
+		o0[0] = d == b ? d : e;
+		o0[1] = (d == b && e != c) || (b == f && e != a) ? b : e;
+		o0[2] = b == f ? f : e;
+		o1[0] = (d == b && e != g) || (d == h && e != a) ? d : e;
+		o1[1] = e;
+		o1[2] = (b == f && e != i) || (h == f && e != c) ? f : e;
+		o2[0] = d == h ? d : e;
+		o2[1] = (d == h && e != i) || (h == f && e != g) ? h : e;
+		o2[2] = h == f ? f : e;
+	};
+
+	if (w <= 0) return;
+	scalar(0);
+	int x = 1;
+
+#ifdef SIMD_SSE2
+	alignas(16) Uint8 lanes[9][16];
+	for (; x + 16 < w; x += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(up + x - 1));
+		__m128i b = _mm_loadu_si128((const __m128i*)(up + x));
+		__m128i c = _mm_loadu_si128((const __m128i*)(up + x + 1));
+		__m128i d = _mm_loadu_si128((const __m128i*)(row + x - 1));
+		__m128i e = _mm_loadu_si128((const __m128i*)(row + x));
+		__m128i f = _mm_loadu_si128((const __m128i*)(row + x + 1));
+		__m128i g = _mm_loadu_si128((const __m128i*)(down + x - 1));
+		__m128i h = _mm_loadu_si128((const __m128i*)(down + x));
+		__m128i i = _mm_loadu_si128((const __m128i*)(down + x + 1));
+
+		__m128i active = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(b, h), _mm_cmpeq_epi8(d, f)), _mm_set1_epi8(-1));
+		__m128i db = _mm_and_si128(active, _mm_cmpeq_epi8(d, b));
+		__m128i bf = _mm_and_si128(active, _mm_cmpeq_epi8(b, f));
+		__m128i dh = _mm_and_si128(active, _mm_cmpeq_epi8(d, h));
+		__m128i hf = _mm_and_si128(active, _mm_cmpeq_epi8(h, f));
+		__m128i ea = _mm_cmpeq_epi8(e, a), ec = _mm_cmpeq_epi8(e, c);
+		__m128i eg = _mm_cmpeq_epi8(e, g), ei = _mm_cmpeq_epi8(e, i);
+
+		_mm_store_si128((__m128i*)lanes[0], SelectBytes(db, d, e));
+		_mm_store_si128((__m128i*)lanes[1], SelectBytes(_mm_or_si128(_mm_andnot_si128(ec, db), _mm_andnot_si128(ea, bf)), b, e));
+		_mm_store_si128((__m128i*)lanes[2], SelectBytes(bf, f, e));
+		_mm_store_si128((__m128i*)lanes[3], SelectBytes(_mm_or_si128(_mm_andnot_si128(eg, db), _mm_andnot_si128(ea, dh)), d, e));
+		_mm_store_si128((__m128i*)lanes[4], e);
+		_mm_store_si128((__m128i*)lanes[5], SelectBytes(_mm_or_si128(_mm_andnot_si128(ei, bf), _mm_andnot_si128(ec, hf)), f, e));
+		_mm_store_si128((__m128i*)lanes[6], SelectBytes(dh, d, e));
+		_mm_store_si128((__m128i*)lanes[7], SelectBytes(_mm_or_si128(_mm_andnot_si128(ei, dh), _mm_andnot_si128(eg, hf)), h, e));
+		_mm_store_si128((__m128i*)lanes[8], SelectBytes(hf, f, e));
+
+		Uint8* outs[3] = { out0 + x * 3, out1 + x * 3, out2 + x * 3 };
+		for (int r = 0; r < 3; r++)
+			for (int k = 0; k < 16; k++) {
+				outs[r][k * 3]     = lanes[r * 3][k];
+				outs[r][k * 3 + 1] = lanes[r * 3 + 1][k];
+				outs[r][k * 3 + 2] = lanes[r * 3 + 2][k];
+			}
+	}
+#endif
+
+	for (; x < w; x++) scalar(x);
+}
+
+static void Scale3xIndices(const Uint8* src, int w, int h, Uint8* dst) {
+	SDLG::ParallelFor(0, h, [&](int y0, int y1) {
+		for (int y = y0; y < y1; y++) {
+			const Uint8* row = src + (size_t)y * w;
+			Uint8* out0 = dst + (size_t)y * 3 * (w * 3);
+			Scale3xRow(y > 0 ? row - w : row, row, y < h - 1 ? row + w : row, w, out0, out0 + w * 3, out0 + w * 6);
+		}
+	}, ResampleGrain(w * 9));
+}
+
+// One corner of a 2xBR pixel e, named for the bottom right one and mirrored for the others:
+//       b
+//    d  e  f  f4
+//       h  i  i4
+//       h5 i5
+// with c above f and g left of h. The corner takes f's colour when the edge through f and h is a better
+// match for the pixels around it than the one through e and i. Distance is 0 for the same index and 1 otherwise.
+static inline Uint8 XBRCorner(Uint8 e, Uint8 f, Uint8 h, Uint8 i, Uint8 c, Uint8 g, Uint8 f4, Uint8 h5, Uint8 d, Uint8 b, Uint8 i5, Uint8 i4) {
+	int across = (e != c) + (e != g) + (i != f4) + (i != h5) + 4 * (h != f);
+	int along = (h != d) + (h != i5) + (f != i4) + (f != b) + 4 * (e != i);
+	return across < along && e != f && e != h ? f : e;
+}
+
+#ifdef SIMD_SSE2
+static inline __m128i XBRCorner(__m128i e, __m128i f, __m128i h, __m128i i, __m128i c, __m128i g, __m128i f4, __m128i h5,
+	__m128i d, __m128i b, __m128i i5, __m128i i4) {
+	__m128i hf = DifferBytes(h, f), ei = DifferBytes(e, i);
+	hf = _mm_add_epi8(hf, hf);
+	ei = _mm_add_epi8(ei, ei);
+
+	__m128i across = _mm_add_epi8(_mm_add_epi8(DifferBytes(e, c), DifferBytes(e, g)), _mm_add_epi8(DifferBytes(i, f4), DifferBytes(i, h5)));
+	__m128i along = _mm_add_epi8(_mm_add_epi8(DifferBytes(h, d), DifferBytes(h, i5)), _mm_add_epi8(DifferBytes(f, i4), DifferBytes(f, b)));
+	across = _mm_add_epi8(across, _mm_add_epi8(hf, hf));
+	along = _mm_add_epi8(along, _mm_add_epi8(ei, ei));
+
+	__m128i same = _mm_or_si128(_mm_cmpeq_epi8(e, f), _mm_cmpeq_epi8(e, h));
+	return SelectBytes(_mm_andnot_si128(same, _mm_cmplt_epi8(across, along)), f, e);
+}
+#endif
+
+// rows holds the five source rows from two above to two below, repeated at the top and bottom edges
+static void XBRRow(const Uint8* const rows[5], int w, Uint8* out0, Uint8* out1) {
+	// Neighbour dx, dy from the pixel, mirrored by sx, sy to reach each corner
+	auto at = [&](int x, int dx, int dy) { return rows[2 + dy][std::max(0, std::min(w - 1, x + dx))]; };
+	auto corner = [&](int x, int sx, int sy) {
+		return XBRCorner(at(x, 0, 0), at(x, sx, 0), at(x, 0, sy), at(x, sx, sy), at(x, sx, -sy), at(x, -sx, sy),
+			at(x, 2 * sx, 0), at(x, 0, 2 * sy), at(x, -sx, 0), at(x, 0, -sy), at(x, sx, 2 * sy), at(x, 2 * sx, sy));
+	};
+	auto scalar = [&](int x) {
+		out0[x * 2]     = corner(x, -1, -1);
+		out0[x * 2 + 1] = corner(x, 1, -1);
+		out1[x * 2]     = corner(x, -1, 1);
+		out1[x * 2 + 1] = corner(x, 1, 1);
+	};
+
+	int x = 0;
+	for (; x < std::min(2, w); x++) scalar(x);
+
+#ifdef SIMD_SSE2
+	for (; x + 18 <= w; x += 16) {
+		__m128i n[5][5];
+		for (int dy = 0; dy < 5; dy++)
+			for (int dx = 0; dx < 5; dx++) n[dy][dx] = _mm_loadu_si128((const __m128i*)(rows[dy] + x + dx - 2));
+
+		__m128i e[4];
+		int k = 0;
+		for (int sy = -1; sy <= 1; sy += 2)
+			for (int sx = -1; sx <= 1; sx += 2) {
+				auto v = [&](int dx, int dy) { return n[2 + dy][2 + dx]; };
+				e[k++] = XBRCorner(v(0, 0), v(sx, 0), v(0, sy), v(sx, sy), v(sx, -sy), v(-sx, sy),
+					v(2 * sx, 0), v(0, 2 * sy), v(-sx, 0), v(0, -sy), v(sx, 2 * sy), v(2 * sx, sy));
+			}
+
+		_mm_storeu_si128((__m128i*)(out0 + x * 2), _mm_unpacklo_epi8(e[0], e[1]));
+		_mm_storeu_si128((__m128i*)(out0 + x * 2 + 16), _mm_unpackhi_epi8(e[0], e[1]));
+		_mm_storeu_si128((__m128i*)(out1 + x * 2), _mm_unpacklo_epi8(e[2], e[3]));
+		_mm_storeu_si128((__m128i*)(out1 + x * 2 + 16), _mm_unpackhi_epi8(e[2], e[3]));
+	}
+#endif
+
+	for (; x < w; x++) scalar(x);
+}
+
+static void XBRIndices(const Uint8* src, int w, int h, Uint8* dst) {
+	SDLG::ParallelFor(0, h, [&](int y0, int y1) {
+		for (int y = y0; y < y1; y++) {
+			const Uint8* rows[5];
+			for (int dy = -2; dy <= 2; dy++) rows[dy + 2] = src + (size_t)std::max(0, std::min(h - 1, y + dy)) * w;
+
+			Uint8* out0 = dst + (size_t)y * 2 * (w * 2);
+			XBRRow(rows, w, out0, out0 + w * 2);
+		}
+	}, ResampleGrain(w * 4));
+}
+
+// Scales w*h indices up by factor into dst, resizing it to fit. The pixel art modes run once for each time their
+// own factor goes into factor, so Scale2x by 8 is three passes, and nearest neighbour makes up anything left.
+static void UpscaleIndices(ScaleMode mode, const Uint8* src, int w, int h, int factor, std::vector<Uint8>& dst, std::vector<Uint8>& scratch) {
+	factor = std::max(1, factor);
+	int step = ScaleModeFactor(mode);
+
+	const Uint8* current = src;
+	std::vector<Uint8>* out = &dst;
+	std::vector<Uint8>* other = &scratch;
+	bool passed = false;
+
+	while (step > 0 && factor % step == 0) {
+		out->resize((size_t)w * step * h * step);
+		switch (mode) {
+		case ScaleMode::Scale3x: Scale3xIndices(current, w, h, out->data()); break;
+		case ScaleMode::XBR:     XBRIndices(current, w, h, out->data()); break;
+		default:                 Scale2xIndices(current, w, h, out->data()); break;
+		}
+		w *= step;
+		h *= step;
+		factor /= step;
+		current = out->data();
+		std::swap(out, other);
+		passed = true;
+	}
+
+	if (factor > 1 || !passed) {
+		out->resize((size_t)w * factor * h * factor);
+		ResampleNearest(current, w, h, out->data(), w * factor, h * factor);
+		std::swap(out, other);
+	}
+
+	if (other != &dst) dst.swap(scratch);
+}
+
+// Each factor*factor block becomes the index most of its pixels have, ties going to the one that got there first.
+// Blocks past the right and bottom edges vote with the pixels they have. Upscaled pixel art is mostly whole blocks
+// of one index, so blocks are first checked for that 16 columns at a time and only mixed ones are counted.
+static void DownscaleMajority(const Uint8* src, int w, int h, int factor, Uint8* dst) {
+	factor = std::max(1, factor);
+	int dw = (w + factor - 1) / factor, dh = (h + factor - 1) / factor;
+
+	SDLG::ParallelFor(0, dh, [&](int y0, int y1) {
+		std::vector<Uint8>& same = SDLG::ScratchBuffer<Uint8, 0>(w);
+		std::vector<Uint32>& counts = SDLG::ScratchBuffer<Uint32, 1>(256);
+		std::fill(counts.begin(), counts.end(), 0);
+
+		for (int by = y0; by < y1; by++) {
+			int top = by * factor, rows = std::min(factor, h - top);
+			const Uint8* first = src + (size_t)top * w;
+
+			// same[x] is 0xFF where every row of the block matches the first at column x
+			memset(same.data(), 0xFF, w);
+			for (int r = 1; r < rows; r++) {
+				const Uint8* row = first + (size_t)r * w;
+				int x = 0;
+#ifdef SIMD_SSE2
+				for (; x + 16 <= w; x += 16) {
+					__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(row + x)), _mm_loadu_si128((const __m128i*)(first + x)));
+					_mm_storeu_si128((__m128i*)(same.data() + x), _mm_and_si128(eq, _mm_loadu_si128((const __m128i*)(same.data() + x))));
+				}
+#endif
+				for (; x < w; x++) same[x] &= row[x] == first[x] ? 0xFF : 0;
+			}
+
+			Uint8* out = dst + (size_t)by * dw;
+			for (int bx = 0; bx < dw; bx++) {
+				int left = bx * factor, cols = std::min(factor, w - left);
+				Uint8 index = first[left];
+
+				bool uniform = true;
+				for (int x = left; x < left + cols && uniform; x++) uniform = same[x] != 0 && first[x] == index;
+				if (uniform) {
+					out[bx] = index;
+					continue;
+				}
+
+				Uint32 best = 0;
+				for (int r = 0; r < rows; r++) {
+					const Uint8* row = first + (size_t)r * w + left;
+					for (int x = 0; x < cols; x++)
+						if (++counts[row[x]] > best) {
+							best = counts[row[x]];
+							index = row[x];
+						}
+				}
+				for (int r = 0; r < rows; r++) {
+					const Uint8* row = first + (size_t)r * w + left;
+					for (int x = 0; x < cols; x++) counts[row[x]] = 0;
+				}
+				out[bx] = index;
+			}
+		}
+	}, ResampleGrain(w * factor));
+}
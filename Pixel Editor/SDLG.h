@@ -3,17 +3,27 @@
 #include <SDL.h>
 #include <SDL_image.h>
 #include "Generic.h"
+#include "Jobs.h"
+#include "Memory.h"
 
-#ifdef ERROR_LOGGING
 #include <string>
+#include <cstdio>
+
+#ifdef ERROR_LOGGING
 #include <iostream>
 #endif
 
+#ifndef TIME_HANDLED
+#include <algorithm>
+#endif
+
 #ifndef INPUT_HANDLED
 #include <map>
-#include <vector>
+#include <cstring>
 #endif
 
+#include <vector>
+
 // SDL-GAME
 namespace SDLG
 {
@@ -35,6 +45,10 @@ namespace SDLG
 
 	static bool gameRunning = true;
 
+	// Set while a recorded session is played back in place of live input
+	static bool replaying = false;
+	static std::vector<float> replayTimings; // Milliseconds each replayed frame took, input to present
+
 	static int windowWidth = 500;
 	static int windowHeight = 300;
 
@@ -44,39 +58,176 @@ namespace SDLG
 
 	static Uint32 windowFlags = SDL_WINDOW_INPUT_FOCUS | SDL_WINDOW_RESIZABLE | SDL_WINDOW_SHOWN;
 
+#ifdef ERROR_LOGGING
+
+	static void MakeLog(std::string message) {
+		std::cout << message;
+		SDL_Log(message.c_str());
+	}
+
+#endif // ERROR_LOGGING
+
 	// Programmer handles time stuff
 #ifndef TIME_HANDLED
 	static millitime currentTime = 0;
 	static millitime previousTime = 0;
 	static millitime deltaTime = 0;
 
-	static millitime minFrameDelta = 0;
+	// deltaTime as measured by the performance counter
+	static double deltaSeconds = 0;
 
-	static void HandleTime() {
-		previousTime = currentTime;
-		currentTime = SDL_GetTicks();
-		deltaTime = currentTime - previousTime;
+	enum class FramePacing {
+		VSync,    // Presenting waits for the display
+		Capped,   // Frames are held to frameRateCap
+		Uncapped, // Frames are made as fast as they can be
+		Late,     // VSync, with input sampled as close to the next refresh as the frame time allows
+	};
+
+	static FramePacing framePacing = FramePacing::Capped;
+	static double frameRateCap = 60;
+
+	struct frameStats {
+		double meanMs = 0;    // Between successive presents
+		double p99Ms = 0;
+		double worstMs = 0;
+		double latencyMs = 0; // Mean from sampling input to presenting
+		int frames = 0;       // Frames the figures cover
+	};
+
+#define FRAME_HISTORY 256
+
+	static Uint64 counterFrequency = 1;
+	static Uint64 startCounter = 0;
+	static Uint64 presentCounter = 0; // When the last frame finished
+	static Uint64 inputCounter = 0;   // When this frame's input was sampled
+	static Uint64 frameDeadline = 0;
+
+	static double sleepOvershoot = 0.002; // Seconds that sleeps have been seen to overrun by
+	static double workEstimate = 0.004;   // Seconds from input to present, following recent peaks
+	static double refreshInterval = 1.0 / 60;
+
+	static float frameIntervals[FRAME_HISTORY];
+	static float frameLatencies[FRAME_HISTORY];
+	static int frameHistoryCount = 0;
+	static int frameHistoryNext = 0;
 
-		// FPS is capped when a min delta time is given
-		if (minFrameDelta > 0 && deltaTime < minFrameDelta) {
-			millitime delayTime = minFrameDelta - deltaTime;
+	static double CounterSeconds(Uint64 ticks) {
+		return (double)ticks / counterFrequency;
+	}
+
+	// Sleeps while the deadline is further off than sleeps tend to overrun, then spins the rest of the way
+	static void WaitUntil(Uint64 deadline) {
+		while (true) {
+			Uint64 now = SDL_GetPerformanceCounter();
+			if (now >= deadline) return;
+
+			double sleepable = CounterSeconds(deadline - now) - sleepOvershoot;
+			if (sleepable < 0.001) continue;
 
-			deltaTime = minFrameDelta;
-			currentTime = previousTime + deltaTime;
+			Uint32 ms = (Uint32)(sleepable * 1000);
+			SDL_Delay(ms);
 
-			SDL_Delay(delayTime);
+			// Rises straight away and falls back slowly, so one lucky sleep doesn't cause a missed deadline
+			double over = CounterSeconds(SDL_GetPerformanceCounter() - now) - ms / 1000.0;
+			sleepOvershoot = over > sleepOvershoot ? over : sleepOvershoot * 0.99 + over * 0.01;
 		}
 	}
-#endif // !TIME_HANDLED
 
+	static void ApplyFramePacing() {
+		frameDeadline = SDL_GetPerformanceCounter();
+		if (gameRenderer == nullptr) return;
+
+		bool vsync = framePacing == FramePacing::VSync || framePacing == FramePacing::Late;
+		if (SDL_RenderSetVSync(gameRenderer, vsync ? 1 : 0) != 0) {
 #ifdef ERROR_LOGGING
+			MakeLog("Unable to change vsync: " + std::string(SDL_GetError()));
+#endif // ERROR_LOGGING
+		}
 
-	static void MakeLog(std::string message) {
-		std::cout << message;
-		SDL_Log(message.c_str());
+		SDL_DisplayMode mode;
+		if (SDL_GetWindowDisplayMode(gameWindow, &mode) == 0 && mode.refresh_rate > 0)
+			refreshInterval = 1.0 / mode.refresh_rate;
 	}
 
-#endif // ERROR_LOGGING
+	static void SetFramePacing(FramePacing pacing, double cap = frameRateCap) {
+		framePacing = pacing;
+		frameRateCap = cap;
+		ApplyFramePacing();
+	}
+
+	static void StartTime() {
+		counterFrequency = SDL_GetPerformanceFrequency();
+		startCounter = presentCounter = inputCounter = SDL_GetPerformanceCounter();
+		currentTime = previousTime = deltaTime = 0;
+		ApplyFramePacing();
+	}
+
+	// Late pacing holds off sampling input until just enough time is left to make the frame before the next refresh
+	static void BeginFrame() {
+		if (framePacing == FramePacing::Late && !replaying) {
+			double wait = refreshInterval - workEstimate - sleepOvershoot;
+			if (wait > 0) WaitUntil(presentCounter + (Uint64)(wait * counterFrequency));
+		}
+		inputCounter = SDL_GetPerformanceCounter();
+	}
+
+	static void HandleTime() {
+		Uint64 now = SDL_GetPerformanceCounter();
+		double work = CounterSeconds(now - inputCounter);
+
+		// Replays run flat out, with the clock set from the recording by HandleInput
+		if (replaying) {
+			replayTimings.push_back((float)(work * 1000));
+			return;
+		}
+		workEstimate = work > workEstimate ? work : workEstimate * 0.95 + work * 0.05;
+
+		// FPS is capped against a fixed schedule, so the intervals don't drift with the frame time
+		if (framePacing == FramePacing::Capped && frameRateCap > 0) {
+			frameDeadline += (Uint64)(counterFrequency / frameRateCap);
+			if (frameDeadline < now) frameDeadline = now; // Running late starts a new schedule rather than rushing to catch up
+			WaitUntil(frameDeadline);
+			now = SDL_GetPerformanceCounter();
+		}
+
+		deltaSeconds = CounterSeconds(now - presentCounter);
+		presentCounter = now;
+
+		frameIntervals[frameHistoryNext] = (float)(deltaSeconds * 1000);
+		frameLatencies[frameHistoryNext] = (float)(work * 1000);
+		frameHistoryNext = (frameHistoryNext + 1) % FRAME_HISTORY;
+		if (frameHistoryCount < FRAME_HISTORY) frameHistoryCount++;
+
+		previousTime = currentTime;
+		currentTime = (millitime)((now - startCounter) * 1000 / counterFrequency);
+		deltaTime = currentTime - previousTime;
+	}
+
+	// Over the last FRAME_HISTORY frames
+	static frameStats GetFrameStats() {
+		frameStats stats;
+		int n = frameHistoryCount;
+		stats.frames = n;
+		if (n == 0) return stats;
+
+		float sorted[FRAME_HISTORY];
+		double total = 0, latency = 0;
+		for (int i = 0; i < n; i++) {
+			sorted[i] = frameIntervals[i];
+			total += frameIntervals[i];
+			latency += frameLatencies[i];
+		}
+
+		int p99 = std::min(n - 1, (int)(n * 0.99));
+		std::nth_element(sorted, sorted + p99, sorted + n);
+		stats.p99Ms = sorted[p99];
+		stats.worstMs = *std::max_element(sorted + p99, sorted + n);
+		stats.meanMs = total / n;
+		stats.latencyMs = latency / n;
+		return stats;
+	}
+#endif // !TIME_HANDLED
+
 
 #ifndef INPUT_HANDLED
 
@@ -142,6 +293,16 @@ namespace SDLG
 			if (callback->active) callback->Callback(e);
 	}
 
+	// Runs RunAsync continuations on the main thread as their completion events come in
+	class JobCompletionCallback : public EventCallback {
+	public:
+		void Callback(SDL_Event& e) override {
+			JobSystem::Complete(e);
+		}
+	};
+
+	static JobCompletionCallback jobCompletion;
+
 	static bool keyPressed(SDL_Keycode key, keyboardData* pipe = &globalKeyboard) {
 		return pipe->keys_keycode[key].down > pipe->last_keys_keycode[key].down;
 	}
@@ -181,6 +342,259 @@ namespace SDLG
 		return globalMouseData.mouse_buttons[button].up > globalMouseData.mouse_buttons[button].down;
 	}
 
+	// Input recording. A session is written as a stream of records, each a Uint16 size followed by that many bytes:
+	// a size of 0 starts a frame and is followed by the Uint32 currentTime it ran at, anything else is an SDL_Event
+	// cut to the size of its type. Drop events carry their text after them as a Sint32 length (-1 for none) and bytes.
+#define RECORD_MAGIC "SDLGREC1"
+
+	static SDL_RWops* recordFile = nullptr;
+	static std::vector<Uint8> recordBuffer;
+	static bool recordStarted = false; // The header waits for the first frame, once the window exists
+
+	static std::vector<Uint8> replayData;
+	static size_t replayCursor = 0;
+	static Uint32 replayWindowID = 0;
+	static std::string replayReport;
+
+	// Set by the program to have a replay report end with a checksum of its state
+	static Uint64 (*replayChecksum)() = nullptr;
+
+	static Uint16 RecordedSize(const SDL_Event& e) {
+		switch (e.type) {
+		case SDL_KEYDOWN: case SDL_KEYUP: return sizeof(SDL_KeyboardEvent);
+		case SDL_MOUSEMOTION: return sizeof(SDL_MouseMotionEvent);
+		case SDL_MOUSEBUTTONDOWN: case SDL_MOUSEBUTTONUP: return sizeof(SDL_MouseButtonEvent);
+		case SDL_MOUSEWHEEL: return sizeof(SDL_MouseWheelEvent);
+		case SDL_WINDOWEVENT: return sizeof(SDL_WindowEvent);
+		case SDL_TEXTINPUT: return sizeof(SDL_TextInputEvent);
+		case SDL_DROPFILE: case SDL_DROPTEXT: case SDL_DROPBEGIN: case SDL_DROPCOMPLETE: return sizeof(SDL_DropEvent);
+		default: return sizeof(SDL_Event);
+		}
+	}
+
+	static bool IsDropEvent(Uint32 type) {
+		return type == SDL_DROPFILE || type == SDL_DROPTEXT || type == SDL_DROPBEGIN || type == SDL_DROPCOMPLETE;
+	}
+
+	// The window an event was sent to, so replays can aim it at their own window
+	static Uint32* EventWindowID(SDL_Event& e) {
+		switch (e.type) {
+		case SDL_KEYDOWN: case SDL_KEYUP: return &e.key.windowID;
+		case SDL_MOUSEMOTION: return &e.motion.windowID;
+		case SDL_MOUSEBUTTONDOWN: case SDL_MOUSEBUTTONUP: return &e.button.windowID;
+		case SDL_MOUSEWHEEL: return &e.wheel.windowID;
+		case SDL_WINDOWEVENT: return &e.window.windowID;
+		case SDL_TEXTINPUT: return &e.text.windowID;
+		default: return IsDropEvent(e.type) ? &e.drop.windowID : nullptr;
+		}
+	}
+
+	static void RecordBytes(const void* data, size_t size) {
+		const Uint8* bytes = (const Uint8*)data;
+		recordBuffer.insert(recordBuffer.end(), bytes, bytes + size);
+	}
+
+	// Every frame's input is recorded until StopRecording, from the next frame on. Replays start from a fresh program,
+	// so recordings should be started before StartSDL.
+	static bool StartRecording(const char* path) {
+		recordFile = SDL_RWFromFile(path, "wb");
+		if (recordFile == nullptr) {
+#ifdef ERROR_LOGGING
+			MakeLog("Unable to record to " + std::string(path) + ": " + std::string(SDL_GetError()));
+#endif // ERROR_LOGGING
+			return false;
+		}
+
+		recordBuffer.clear();
+		recordStarted = false;
+		return true;
+	}
+
+	static void StopRecording() {
+		if (recordFile == nullptr) return;
+		SDL_RWwrite(recordFile, recordBuffer.data(), 1, recordBuffer.size());
+		SDL_RWclose(recordFile);
+		recordFile = nullptr;
+		recordBuffer.clear();
+	}
+
+	static void RecordFrame() {
+		if (!recordStarted) {
+			RecordBytes(RECORD_MAGIC, 8);
+			Sint32 size[2] = { windowWidth, windowHeight };
+			RecordBytes(size, sizeof(size));
+			RecordBytes(&gameWindowID, sizeof(gameWindowID));
+			recordStarted = true;
+		}
+
+		Uint16 marker = 0;
+		Uint32 time = 0;
+#ifndef TIME_HANDLED
+		time = currentTime;
+#endif // !TIME_HANDLED
+		RecordBytes(&marker, sizeof(marker));
+		RecordBytes(&time, sizeof(time));
+	}
+
+	static void RecordEvent(const SDL_Event& e) {
+		Uint16 size = RecordedSize(e);
+		RecordBytes(&size, sizeof(size));
+		RecordBytes(&e, size);
+
+		if (IsDropEvent(e.type)) {
+			Sint32 length = e.drop.file == nullptr ? -1 : (Sint32)SDL_strlen(e.drop.file);
+			RecordBytes(&length, sizeof(length));
+			if (length > 0) RecordBytes(e.drop.file, length);
+		}
+	}
+
+	// Written once a frame, so a long session costs one write a frame rather than one per event
+	static void FlushRecording() {
+		if (recordFile == nullptr || recordBuffer.empty()) return;
+		SDL_RWwrite(recordFile, recordBuffer.data(), 1, recordBuffer.size());
+		recordBuffer.clear();
+	}
+
+	static bool ReplayRead(void* out, size_t size) {
+		if (replayCursor + size > replayData.size()) return false;
+		memcpy(out, replayData.data() + replayCursor, size);
+		replayCursor += size;
+		return true;
+	}
+
+	// Plays a recording back in place of live input, headless on the dummy video driver and without any frame pacing.
+	// Call before StartSDL. Per frame timings and the checksum are written to reportPath once the recording runs out.
+	static bool StartReplay(const char* path, const char* reportPath) {
+		SDL_RWops* file = SDL_RWFromFile(path, "rb");
+		if (file == nullptr) {
+#ifdef ERROR_LOGGING
+			MakeLog("Unable to open recording " + std::string(path) + ": " + std::string(SDL_GetError()));
+#endif // ERROR_LOGGING
+			return false;
+		}
+
+		Sint64 size = SDL_RWsize(file);
+		replayData.resize(size > 0 ? (size_t)size : 0);
+		size_t read = SDL_RWread(file, replayData.data(), 1, replayData.size());
+		SDL_RWclose(file);
+
+		char magic[8];
+		Sint32 windowSize[2];
+		replayCursor = 0;
+		if (read != replayData.size() || !ReplayRead(magic, 8) || memcmp(magic, RECORD_MAGIC, 8) != 0 ||
+			!ReplayRead(windowSize, sizeof(windowSize)) || !ReplayRead(&replayWindowID, sizeof(replayWindowID))) {
+#ifdef ERROR_LOGGING
+			MakeLog("Not a recording: " + std::string(path));
+#endif // ERROR_LOGGING
+			replayData.clear();
+			return false;
+		}
+
+		windowWidth = windowSize[0];
+		windowHeight = windowSize[1];
+		replayReport = reportPath;
+		replaying = true;
+		replayTimings.clear();
+
+		SDL_SetHint(SDL_HINT_VIDEODRIVER, "dummy");
+		return true;
+	}
+
+	static void FinishReplay() {
+		replaying = false;
+		gameRunning = false;
+
+		std::vector<float> sorted = replayTimings;
+		std::sort(sorted.begin(), sorted.end());
+		double total = 0;
+		for (float t : sorted) total += t;
+		size_t n = sorted.size();
+
+		char line[128];
+		std::string report = "frame,ms\n";
+		for (size_t i = 0; i < replayTimings.size(); i++) {
+			snprintf(line, sizeof(line), "%u,%.3f\n", (unsigned)i, replayTimings[i]);
+			report += line;
+		}
+
+		snprintf(line, sizeof(line), "# frames %u total %.1fms mean %.3fms p99 %.3fms worst %.3fms\n", (unsigned)n, total,
+			n ? total / n : 0.0, n ? sorted[std::min(n - 1, n * 99 / 100)] : 0.0f, n ? sorted.back() : 0.0f);
+		report += line;
+		SDL_Log("%s", line);
+
+		if (replayChecksum != nullptr) {
+			snprintf(line, sizeof(line), "# checksum %016llx\n", (unsigned long long)replayChecksum());
+			report += line;
+			SDL_Log("%s", line);
+		}
+
+		SDL_RWops* file = SDL_RWFromFile(replayReport.c_str(), "wb");
+		if (file == nullptr) {
+#ifdef ERROR_LOGGING
+			MakeLog("Unable to write replay report: " + std::string(SDL_GetError()));
+#endif // ERROR_LOGGING
+			return;
+		}
+		SDL_RWwrite(file, report.data(), 1, report.size());
+		SDL_RWclose(file);
+	}
+
+	// Starts the next recorded frame, setting the clock to the time it ran at. False once the recording runs out.
+	static bool ReplayFrame() {
+		Uint16 marker;
+		Uint32 time;
+		if (!ReplayRead(&marker, sizeof(marker)) || marker != 0 || !ReplayRead(&time, sizeof(time))) return false;
+
+#ifndef TIME_HANDLED
+		previousTime = currentTime;
+		currentTime = time;
+		deltaTime = currentTime - previousTime;
+		deltaSeconds = deltaTime / 1000.0;
+#endif // !TIME_HANDLED
+		return true;
+	}
+
+	// The next recorded event of this frame
+	static bool ReplayEvent(SDL_Event& e) {
+		Uint16 size;
+		if (replayCursor + sizeof(size) > replayData.size()) return false;
+		memcpy(&size, replayData.data() + replayCursor, sizeof(size));
+		if (size == 0 || size > sizeof(SDL_Event)) return false;
+
+		replayCursor += sizeof(size);
+		SDL_zero(e);
+		if (!ReplayRead(&e, size)) return false;
+
+		Uint32* window = EventWindowID(e);
+		if (window != nullptr && *window == replayWindowID) *window = gameWindowID;
+
+		if (IsDropEvent(e.type)) {
+			Sint32 length;
+			if (!ReplayRead(&length, sizeof(length))) return false;
+			e.drop.file = nullptr;
+			if (length >= 0) {
+				if (replayCursor + length > replayData.size()) return false;
+				e.drop.file = (char*)SDL_malloc(length + 1);
+				memcpy(e.drop.file, replayData.data() + replayCursor, length);
+				e.drop.file[length] = 0;
+				replayCursor += length;
+			}
+		}
+		return true;
+	}
+
+	// Live events, or recorded ones while replaying. Events the program sends itself are always live.
+	static bool NextEvent(SDL_Event& e) {
+		if (replaying && ReplayEvent(e)) return true;
+
+		while (SDL_PollEvent(&e)) {
+			if (replaying && e.type < SDL_USEREVENT) continue;
+			if (recordFile != nullptr && e.type < SDL_USEREVENT) RecordEvent(e);
+			return true;
+		}
+		return false;
+	}
+
 	static void HandleInput() {
 		mouseXPrev = mouseX;
 		mouseYPrev = mouseY;
@@ -197,11 +611,19 @@ namespace SDLG
 		for (const auto& pair : globalKeyboard.keys_keycode)
 			globalKeyboard.last_keys_keycode[pair.first] = globalKeyboard.keys_keycode[pair.first];
 
+		if (replaying && !ReplayFrame()) {
+			FinishReplay();
+			return;
+		}
+		if (recordFile != nullptr) RecordFrame();
+
 		SDL_Event e;
-		while (SDL_PollEvent(&e)) {
+		while (NextEvent(e)) {
 			switch (e.type) {
 			case SDL_QUIT:
 				gameRunning = false;
+				if (replaying) FinishReplay();
+				FlushRecording();
 				return; // Exit immediately
 
 			case SDL_KEYDOWN:
@@ -261,6 +683,8 @@ namespace SDLG
 					break;
 
 				case SDL_WINDOWEVENT_CLOSE:
+					// A replay has the quit from the recording, so doesn't need one of its own
+					if (replaying) break;
 					e.type = SDL_QUIT;
 					SDL_PushEvent(&e);
 					break;
@@ -270,6 +694,8 @@ namespace SDLG
 			TriggerEventCallbacks(e);
 		}
 
+		FlushRecording();
+
 		mouseXDelta = mouseX - mouseXPrev;
 		mouseYDelta = mouseY - mouseYPrev;
 		mouseWheelXDelta = mouseWheelX - mouseWheelXPrev;
@@ -307,18 +733,30 @@ namespace SDLG
 
 		gameWindowID = SDL_GetWindowID(gameWindow);
 
-		OnStart();
+#ifndef INPUT_HANDLED
+		if (Jobs().CompletionEvent() != (Uint32)-1)
+			callbacks[Jobs().CompletionEvent()].push_back(&jobCompletion);
+#endif // !INPUT_HANDLED
 
-		currentTime = SDL_GetTicks();
-		deltaTime = currentTime;
+#ifndef TIME_HANDLED
+		StartTime();
+#endif // !TIME_HANDLED
+
+		OnStart();
 
 #ifndef LOOP_HANDLED
 		while (gameRunning) {
 
+#ifndef TIME_HANDLED
+			BeginFrame();
+#endif // !TIME_HANDLED
+
 			HandleInput();
 
 			OnFrame();
 
+			FrameMemory().Reset();
+
 #ifndef TIME_HANDLED
 			HandleTime();
 #endif // !TIME_HANDLED
@@ -328,6 +766,12 @@ namespace SDLG
 
 		OnQuit();
 
+#ifndef INPUT_HANDLED
+		StopRecording();
+#endif // !INPUT_HANDLED
+
+		Jobs().Stop();
+
 		CleanupSDL();
 
 		return 0;
@@ -0,0 +1,396 @@
+#pragma once
+
+#include <SDL.h>
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <climits>
+
+#include "SIMD.h"
+#include "Raster.h"
+
+// Masks are stored as 64x64 pixel tiles of one bit per pixel, one word per tile row, so each tile is 512 bytes
+// and every operation on whole masks is a straight pass over words.
+#define SELECTION_TILE 64
+
+enum class SelectionOp {
+	Replace,
+	Add,
+	Subtract,
+	Intersect
+};
+
+// An axis aligned piece of a mask's outline, along pixel edges from (x0,y0) to (x1,y1)
+struct outlineSegment {
+	int x0, y0;
+	int x1, y1;
+};
+
+class SelectionMask {
+private:
+	int width = 0, height = 0;
+	int tilesX = 0, tilesY = 0;
+	std::vector<Uint64> words;
+	bool empty = true;
+
+	std::vector<outlineSegment> outline;
+	bool outlineDirty = true;
+
+	std::vector<Uint64> edges, prevEdges;
+	std::vector<int> runStart;
+	std::vector<span> selected;
+
+	size_t WordIndex(int x, int y) const {
+		return ((size_t)(y >> 6) * tilesX + (x >> 6)) * SELECTION_TILE + (y & 63);
+	}
+
+	// Word tx of row y, with rows outside the mask reading as empty
+	Uint64 RowWord(int tx, int y) const {
+		if (y < 0 || y >= height) return 0;
+		return words[WordIndex(tx * SELECTION_TILE, y)];
+	}
+
+	// Bits x0 <= x < x1 of a word, 0 <= x0 < x1 <= 64
+	static Uint64 BitRange(int x0, int x1) {
+		Uint64 high = x1 >= 64 ? ~0ULL : (1ULL << x1) - 1;
+		return high & ~((1ULL << x0) - 1);
+	}
+
+	// Walks the bits of one word of a row, opening and closing runs that may carry on into the next word
+	template<class F>
+	static void WordRuns(Uint64 bits, int base, int& open, F emit) {
+		int pos = 0;
+		while (pos < 64) {
+			Uint64 rest = (open < 0 ? bits : ~bits) >> pos;
+			if (!rest) return;
+			pos += CountTrailingZeros(rest);
+
+			if (open < 0) open = base + pos;
+			else {
+				emit(open, base + pos);
+				open = -1;
+			}
+		}
+	}
+
+	// Bits right of and below the image must stay clear, since inverting sets them
+	void ClearPadding() {
+		if (width & 63) {
+			Uint64 keep = BitRange(0, width & 63);
+			for (int ty = 0; ty < tilesY; ty++) {
+				Uint64* tile = words.data() + ((size_t)ty * tilesX + tilesX - 1) * SELECTION_TILE;
+				for (int row = 0; row < SELECTION_TILE; row++) tile[row] &= keep;
+			}
+		}
+		if (height & 63) {
+			for (int tx = 0; tx < tilesX; tx++) {
+				Uint64* tile = words.data() + ((size_t)(tilesY - 1) * tilesX + tx) * SELECTION_TILE;
+				memset(tile + (height & 63), 0, (SELECTION_TILE - (height & 63)) * sizeof(Uint64));
+			}
+		}
+	}
+
+	bool AnySet() const {
+		size_t n = words.size();
+		const Uint64* w = words.data();
+		size_t i = 0;
+
+#ifdef SIMD_SSE2
+		__m128i acc = _mm_setzero_si128();
+		for (; i + 2 <= n; i += 2)
+			acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i*)(w + i)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF) return true;
+#endif
+
+		for (; i < n; i++)
+			if (w[i]) return true;
+		return false;
+	}
+
+	void Changed() {
+		empty = !AnySet();
+		outlineDirty = true;
+	}
+
+	template<SelectionOp op>
+	static void CombineWords(Uint64* a, const Uint64* b, size_t n) {
+		size_t i = 0;
+
+#ifdef SIMD_SSE2
+		for (; i + 2 <= n; i += 2) {
+			__m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+			__m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+
+			if (op == SelectionOp::Add) x = _mm_or_si128(x, y);
+			else if (op == SelectionOp::Subtract) x = _mm_andnot_si128(y, x);
+			else x = _mm_and_si128(x, y);
+
+			_mm_storeu_si128((__m128i*)(a + i), x);
+		}
+#endif
+
+		for (; i < n; i++) {
+			if (op == SelectionOp::Add) a[i] |= b[i];
+			else if (op == SelectionOp::Subtract) a[i] &= ~b[i];
+			else a[i] &= b[i];
+		}
+	}
+
+	// Horizontal edges lie between rows where the bits differ, vertical edges between neighbouring bits that differ.
+	// Both are found a word at a time and joined into runs, so the cost follows the mask size over 64 plus the outline.
+	void BuildOutline() {
+		outline.clear();
+		outlineDirty = false;
+		if (empty) return;
+
+		for (int y = 0; y <= height; y++) {
+			int open = -1;
+			for (int tx = 0; tx < tilesX; tx++)
+				WordRuns(RowWord(tx, y - 1) ^ RowWord(tx, y), tx * SELECTION_TILE, open, [&](int x0, int x1) {
+					outline.push_back({ x0, y, x1, y });
+				});
+			if (open >= 0) outline.push_back({ open, y, width, y });
+		}
+
+		// One extra word holds the edge on the far side of the last column
+		int columnWords = tilesX + 1;
+		edges.assign(columnWords, 0);
+		prevEdges.assign(columnWords, 0);
+		runStart.assign((size_t)columnWords * SELECTION_TILE, 0);
+
+		for (int y = 0; y <= height; y++) {
+			Uint64 carry = 0;
+			for (int tx = 0; tx < tilesX; tx++) {
+				Uint64 w = RowWord(tx, y);
+				edges[tx] = w ^ ((w << 1) | carry);
+				carry = w >> 63;
+			}
+			edges[tilesX] = carry;
+
+			for (int k = 0; k < columnWords; k++) {
+				Uint64 ended = prevEdges[k] & ~edges[k];
+				Uint64 started = edges[k] & ~prevEdges[k];
+
+				while (ended) {
+					int x = k * SELECTION_TILE + CountTrailingZeros(ended);
+					outline.push_back({ x, runStart[x], x, y });
+					ended &= ended - 1;
+				}
+				while (started) {
+					runStart[k * SELECTION_TILE + CountTrailingZeros(started)] = y;
+					started &= started - 1;
+				}
+			}
+			prevEdges.swap(edges);
+		}
+	}
+
+public:
+	int GetWidth() const {
+		return width;
+	}
+
+	int GetHeight() const {
+		return height;
+	}
+
+	// Nothing selected. Tools treat an empty selection as the whole image.
+	bool IsEmpty() const {
+		return empty;
+	}
+
+	// Sizes the mask to a w*h image, with nothing selected
+	void Resize(int w, int h) {
+		width = w;
+		height = h;
+		tilesX = (w + SELECTION_TILE - 1) / SELECTION_TILE;
+		tilesY = (h + SELECTION_TILE - 1) / SELECTION_TILE;
+		words.assign((size_t)tilesX * tilesY * SELECTION_TILE, 0);
+		empty = true;
+		outlineDirty = true;
+	}
+
+	void Clear() {
+		std::fill(words.begin(), words.end(), 0);
+		empty = true;
+		outlineDirty = true;
+	}
+
+	void SelectAll() {
+		std::fill(words.begin(), words.end(), ~0ULL);
+		ClearPadding();
+		Changed();
+	}
+
+	// Bits of row y for pixels tx * 64 to tx * 64 + 63, lowest bit first
+	Uint64 GetRowWord(int tx, int y) const {
+		return RowWord(tx, y);
+	}
+
+	bool Get(int x, int y) const {
+		if (x < 0 || y < 0 || x >= width || y >= height) return false;
+		return (words[WordIndex(x, y)] >> (x & 63)) & 1;
+	}
+
+	// Sets or clears x0 <= x < x1 on row y, clipped to the mask
+	void SetRun(int y, int x0, int x1, bool value) {
+		if (y < 0 || y >= height) return;
+		x0 = std::max(x0, 0);
+		x1 = std::min(x1, width);
+
+		while (x0 < x1) {
+			int base = x0 & ~63;
+			int end = std::min(x1, base + 64);
+			Uint64 bits = BitRange(x0 - base, end - base);
+
+			Uint64& w = words[WordIndex(x0, y)];
+			if (value) w |= bits;
+			else w &= ~bits;
+
+			x0 = end;
+		}
+
+		if (value) empty = false;
+		outlineDirty = true;
+	}
+
+	void SetSpans(const std::vector<span>& spans, bool value) {
+		for (const span& s : spans) SetRun(s.y, s.x0, s.x1, value);
+		if (!value) empty = !AnySet();
+	}
+
+	// Combines other into this mask. Both must be the same size.
+	void Combine(const SelectionMask& other, SelectionOp op) {
+		if (other.width != width || other.height != height) return;
+
+		switch (op)
+		{
+		case SelectionOp::Replace:
+			words = other.words;
+			break;
+		case SelectionOp::Add:
+			CombineWords<SelectionOp::Add>(words.data(), other.words.data(), words.size());
+			break;
+		case SelectionOp::Subtract:
+			CombineWords<SelectionOp::Subtract>(words.data(), other.words.data(), words.size());
+			break;
+		case SelectionOp::Intersect:
+			CombineWords<SelectionOp::Intersect>(words.data(), other.words.data(), words.size());
+			break;
+		}
+
+		Changed();
+	}
+
+	void Invert() {
+		size_t n = words.size();
+		Uint64* w = words.data();
+		size_t i = 0;
+
+#ifdef SIMD_SSE2
+		const __m128i ones = _mm_set1_epi32(-1);
+		for (; i + 2 <= n; i += 2)
+			_mm_storeu_si128((__m128i*)(w + i), _mm_xor_si128(_mm_loadu_si128((const __m128i*)(w + i)), ones));
+#endif
+
+		for (; i < n; i++) w[i] = ~w[i];
+
+		ClearPadding();
+		Changed();
+	}
+
+	// Cuts the spans from begin onwards down to their selected parts. Whole words are skipped or kept at once.
+	void IntersectSpans(std::vector<span>& spans, size_t begin = 0) {
+		selected.clear();
+
+		for (size_t i = begin; i < spans.size(); i++) {
+			const span& s = spans[i];
+			if (s.y < 0 || s.y >= height) continue;
+
+			int x0 = std::max(s.x0, 0);
+			int x1 = std::min(s.x1, width);
+			int open = -1;
+
+			while (x0 < x1) {
+				int base = x0 & ~63;
+				int end = std::min(x1, base + 64);
+				Uint64 bits = words[WordIndex(x0, s.y)] & BitRange(x0 - base, end - base);
+
+				WordRuns(bits, base, open, [&](int a, int b) {
+					selected.push_back({ s.y, a, b });
+				});
+				x0 = end;
+			}
+			if (open >= 0) selected.push_back({ s.y, open, x1 });
+		}
+
+		spans.resize(begin);
+		spans.insert(spans.end(), selected.begin(), selected.end());
+	}
+
+	// Edges between selected and unselected pixels, rebuilt only after the mask changes
+	const std::vector<outlineSegment>& GetOutline() {
+		if (outlineDirty) BuildOutline();
+		return outline;
+	}
+
+	// Smallest rectangle holding every selected pixel, taken from the outline
+	SDL_Rect GetBounds() {
+		const std::vector<outlineSegment>& edges = GetOutline();
+		if (edges.empty()) return { 0,0,0,0 };
+
+		int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+		for (const outlineSegment& o : edges) {
+			x0 = std::min(x0, o.x0);
+			y0 = std::min(y0, o.y0);
+			x1 = std::max(x1, o.x1);
+			y1 = std::max(y1, o.y1);
+		}
+		return { x0, y0, x1 - x0, y1 - y0 };
+	}
+};
+
+// Scanline flood from (x,y) over the 4-connected pixels sharing its index, appending one span per run.
+// visited is resized to the image and used to mark runs already taken. When limit is given,
+// pixels it does not select act as walls.
+static void FloodSpans(const Uint8* pixels, int width, int height, int x, int y, SelectionMask& visited, const SelectionMask* limit, std::vector<span>& out) {
+	if (x < 0 || y < 0 || x >= width || y >= height) return;
+	if (limit != NULL && !limit->Get(x, y)) return;
+
+	if (visited.GetWidth() != width || visited.GetHeight() != height) visited.Resize(width, height);
+	else visited.Clear();
+
+	Uint8 target = pixels[(size_t)y * width + x];
+	auto open = [&](int px, int py) {
+		return pixels[(size_t)py * width + px] == target && !visited.Get(px, py) && (limit == NULL || limit->Get(px, py));
+	};
+
+	std::vector<SDL_Point>& seeds = SDLG::ScratchBuffer<SDL_Point>(0);
+	seeds.push_back({ x, y });
+
+	while (!seeds.empty()) {
+		SDL_Point p = seeds.back();
+		seeds.pop_back();
+		if (!open(p.x, p.y)) continue;
+
+		int left = p.x, right = p.x + 1;
+		while (left > 0 && open(left - 1, p.y)) left--;
+		while (right < width && open(right, p.y)) right++;
+
+		visited.SetRun(p.y, left, right, true);
+		out.push_back({ p.y, left, right });
+
+		// One seed per run of open pixels on the rows above and below
+		for (int ny = p.y - 1; ny <= p.y + 1; ny += 2) {
+			if (ny < 0 || ny >= height) continue;
+
+			bool inRun = false;
+			for (int i = left; i < right; i++) {
+				bool o = open(i, ny);
+				if (o && !inRun) seeds.push_back({ i, ny });
+				inRun = o;
+			}
+		}
+	}
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <SDL.h>
+
+#include <vector>
+#include <algorithm>
+#include <climits>
+
+// Bottom-left skyline packing into a strip of fixed width and unbounded height.
+// The skyline is the top edge of everything placed so far, kept as horizontal segments.
+class SkylinePacker {
+private:
+	struct skylineNode {
+		int x, y, w;
+	};
+
+	int width;
+	std::vector<skylineNode> skyline;
+
+	// Height a w wide rect would rest at when its left edge is on node i, or -1 if it runs off the right
+	int RestingHeight(size_t i, int w) const {
+		if (skyline[i].x + w > width) return -1;
+
+		int y = 0;
+		int remaining = w;
+		for (size_t j = i; remaining > 0; j++) {
+			y = std::max(y, skyline[j].y);
+			remaining -= skyline[j].w;
+		}
+		return y;
+	}
+
+public:
+	SkylinePacker(int width) : width(width) {
+		skyline.push_back({ 0, 0, width });
+	}
+
+	// Places a w*h rect as low as possible, then as far left as possible
+	SDL_Point Insert(int w, int h) {
+		size_t best = 0;
+		int bestY = INT_MAX;
+		for (size_t i = 0; i < skyline.size(); i++) {
+			int y = RestingHeight(i, w);
+			if (y >= 0 && y < bestY) {
+				bestY = y;
+				best = i;
+			}
+		}
+
+		SDL_Point at = { skyline[best].x, bestY };
+
+		// Raise the skyline under the rect, trimming or removing the nodes it covers
+		skylineNode top = { at.x, bestY + h, w };
+		size_t i = best;
+		while (i < skyline.size() && skyline[i].x < at.x + w) {
+			int end = skyline[i].x + skyline[i].w;
+			if (end <= at.x + w) skyline.erase(skyline.begin() + i);
+			else {
+				skyline[i].w = end - (at.x + w);
+				skyline[i].x = at.x + w;
+				break;
+			}
+		}
+		skyline.insert(skyline.begin() + best, top);
+
+		// Join neighbours at the same height
+		for (size_t j = 0; j + 1 < skyline.size();) {
+			if (skyline[j].y == skyline[j + 1].y) {
+				skyline[j].w += skyline[j + 1].w;
+				skyline.erase(skyline.begin() + j + 1);
+			}
+			else j++;
+		}
+
+		return at;
+	}
+
+	int Height() const {
+		int h = 0;
+		for (const skylineNode& n : skyline) h = std::max(h, n.y);
+		return h;
+	}
+};
@@ -1,7 +1,8 @@
 #include <SDL.h>
 #include <SDL_image.h>
 
-#include <queue>
+#include <string>
+#include <unordered_map>
 
 #define ERROR_LOGGING
 #include "SDLG.h"
@@ -12,16 +13,56 @@
 #include "RenderableElement.h"
 #include "InteractiveElement.h"
 #include "Generic.h"
+#include "Quantise.h"
+#include "Font.h"
+#include "Colour.h"
+#include "Raster.h"
+#include "Brush.h"
+#include "Selection.h"
+#include "Transform.h"
+#include "Palette.h"
+#include "Timeline.h"
+#include "Onion.h"
+#include "Export.h"
+#include "SpriteAtlas.h"
+#include "Image.h"
+#include "Resample.h"
+#include "Tilemap.h"
 
 #define swap(a,b) a ^= (b ^= (a ^= b))
 
 #define TRANSPARENT_CHECKER_1 (0xFFFFFFFF)
 #define TRANSPARENT_CHECKER_2 (0xFFBFBFBF)
 #define SHADOW (0x7F000000)
+#define PIXEL_GRID (0x40000000)
+
+// Screen pixels per square of the checkerboard behind the canvas
+#define CHECKER_SIZE 8
+// Below this zoom the pixel grid would hide the image
+#define GRID_MIN_ZOOM 4
+// Past this many, instances rewritten by a tilemap edit are uploaded as the area around them all
+#define TILEMAP_MAX_UPLOADS 64
+// Largest canvas resampling may make, the texture size most renderers can take
+#define CANVAS_MAX_SIZE 16384
 
 using namespace SDLG;
 
-int main(int argc, char* argv[]) { return StartSDL(); }
+// --record <file> saves the session's input, --replay <file> [--report <file>] plays one back headless and
+// reports how long each frame took
+int main(int argc, char* argv[]) {
+	const char* replay = nullptr;
+	const char* report = "replay.csv";
+
+	for (int i = 1; i + 1 < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--record") StartRecording(argv[++i]);
+		else if (arg == "--replay") replay = argv[++i];
+		else if (arg == "--report") report = argv[++i];
+	}
+
+	if (replay != nullptr && !StartReplay(replay, report)) return 3;
+	return StartSDL();
+}
 
 void DrawTexture(SDL_Texture* txt, SDL_FRect dst) {
 	SDL_RenderCopyF(gameRenderer, txt, NULL, &dst);
@@ -31,36 +72,186 @@ void DrawTexture(SDL_Texture* txt, SDL_Rect dst) {
 	SDL_RenderCopy(gameRenderer, txt, NULL, &dst);
 }
 
-struct textCharacter {
+struct shapedGlyph {
 	SDL_Rect src;
-	SDL_FRect dst; // x/y is the offset, and w/h is a proportion of the scale, both relative to the scale of the text.
+	SDL_FRect dst; // Pixels, relative to the origin of the text
 };
 
-struct textLayout {
-	textCharacter characters[256];
+struct shapedText {
+	std::vector<shapedGlyph> glyphs;
+	float width = 0, height = 0;
 };
 
+// Lays text out once per distinct string and settings, then batches every glyph drawn in a frame into one draw call
 class TextRenderer {
 private:
 	SDL_Texture** fontSrc;
-	SDL_Texture* drawTarget;
-	std::string currentText;
+	textLayout* font;
+	float monoAdvance = 0;
 
-	int boundsWidth, boundsHeight;
+	std::unordered_map<std::string, shapedText> layoutCache;
+	std::string layoutKey; // Reused so looking up a cached layout doesn't allocate
+	std::vector<SDL_Vertex> vertices;
+	std::vector<int> indices;
 
-	bool textWrap = true;
+	// Cached layouts are dropped wholesale once there are this many, which only happens with constantly changing text
+	static const size_t maxCachedLayouts = 1024;
+
+	float Advance(Uint8 c) {
+		return (monospace ? monoAdvance : font->characters[c].advance) * textScale;
+	}
+
+	float WordWidth(const std::string& word) {
+		float w = 0;
+		for (char c : word) w += Advance(c);
+		return w;
+	}
+
+	bool LineFits(float penY) {
+		return !textCutoff || boundsHeight <= 0 || penY + textScale <= boundsHeight;
+	}
+
+	// Places a word at the pen, breaking it between characters when it alone is wider than the bounds
+	void RenderWord(const std::string& word, shapedText& out, float& penX, float& penY) {
+		for (char ch : word) {
+			Uint8 c = ch;
+			float advance = Advance(c);
+
+			if (textWrap && boundsWidth > 0 && penX > 0 && penX + advance > boundsWidth) {
+				penX = 0;
+				penY += textScale;
+			}
+			if (!LineFits(penY)) return;
+
+			const textCharacter& character = font->characters[c];
+			if (character.src.w > 0 && (!textCutoff || boundsWidth <= 0 || penX + advance <= boundsWidth)) {
+				float offset = monospace ? (advance - character.advance * textScale) / 2 : 0;
+				out.glyphs.push_back({
+					character.src,
+					{
+						penX + offset + character.dst.x * textScale,
+						penY + character.dst.y * textScale,
+						character.dst.w * textScale,
+						character.dst.h * textScale
+					}
+				});
+			}
+
+			penX += advance;
+			out.width = std::max(out.width, penX);
+		}
+	}
+
+	shapedText ShapeText(const std::string& text) {
+		shapedText out;
+		float penX = 0, penY = 0;
+
+		size_t start = 0;
+		while (start <= text.size() && LineFits(penY)) {
+			size_t end = text.find_first_of(" \n", start);
+			if (end == std::string::npos) end = text.size();
+
+			std::string word = text.substr(start, end - start);
+			if (textWrap && boundsWidth > 0 && penX > 0 && penX + WordWidth(word) > boundsWidth) {
+				penX = 0;
+				penY += textScale;
+				if (!LineFits(penY)) break;
+			}
+			RenderWord(word, out, penX, penY);
+
+			if (end >= text.size()) break;
+			if (text[end] == '\n') {
+				penX = 0;
+				penY += textScale;
+			}
+			else if (penX > 0) penX += Advance(' ');
 
-	void RenderWord(std::string& word, textLayout& font) {
+			start = end + 1;
+		}
 
+		out.height = penY + textScale;
+		return out;
 	}
 
-	SDL_Texture* RenderText(std::string& text, textLayout& font, int textScale, int maxWidth, int maxHeight, bool textCutoff = false, bool monospace = false) {
-		if (maxWidth <= 0 || maxHeight <= 0) return NULL;
+	const shapedText& GetLayout(const char* text) {
+		// Every setting that changes the layout is part of the key
+		layoutKey.clear();
+		layoutKey.append((const char*)&textScale, sizeof(textScale));
+		layoutKey.append((const char*)&boundsWidth, sizeof(boundsWidth));
+		layoutKey.append((const char*)&boundsHeight, sizeof(boundsHeight));
+		layoutKey.push_back((char)(textWrap | textCutoff << 1 | monospace << 2));
+		layoutKey.append(text);
 
-		SDL_CreateTexture(gameRenderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_TARGET, maxWidth, maxHeight);
+		auto it = layoutCache.find(layoutKey);
+		if (it != layoutCache.end()) return it->second;
+
+		if (layoutCache.size() >= maxCachedLayouts) layoutCache.clear();
+		return layoutCache.emplace(layoutKey, ShapeText(text)).first->second;
 	}
 
 public:
+	int textScale = 12;      // Line height in pixels
+	int boundsWidth = 0;     // Wrapping and cutoff width, or 0 for unbounded
+	int boundsHeight = 0;    // Cutoff height, or 0 for unbounded
+
+	bool textWrap = true;
+	bool textCutoff = false;
+	bool monospace = false;
+
+	TextRenderer(SDL_Texture** src, textLayout& layout) : fontSrc(src), font(&layout) {
+		for (auto& c : layout.characters) monoAdvance = std::max(monoAdvance, c.advance);
+	}
+
+	SDL_FPoint MeasureText(const char* text) {
+		const shapedText& shaped = GetLayout(text);
+		return { shaped.width, shaped.height };
+	}
+
+	SDL_FPoint MeasureText(const std::string& text) {
+		return MeasureText(text.c_str());
+	}
+
+	void RenderText(const std::string& text, float x, float y, SDL_Colour colour = { 255,255,255,255 }) {
+		RenderText(text.c_str(), x, y, colour);
+	}
+
+	// Queues text for this frame's batch. Nothing is drawn until Flush.
+	void RenderText(const char* text, float x, float y, SDL_Colour colour = { 255,255,255,255 }) {
+		if (fontSrc == NULL || *fontSrc == NULL) return;
+
+		int atlasW, atlasH;
+		SDL_QueryTexture(*fontSrc, NULL, NULL, &atlasW, &atlasH);
+
+		for (const shapedGlyph& g : GetLayout(text).glyphs) {
+			float u0 = g.src.x / (float)atlasW;
+			float v0 = g.src.y / (float)atlasH;
+			float u1 = (g.src.x + g.src.w) / (float)atlasW;
+			float v1 = (g.src.y + g.src.h) / (float)atlasH;
+
+			float x0 = x + g.dst.x;
+			float y0 = y + g.dst.y;
+			float x1 = x0 + g.dst.w;
+			float y1 = y0 + g.dst.h;
+
+			int base = (int)vertices.size();
+			vertices.push_back({ { x0, y0 }, colour, { u0, v0 } });
+			vertices.push_back({ { x1, y0 }, colour, { u1, v0 } });
+			vertices.push_back({ { x1, y1 }, colour, { u1, v1 } });
+			vertices.push_back({ { x0, y1 }, colour, { u0, v1 } });
+
+			int quad[6] = { base, base + 1, base + 2, base, base + 2, base + 3 };
+			indices.insert(indices.end(), quad, quad + 6);
+		}
+	}
+
+	// Draws everything queued since the last flush in one call
+	void Flush() {
+		if (!indices.empty() && fontSrc != NULL && *fontSrc != NULL)
+			SDL_RenderGeometry(gameRenderer, *fontSrc, vertices.data(), (int)vertices.size(), indices.data(), (int)indices.size());
+
+		vertices.clear();
+		indices.clear();
+	}
 };
 
 SDL_Rect ToRect(SDL_FRect rect) {
@@ -80,16 +271,18 @@ SDL_FRect GetFrameRect(frame& f) {
 	return { x,y,width,height };
 }
 
-void RenderSprite(sprite& src, frame& dst) {
+SpriteAtlas uiIcons;
+SpriteBatch uiSprites;
+
+// Sprites are queued and drawn together at the end of the frame, one call per texture, over the rest of the UI
+void RenderSprite(sprite& src, frame& dst, SDL_Colour tint = { 255,255,255,255 }) {
 	if (src.texture == NULL || *src.texture == NULL) {
 		SetDrawColour(255, 0, 255); // A simple magenta box
 		FillRect(GetFrameRect(dst));
 		return;
 	}
 
-	SDL_FRect dstRect = GetFrameRect(dst);
-
-	SDL_RenderCopyF(gameRenderer, *src.texture, &src.src, &dstRect);
+	uiSprites.Add(*src.texture, src.src, GetFrameRect(dst), tint);
 }
 
 enum class ScreenState {
@@ -101,21 +294,250 @@ ScreenState gameState = ScreenState::CreateImage;
 
 class DrawCanvas : public RenderableElement {
 protected:
-	Uint8* appliedData;
-	Uint8* modifiedData;
-	SDL_Surface* surface;
-	SDL_Texture* renderedSurface;
-	SDL_Colour palette[256];
-	SDL_Palette* surfacePalette;
+	Uint8* appliedData = NULL;
+	Uint8* modifiedData = NULL;
+	SDL_Surface* surface = NULL;
+	SDL_Texture* renderedSurface = NULL;
+	SDL_Colour palette[256] = {};
+	bool paletteLocked[256] = {};
+	SDL_Palette* surfacePalette = NULL;
 	frame canvasArea;
 	unsigned width, height, zoom;
-	bool rendered = false;
+
+	// Area of the image changed since the texture was last updated
+	SDL_Rect dirty = { 0,0,0,0 };
+
+	// Scattered tiles changed since then, uploaded one by one rather than as the area around them all
+	std::vector<SDL_Rect> dirtyTiles;
+	std::vector<Uint8> replacedTiles;
+	std::vector<int> replacedList;
+
+	// Uncommitted shape drawn over the canvas, kept out of the image until the tool commits it
+	std::vector<span> previewSpans;
+	std::vector<SDL_FRect> previewRects;
+	Uint8 previewColour = 0;
+
+	std::vector<span> strokeSpans;
+
+	// Pixels outside a non-empty selection are left alone by every tool
+	SelectionMask selection;
+	SelectionMask selectionShape;
+	SelectionMask floodVisited;
+	std::vector<span> floodSpans;
+	std::vector<SDL_FRect> antRects, antDashes;
+
+	// Pixels being transformed float above the image until they are committed
+	FloatingSelection floating;
+	bool transforming = false;
+	SDL_Texture* transformTexture = NULL;
+	int transformTextureW = 0, transformTextureH = 0;
+	SDL_Rect transformArea = { 0,0,0,0 };
+	unsigned transformVersion = 0;
+	std::vector<Uint8> transformIndex, transformCovered;
+
+	// The image being edited is the current frame. Edits reach the timeline's tiles when the frame is left.
+	Timeline timeline;
+	int currentFrame = 0;
+	SDL_Rect unstored = { 0,0,0,0 };
+
+	// Playback shows a cached texture per frame instead of the edited image
+	bool playing = false;
+	int playFrame = 0;
+	Uint32 playNext = 0;
+	std::vector<SDL_Texture*> frameTextures;
+	std::vector<Uint64> frameTextureVersions;
+	std::vector<Uint32> frameExpand;
+	unsigned paletteVersion = 0;
+
+	// Ghosts of neighbouring frames, composited once into a texture and kept until something they show changes
+	onionSettings onion;
+	unsigned onionSettingsVersion = 0;
+	SDL_Texture* onionTexture = NULL;
+	std::vector<Uint64> onionKey, onionBuilt;
+	std::vector<Uint32> onionPixels;
+
+	// Checkerboard behind transparent colours, a texture made once for the window size and drawn in one copy
+	// clipped to the visible canvas, so its cost doesn't follow zoom
+	SDL_Texture* checkerTexture = NULL;
+	int checkerW = 0, checkerH = 0;
+
+	// Lines of the pixel grid, rebuilt each frame for the visible part of the canvas
+	std::vector<SDL_FRect> pixelGridRects;
+
+	// Tilemap mode links every instance of a tile in the current frame, so an edit to one is made to all of them.
+	// The map is rebuilt from the image whenever the image is replaced rather than edited.
+	Tilemap tilemap;
+	int tilemapSize = 0;
+	bool tilemapFlips = true;
+	std::vector<SDL_Rect> linkedCells;
+	std::vector<SDL_FRect> tileGridRects;
 
 	constexpr unsigned GetIndex(unsigned x, unsigned y) {
 		return x + y * width;
 	}
 
+	// (Re)creates the pixel buffers, surface and texture for a W*H image, cleared to index 0
+	void AllocateImage(unsigned W, unsigned H) {
+		if (appliedData != NULL) TrackMemory(MemoryTag::Canvas, -2 * (Sint64)width * height);
+		delete[] appliedData;
+		delete[] modifiedData;
+		if (surface != NULL) SDL_FreeSurface(surface);
+		if (renderedSurface != NULL) {
+			TrackTexture(renderedSurface, MemoryTag::Textures, false);
+			SDL_DestroyTexture(renderedSurface);
+		}
+
+		width = W;
+		height = H;
+
+		appliedData = new Uint8[W * H];
+		memset(appliedData, 0, W * H);
+		modifiedData = new Uint8[W * H];
+		memcpy(modifiedData, appliedData, W * H);
+		TrackMemory(MemoryTag::Canvas, 2 * (Sint64)W * H);
+
+		surface = SDL_CreateRGBSurfaceFrom(modifiedData, W, H, 8, W, 0, 0, 0, 0);
+		SDL_SetSurfacePalette(surface, surfacePalette);
+
+		renderedSurface = SDL_CreateTexture(gameRenderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, W, H);
+		SDL_SetTextureBlendMode(renderedSurface, SDL_BLENDMODE_BLEND);
+		TrackTexture(renderedSurface, MemoryTag::Textures, true);
+
+		selection.Resize(W, H);
+		transforming = false;
+
+		timeline.Reset(modifiedData, W, H);
+		currentFrame = 0;
+		unstored = { 0,0,(int)W,(int)H };
+		playing = false;
+		ReleaseFrameTextures();
+		ReleaseOnionTexture();
+		RebuildTilemap();
+
+		MarkAllDirty();
+	}
+
+	void MarkDirty(SDL_Rect area) {
+		if (area.w <= 0 || area.h <= 0) return;
+
+		if (dirty.w <= 0 || dirty.h <= 0) dirty = area;
+		else SDL_UnionRect(&dirty, &area, &dirty);
+
+		MarkUnstored(area);
+	}
+
+	void MarkUnstored(SDL_Rect area) {
+		if (unstored.w <= 0 || unstored.h <= 0) unstored = area;
+		else SDL_UnionRect(&unstored, &area, &unstored);
+	}
+
+	void RebuildTilemap() {
+		if (tilemapSize > 0) tilemap.Build(modifiedData, width, height, tilemapSize, tilemapFlips);
+		else tilemap.Clear();
+	}
+
+	// Carries an edit within changed to every other instance of the tiles it touched
+	void LinkEdits(SDL_Rect changed) {
+		if (tilemap.IsEmpty()) return;
+
+		linkedCells.clear();
+		tilemap.Propagate(modifiedData, width, changed, linkedCells);
+		if (linkedCells.empty()) return;
+
+		SDL_Rect bounds = linkedCells[0];
+		for (const SDL_Rect& r : linkedCells) SDL_UnionRect(&bounds, &r, &bounds);
+
+		// Instances are usually scattered over the map, so are uploaded one by one unless they fill most of their bounds
+		Sint64 covered = (Sint64)linkedCells.size() * tilemapSize * tilemapSize;
+		if (covered * 2 >= (Sint64)bounds.w * bounds.h || linkedCells.size() > TILEMAP_MAX_UPLOADS) MarkDirty(bounds);
+		else {
+			dirtyTiles.insert(dirtyTiles.end(), linkedCells.begin(), linkedCells.end());
+			MarkUnstored(bounds);
+		}
+	}
+
+	void MarkAllDirty() {
+		dirty = { 0,0,(int)width,(int)height };
+	}
+
+	void ReleaseFrameTextures() {
+		for (SDL_Texture* t : frameTextures)
+			if (t != NULL) {
+				TrackTexture(t, MemoryTag::Textures, false);
+				SDL_DestroyTexture(t);
+			}
+		frameTextures.clear();
+		frameTextureVersions.clear();
+	}
+
+	void ReleaseOverlayTexture(SDL_Texture*& texture) {
+		if (texture == NULL) return;
+		TrackTexture(texture, MemoryTag::UI, false);
+		SDL_DestroyTexture(texture);
+		texture = NULL;
+	}
+
+	// Static texture of w*h pixels from fn(x, y)
+	template <class F>
+	SDL_Texture* CreateOverlayTexture(int w, int h, F fn) {
+		std::vector<Uint32> pixels((size_t)w * h);
+		for (int y = 0; y < h; y++)
+			for (int x = 0; x < w; x++) pixels[(size_t)y * w + x] = fn(x, y);
+
+		SDL_Texture* texture = SDL_CreateTexture(gameRenderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC, w, h);
+		if (texture == NULL) return NULL;
+		SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+		SDL_UpdateTexture(texture, NULL, pixels.data(), w * 4);
+		TrackTexture(texture, MemoryTag::UI, true);
+		return texture;
+	}
+
+	// Part of the window the canvas covers
+	bool VisibleArea(SDL_FRect area, SDL_Rect& visible) {
+		SDL_Rect canvasRect = ToRect(area);
+		SDL_Rect window = { 0,0,windowWidth,windowHeight };
+		return SDL_IntersectRect(&canvasRect, &window, &visible);
+	}
+
+	void ReleaseOnionTexture() {
+		if (onionTexture == NULL) return;
+		TrackTexture(onionTexture, MemoryTag::Textures, false);
+		SDL_DestroyTexture(onionTexture);
+		onionTexture = NULL;
+	}
+
+	// Texture of a frame as stored, rebuilt when the frame or the palette has changed since it was made
+	SDL_Texture* FrameTexture(int index) {
+		size_t count = timeline.GetFrameCount();
+		if (frameTextures.size() != count) {
+			for (size_t i = count; i < frameTextures.size(); i++)
+				if (frameTextures[i] != NULL) {
+					TrackTexture(frameTextures[i], MemoryTag::Textures, false);
+					SDL_DestroyTexture(frameTextures[i]);
+				}
+			frameTextures.resize(count, NULL);
+			frameTextureVersions.resize(count, 0);
+		}
+
+		Uint64 version = (Uint64)paletteVersion << 32 | timeline.GetFrame(index).version;
+		if (frameTextures[index] != NULL && frameTextureVersions[index] == version) return frameTextures[index];
+
+		if (frameTextures[index] == NULL) {
+			frameTextures[index] = SDL_CreateTexture(gameRenderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC, width, height);
+			TrackTexture(frameTextures[index], MemoryTag::Textures, true);
+		}
+
+		frameExpand.resize((size_t)width * height);
+		timeline.Expand(index, palette, frameExpand.data(), width * 4);
+		SDL_UpdateTexture(frameTextures[index], NULL, frameExpand.data(), width * 4);
+		frameTextureVersions[index] = version;
+
+		return frameTextures[index];
+	}
+
 public:
+	Brush brush;
+
 	unsigned GetImageWidth() {
 		return width;
 	}
@@ -128,27 +550,50 @@ public:
 		return ToRect(GetFrameRect(canvasArea));
 	}
 
+	// Expands the dirty parts of the image through the palette into the texture
 	void RenderCanvas() {
-		/*SDL_Colour* pixels;
-		int pitch;
+		SDL_Rect image = { 0,0,(int)width,(int)height };
+		SDL_Rect area;
+		if (SDL_IntersectRect(&dirty, &image, &area)) UploadArea(area);
+		dirty = { 0,0,0,0 };
 
-		if (SDL_LockTexture(surface, NULL, (void**)&pixels, &pitch) == -1)
-			return;
-		unsigned long i = 0;
-		for (unsigned y = 0; y < height; y++)
-			for (unsigned x = 0; x < width; x++)
-				*(pixels++) = palette[modifiedData[i++]];
-		SDL_UnlockTexture(surface);*/
+		for (const SDL_Rect& tile : dirtyTiles) UploadArea(tile);
+		dirtyTiles.clear();
+	}
 
-		rendered = true;
-		SDL_Surface* tmpSurface = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA32, 0);
-		SDL_UpdateTexture(renderedSurface, NULL, tmpSurface->pixels, tmpSurface->pitch);
+	void UploadArea(SDL_Rect area) {
+		Uint32 colours[256];
+		memcpy(colours, palette, sizeof(colours));
+
+		Uint8* pixels;
+		int pitch;
+		if (SDL_LockTexture(renderedSurface, &area, (void**)&pixels, &pitch) != 0) return;
+
+		// Small brush strokes stay on this thread, large areas are split across the job system
+		ParallelFor(0, area.h, [&](int y0, int y1) {
+			for (int y = y0; y < y1; y++) {
+				Uint32* out = (Uint32*)(pixels + y * pitch);
+				const Uint8* in = modifiedData + GetIndex(area.x, area.y + y);
+				for (int x = 0; x < area.w; x++) out[x] = colours[in[x]];
+			}
+		}, std::max(1, 16384 / area.w));
+
+		SDL_UnlockTexture(renderedSurface);
 	}
 
 	SDL_Colour GetPaletteColour(Uint8 index) {
 		return palette[index];
 	}
 
+	bool GetPaletteLocked(Uint8 index) {
+		return paletteLocked[index];
+	}
+
+	// Locked entries keep their colour when an image is imported
+	void SetPaletteLocked(Uint8 index, bool locked) {
+		paletteLocked[index] = locked;
+	}
+
 	void SetPaletteColour(SDL_Colour colour, Uint8 index) {
 		/*palette[index] = colour;
 
@@ -167,27 +612,52 @@ public:
 		palette[index] = colour;
 
 		SDL_SetPaletteColors(surface->format->palette, palette + index, index, 1);
+		timeline.SetPaletteSize(PaletteSize(palette));
 
-		rendered = false;
+		MarkAllDirty();
+		transformArea = { 0,0,0,0 };
+		paletteVersion++;
 	}
 
-	void DrawPoint(Uint8 colourIndex, unsigned x, unsigned y) {
-		/*if (!InBounds({ 0,0,(int)width,(int)height }, x, y)) return;
+	const SDL_Colour* GetPalette() {
+		return palette;
+	}
 
-		modifiedData[GetIndex(x,y)] = colourIndex;
-		
-		SDL_Colour* pixels;
-		int pitch;
+	const bool* GetPaletteLocks() {
+		return paletteLocked;
+	}
+
+	// Which indices appear in any frame. The counts are kept by the timeline, so only unstored edits cost anything.
+	void GetUsedIndices(bool* used) {
+		StoreFrame();
+		for (int i = 0; i < 256; i++) used[i] = timeline.IndexUsed((Uint8)i);
+	}
 
-		SDL_LockTexture(renderedSurface, NULL, (void**)&pixels, &pitch);
-		pixels[GetIndex(x,y)] = palette[colourIndex];
-		SDL_UnlockTexture(renderedSurface);*/
+	// Moves every pixel of every frame onto its new index and takes the remapped palette.
+	// The image looks the same afterwards.
+	void RemapPalette(const paletteRemap& remap) {
+		CommitTransform();
+		StoreFrame();
 
-		if (!InBounds({ 0,0,(int)width,(int)height }, x, y)) return;
+		if (RemapsPixels(remap)) {
+			RemapIndices(modifiedData, (size_t)width * height, remap.lut);
+			RemapIndices(appliedData, (size_t)width * height, remap.lut);
+			timeline.Remap(remap.lut);
+		}
 
-		modifiedData[GetIndex(x,y)] = colourIndex;
+		memcpy(palette, remap.colours, sizeof(palette));
+		memcpy(paletteLocked, remap.locked, sizeof(paletteLocked));
+		SDL_SetPaletteColors(surfacePalette, palette, 0, 256);
+		timeline.SetPaletteSize(PaletteSize(palette));
+		RebuildTilemap();
+
+		MarkAllDirty();
+		transformArea = { 0,0,0,0 };
+		paletteVersion++;
+	}
 
-		rendered = false;
+	void DrawPoint(Uint8 colourIndex, unsigned x, unsigned y) {
+		DrawLine(x, y, x, y, colourIndex);
 	}
 
 	int GetPixel(unsigned x, unsigned y) {
@@ -215,21 +685,10 @@ public:
 	}
 
 	DrawCanvas(unsigned W, unsigned H) {
-		width = W;
-		height = H;
-
-		appliedData = new Uint8[W * H];
-		memset(appliedData, 0, W * H);
-		modifiedData = new Uint8[W * H];
-		memcpy(modifiedData, appliedData, W * H);
-
-		surface = SDL_CreateRGBSurfaceFrom(modifiedData, W, H, 8, W, 0, 0, 0, 0);
-
-		renderedSurface = SDL_CreateTexture(gameRenderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, W, H);
-
 		surfacePalette = SDL_AllocPalette(256);
 		SDL_SetPaletteColors(surfacePalette, palette, 0, 256);
-		SDL_SetSurfacePalette(surface, surfacePalette);
+
+		AllocateImage(W, H);
 
 		SetPaletteColour({ 255,   0,   0, 255 }, 0);
 		SetPaletteColour({ 255, 255, 255, 255 }, 1);
@@ -239,80 +698,617 @@ public:
 	}
 
 	~DrawCanvas() {
+		TrackMemory(MemoryTag::Canvas, -2 * (Sint64)width * height);
 		delete[] appliedData;
 		delete[] modifiedData;
+		if (transformTexture != NULL) {
+			TrackTexture(transformTexture, MemoryTag::Textures, false);
+			SDL_DestroyTexture(transformTexture);
+		}
+		ReleaseFrameTextures();
+		ReleaseOnionTexture();
+		ReleaseOverlayTexture(checkerTexture);
 	}
 
+	bool showChecker = true;
+	bool showGrid = false;
+
 	void render(SDL_Renderer* r) {
-		if(!rendered) RenderCanvas();
+		if (showChecker) RenderChecker();
+
+		if (playing) {
+			RenderPlayback();
+			if (showGrid) RenderPixelGrid();
+			return;
+		}
+
+		RenderCanvas();
 		DrawTexture(renderedSurface,GetFrameRect(canvasArea));
+		RenderOnionSkin();
+		if (transforming) RenderTransform();
+		RenderPreview();
+		if (showGrid) RenderPixelGrid();
+		RenderTileGrid();
+		if (!transforming) RenderSelection();
 	}
 
+	// A texture of one texel per square, stretched so each texel covers a square, and offset by a texel
+	// to keep the squares fixed to the canvas as it moves. Skipped while every colour is opaque.
+	void RenderChecker() {
+		bool transparent = false;
+		for (int i = 0; i < 256 && !transparent; i++) transparent = palette[i].a < 255;
+		if (!transparent) return;
+
+		SDL_FRect area = GetFrameRect(canvasArea);
+		SDL_Rect visible;
+		if (!VisibleArea(area, visible)) return;
+
+		int cellsX = windowWidth / CHECKER_SIZE + 3;
+		int cellsY = windowHeight / CHECKER_SIZE + 3;
+		if (checkerTexture == NULL || cellsX > checkerW || cellsY > checkerH) {
+			ReleaseOverlayTexture(checkerTexture);
+			checkerW = cellsX;
+			checkerH = cellsY;
+			checkerTexture = CreateOverlayTexture(checkerW, checkerH, [](int x, int y) {
+				return (x ^ y) & 1 ? TRANSPARENT_CHECKER_1 : TRANSPARENT_CHECKER_2;
+			});
+			if (checkerTexture == NULL) return;
+		}
+
+		int firstX = (int)floor((visible.x - area.x) / CHECKER_SIZE);
+		int firstY = (int)floor((visible.y - area.y) / CHECKER_SIZE);
+		SDL_Rect src = { firstX & 1, firstY & 1, visible.w / CHECKER_SIZE + 2, visible.h / CHECKER_SIZE + 2 };
+		SDL_FRect dst = {
+			area.x + firstX * CHECKER_SIZE, area.y + firstY * CHECKER_SIZE,
+			(float)src.w * CHECKER_SIZE, (float)src.h * CHECKER_SIZE
+		};
+
+		SDL_RenderSetClipRect(gameRenderer, &visible);
+		SDL_RenderCopyF(gameRenderer, checkerTexture, &src, &dst);
+		SDL_RenderSetClipRect(gameRenderer, NULL);
+	}
+
+	// Lines along the top and left of every visible image pixel, in one call with nothing to rebuild on a zoom
+	void RenderPixelGrid() {
+		if (zoom < GRID_MIN_ZOOM) return;
+
+		SDL_FRect area = GetFrameRect(canvasArea);
+		SDL_Rect visible;
+		if (!VisibleArea(area, visible)) return;
+
+		float step = (float)zoom;
+		float top = std::max(area.y, (float)visible.y), left = std::max(area.x, (float)visible.x);
+		float spanW = std::min(area.x + area.w, (float)(visible.x + visible.w)) - left;
+		float spanH = std::min(area.y + area.h, (float)(visible.y + visible.h)) - top;
+		if (spanW <= 0 || spanH <= 0) return;
+
+		pixelGridRects.clear();
+		for (int px = std::max(0, (int)((left - area.x) / step)); px < (int)width; px++) {
+			float x = area.x + px * step;
+			if (x > visible.x + visible.w) break;
+			pixelGridRects.push_back({ x, top, 1, spanH });
+		}
+		for (int py = std::max(0, (int)((top - area.y) / step)); py < (int)height; py++) {
+			float y = area.y + py * step;
+			if (y > visible.y + visible.h) break;
+			pixelGridRects.push_back({ left, y, spanW, 1 });
+		}
+
+		SDL_SetRenderDrawBlendMode(gameRenderer, SDL_BLENDMODE_BLEND);
+		SetDrawColour(0, 0, 0, PIXEL_GRID >> 24);
+		SDL_RenderFillRectsF(gameRenderer, pixelGridRects.data(), (int)pixelGridRects.size());
+	}
+
+	// Edges of the tilemap's cells, the visible ones drawn in one call
+	void RenderTileGrid() {
+		if (tilemap.IsEmpty()) return;
+
+		SDL_FRect area = GetFrameRect(canvasArea);
+		SDL_Rect visible;
+		if (!VisibleArea(area, visible)) return;
+
+		float step = (float)tilemapSize * zoom;
+		float right = area.x + tilemap.GetTilesX() * step;
+		float bottom = area.y + tilemap.GetTilesY() * step;
+		float top = std::max(area.y, (float)visible.y), left = std::max(area.x, (float)visible.x);
+		float spanW = std::min(right, (float)(visible.x + visible.w)) - left;
+		float spanH = std::min(bottom, (float)(visible.y + visible.h)) - top;
+		if (spanW <= 0 || spanH <= 0) return;
+
+		tileGridRects.clear();
+		for (int cx = std::max(0, (int)((left - area.x) / step)); cx <= tilemap.GetTilesX(); cx++) {
+			float x = area.x + cx * step;
+			if (x > visible.x + visible.w) break;
+			tileGridRects.push_back({ x, top, 1, spanH });
+		}
+		for (int cy = std::max(0, (int)((top - area.y) / step)); cy <= tilemap.GetTilesY(); cy++) {
+			float y = area.y + cy * step;
+			if (y > visible.y + visible.h) break;
+			tileGridRects.push_back({ left, y, spanW, 1 });
+		}
+
+		SDL_SetRenderDrawBlendMode(gameRenderer, SDL_BLENDMODE_BLEND);
+		SetDrawColour(255, 200, 0, 160);
+		SDL_RenderFillRectsF(gameRenderer, tileGridRects.data(), (int)tileGridRects.size());
+	}
+
+	// Replaces the preview. Spans are in image coordinates and clipped to the image.
+	void SetPreview(const std::vector<span>& spans, Uint8 colour) {
+		previewSpans.assign(spans.begin(), spans.end());
+		ClipSpans(previewSpans, { 0, 0, (int)width, (int)height });
+		previewColour = colour;
+	}
+
+	void ClearPreview() {
+		previewSpans.clear();
+	}
+
+	// Composites the preview spans on screen in one call, skipping those outside the window
+	void RenderPreview() {
+		if (previewSpans.empty()) return;
+
+		SDL_FRect area = GetFrameRect(canvasArea);
+		float scale = area.w / width;
+
+		previewRects.clear();
+		for (const span& s : previewSpans) {
+			float y = area.y + s.y * scale;
+			if (y + scale < 0 || y > windowHeight) continue;
+
+			float x0 = std::max(area.x + s.x0 * scale, -1.0f);
+			float x1 = std::min(area.x + s.x1 * scale, windowWidth + 1.0f);
+			if (x1 <= x0) continue;
+
+			previewRects.push_back({ x0, y, x1 - x0, scale });
+		}
+
+		SDL_SetRenderDrawBlendMode(gameRenderer, SDL_BLENDMODE_BLEND);
+		SetDrawColour(palette[previewColour]);
+		SDL_RenderFillRectsF(gameRenderer, previewRects.data(), (int)previewRects.size());
+	}
+
+	// Fills the region sharing (x,y)'s colour, stopping at the edge of the selection if there is one
 	void Fill(int x, int y, Uint8 newColour) {
-		rendered = false;
+		if (GetPixel(x, y) < 0 || modifiedData[GetIndex(x, y)] == newColour) return;
 
-		Uint8 oldColour = modifiedData[GetIndex(x, y)];
-		if (oldColour == newColour)
-			return;
+		SDL_Rect changed = FloodFill(modifiedData, width, height, x, y, newColour, floodVisited, selection.IsEmpty() ? NULL : &selection, floodSpans);
+		MarkDirty(changed);
+		LinkEdits(changed);
+	}
+
+	// Non-contiguous fill: every pixel sharing (x,y)'s index takes the new one, within the selection if there is one.
+	// The image is scanned a frame tile at a time across the job system, and only tiles that changed are uploaded
+	// and stored again.
+	void ReplaceColour(int x, int y, Uint8 to) {
+		if (GetPixel(x, y) < 0 || modifiedData[GetIndex(x, y)] == to) return;
+		Uint8 from = modifiedData[GetIndex(x, y)];
+
+		int tilesX = timeline.GetTilesX();
+		replacedTiles.assign((size_t)tilesX * timeline.GetTilesY(), 0);
+		bool limited = !selection.IsEmpty();
+
+		ParallelForTiles({ 0,0,(int)width,(int)height }, FRAME_TILE, FRAME_TILE, [&](SDL_Rect r) {
+			int tx = r.x / FRAME_TILE;
+			Uint64 changed = 0;
+			for (int y = 0; y < r.h; y++) {
+				Uint64 allowed = limited ? selection.GetRowWord(tx, r.y + y) : ~0ULL;
+				if (allowed != 0) changed |= ReplaceRow(modifiedData + GetIndex(r.x, r.y + y), r.w, from, to, allowed);
+			}
+			if (changed != 0) replacedTiles[(size_t)(r.y / FRAME_TILE) * tilesX + tx] = 1;
+		});
+
+		replacedList.clear();
+		SDL_Rect bounds = { 0,0,0,0 };
+		for (size_t i = 0; i < replacedTiles.size(); i++) {
+			if (!replacedTiles[i]) continue;
+			replacedList.push_back((int)i);
+
+			SDL_Rect r = timeline.TileRect((int)i % tilesX, (int)i / tilesX);
+			if (bounds.w <= 0) bounds = r;
+			else SDL_UnionRect(&bounds, &r, &bounds);
+		}
+		if (replacedList.empty()) return;
 
-		std::queue<SDL_Point> Q;
-		Q.push({ x,y });
+		// Stored now rather than when the frame is left, as the area waiting to be stored would cover everything between them
+		timeline.StoreTiles(currentFrame, modifiedData, replacedList);
 
-		SDL_Rect bounds = { 0,0,width,height };
+		// Dense changes are cheaper to upload as one area
+		if ((Sint64)replacedList.size() * FRAME_TILE_BYTES * 2 >= (Sint64)bounds.w * bounds.h) {
+			if (dirty.w <= 0 || dirty.h <= 0) dirty = bounds;
+			else SDL_UnionRect(&dirty, &bounds, &dirty);
+		}
+		else
+			for (int i : replacedList) dirtyTiles.push_back(timeline.TileRect(i % tilesX, i / tilesX));
 
-		while (!Q.empty()) {
-			SDL_Point w, e;
-			e = Q.front();
-			w = e;
-			Q.pop();
+		LinkEdits(bounds);
+	}
 
-			int i = GetIndex(w.x, w.y);
+	// Sweeps the brush along the line. The stroke is clipped to the image before it is rasterised,
+	// then written a row span at a time.
+	void DrawLine(int x0, int y0, int x1, int y1, Uint8 colour) {
+		strokeSpans.clear();
+		brush.Stroke(x0, y0, x1, y1, { 0,0,(int)width,(int)height }, strokeSpans);
+		DrawSpans(strokeSpans, colour);
+	}
 
-			if (modifiedData[i] == newColour) continue;
+	// Writes spans into the image after clipping them to it and the selection, returning the area that changed
+	SDL_Rect DrawSpans(std::vector<span>& spans, Uint8 colour) {
+		ClipSpans(spans, { 0,0,(int)width,(int)height });
+		if (!selection.IsEmpty()) selection.IntersectSpans(spans);
+		FillSpans(modifiedData, width, spans, colour);
 
-			int i1, i2;
-			i1 = i;
-			i2 = i1;
-			while (w.x - 1 >= 0 && modifiedData[i1 - 1] == oldColour) {
-				w.x--;
-				i1--;
+		SDL_Rect changed = SpanBounds(spans);
+		MarkDirty(changed);
+		LinkEdits(changed);
+		return changed;
+	}
+
+	const SelectionMask& GetSelection() {
+		return selection;
+	}
+
+	void SetSelection(const SelectionMask& mask) {
+		selection = mask;
+	}
+
+	// Rasterised shape spans combined with base, which is usually the selection from before the tool started
+	void Select(const std::vector<span>& shape, SelectionOp op, const SelectionMask& base) {
+		selectionShape.Resize(width, height);
+		selectionShape.SetSpans(shape, true);
+
+		if (op == SelectionOp::Replace) selection = selectionShape;
+		else {
+			if (&base != &selection) selection = base;
+			selection.Combine(selectionShape, op);
+		}
+	}
+
+	// Magic wand, selecting the region Fill would fill from (x,y)
+	void SelectRegion(int x, int y, SelectionOp op) {
+		if (GetPixel(x, y) < 0) return;
+
+		floodSpans.clear();
+		FloodSpans(modifiedData, width, height, x, y, floodVisited, NULL, floodSpans);
+		Select(floodSpans, op, selection);
+	}
+
+	void InvertSelection() {
+		selection.Invert();
+	}
+
+	void ClearSelection() {
+		selection.Clear();
+	}
+
+	// Marching ants along the cached outline: black lines under white dashes that crawl over time.
+	// Only the parts of the outline on screen are drawn.
+	void RenderSelection() {
+		if (selection.IsEmpty()) return;
+
+		SDL_FRect area = GetFrameRect(canvasArea);
+		float scale = area.w / width;
+		float phase = (float)((currentTime / 100) % 8);
+
+		antRects.clear();
+		antDashes.clear();
+
+		for (const outlineSegment& o : selection.GetOutline()) {
+			float x0 = std::max(area.x + o.x0 * scale, -1.0f);
+			float y0 = std::max(area.y + o.y0 * scale, -1.0f);
+			float x1 = std::min(area.x + o.x1 * scale, windowWidth + 1.0f);
+			float y1 = std::min(area.y + o.y1 * scale, windowHeight + 1.0f);
+			if (x1 < x0 || y1 < y0) continue;
+
+			bool horizontal = o.y0 == o.y1;
+			antRects.push_back(horizontal ? SDL_FRect{ x0, y0, x1 - x0, 1 } : SDL_FRect{ x0, y0, 1, y1 - y0 });
+
+			float start = horizontal ? x0 : y0;
+			float end = horizontal ? x1 : y1;
+			for (float d = floor((start + phase) / 8) * 8 - phase; d < end; d += 8) {
+				float a = std::max(d, start);
+				float b = std::min(d + 4, end);
+				if (a >= b) continue;
+				antDashes.push_back(horizontal ? SDL_FRect{ a, y0, b - a, 1 } : SDL_FRect{ x0, a, 1, b - a });
 			}
-			while (e.x + 1 < width && modifiedData[i2 + 1] == oldColour) {
-				e.x++;
-				i2++;
+		}
+
+		SetDrawColour(0, 0, 0);
+		SDL_RenderFillRectsF(gameRenderer, antRects.data(), (int)antRects.size());
+		SetDrawColour(255, 255, 255);
+		SDL_RenderFillRectsF(gameRenderer, antDashes.data(), (int)antDashes.size());
+	}
+
+	bool IsTransforming() {
+		return transforming;
+	}
+
+	FloatingSelection& GetFloating() {
+		return floating;
+	}
+
+	// Lifts the selection off the image, or the whole image when nothing is selected, leaving background behind
+	void BeginTransform(Uint8 background) {
+		if (transforming) return;
+
+		SDL_Rect area = selection.IsEmpty() ? SDL_Rect{ 0,0,(int)width,(int)height } : selection.GetBounds();
+		floating.Lift(modifiedData, width, area, selection.IsEmpty() ? NULL : &selection, background);
+		transforming = true;
+		transformArea = { 0,0,0,0 };
+
+		MarkDirty(area);
+	}
+
+	// Resamples the floating pixels into the image at full resolution. The selection follows them.
+	void CommitTransform() {
+		if (!transforming) return;
+
+		SDL_Rect stamped = floating.Stamp(modifiedData, width, height, selection);
+		MarkDirty(stamped);
+		transforming = false;
+
+		// The hole left where the pixels were lifted from is carried to other instances along with where they landed
+		SDL_Rect lifted = floating.GetSourceRect();
+		if (stamped.w > 0 && stamped.h > 0) SDL_UnionRect(&lifted, &stamped, &lifted);
+		LinkEdits(lifted);
+	}
+
+	void CancelTransform() {
+		if (!transforming) return;
+
+		floating.Restore(modifiedData, width);
+		MarkDirty(floating.GetSourceRect());
+		transforming = false;
+	}
+
+	// Live preview of the transform. Only the part of it inside the image and on screen is resampled,
+	// and only when the transform, palette or view has changed.
+	void RenderTransform() {
+		SDL_FRect area = GetFrameRect(canvasArea);
+		float scale = area.w / width;
+
+		SDL_Rect bounds = floating.GetBounds();
+		SDL_Rect image = { 0,0,(int)width,(int)height };
+		SDL_Rect visible = {
+			(int)floor(-area.x / scale), (int)floor(-area.y / scale),
+			(int)ceil(windowWidth / scale) + 2, (int)ceil(windowHeight / scale) + 2
+		};
+
+		SDL_Rect draw;
+		if (SDL_IntersectRect(&bounds, &visible, &draw) && SDL_IntersectRect(&draw, &image, &draw)) {
+			if (draw.w > transformTextureW || draw.h > transformTextureH) {
+				if (transformTexture != NULL) {
+					TrackTexture(transformTexture, MemoryTag::Textures, false);
+					SDL_DestroyTexture(transformTexture);
+				}
+				transformTextureW = std::max(draw.w, transformTextureW);
+				transformTextureH = std::max(draw.h, transformTextureH);
+				transformTexture = SDL_CreateTexture(gameRenderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, transformTextureW, transformTextureH);
+				TrackTexture(transformTexture, MemoryTag::Textures, true);
+				SDL_SetTextureBlendMode(transformTexture, SDL_BLENDMODE_BLEND);
+				transformArea = { 0,0,0,0 };
 			}
 
-			int x = w.x;
-			for (int i = i1; i <= i2; i++, x++) {
-				modifiedData[i] = newColour;
-				if (w.y + 1 < height && modifiedData[i + width] == oldColour) Q.push({ x, w.y + 1 });
-				if (w.y - 1 >= 0 && modifiedData[i - width] == oldColour) Q.push({ x, w.y - 1 });
+			if (floating.GetVersion() != transformVersion || !SDL_RectEquals(&draw, &transformArea)) {
+				transformVersion = floating.GetVersion();
+				transformArea = draw;
+
+				Uint32 colours[256];
+				memcpy(colours, palette, sizeof(colours));
+				transformIndex.resize(draw.w);
+				transformCovered.resize(draw.w);
+
+				SDL_Rect lock = { 0,0,draw.w,draw.h };
+				Uint8* pixels;
+				int pitch;
+				if (SDL_LockTexture(transformTexture, &lock, (void**)&pixels, &pitch) == 0) {
+					for (int y = 0; y < draw.h; y++) {
+						floating.SampleRow(draw.y + y, draw.x, draw.x + draw.w, transformIndex.data(), transformCovered.data());
+
+						Uint32* out = (Uint32*)(pixels + y * pitch);
+						for (int x = 0; x < draw.w; x++)
+							out[x] = transformCovered[x] ? colours[transformIndex[x]] : 0;
+					}
+					SDL_UnlockTexture(transformTexture);
+				}
 			}
+
+			SDL_Rect src = { 0,0,draw.w,draw.h };
+			SDL_FRect dst = { area.x + draw.x * scale, area.y + draw.y * scale, draw.w * scale, draw.h * scale };
+			SDL_RenderCopyF(gameRenderer, transformTexture, &src, &dst);
 		}
+
+		SDL_FRect box = { area.x + bounds.x * scale, area.y + bounds.y * scale, bounds.w * scale, bounds.h * scale };
+		SetDrawColour(255, 255, 255);
+		SDL_RenderDrawRectF(gameRenderer, &box);
 	}
 
-	// https://en.wikipedia.org/wiki/Bresenham%27s_line_algorithm
-	void DrawLine(int x0, int y0, int x1, int y1, Uint8 colour) {
-		rendered = false;
-
-		int dx = abs(x1 - x0);
-		int sx = x0 < x1 ? 1 : -1;
-		int dy = -abs(y1 - y0);
-		int sy = y0 < y1 ? 1 : -1;
-		int err = dx + dy;
-		while (1) {
-			modifiedData[GetIndex(x0,y0)] = colour;
-			if (x0 == x1 && y0 == y1) return;
-			int e2 = 2 * err;
-			if (e2 >= dy) {
-				err += dy;
-				x0 += sx;
-			}
-			if (e2 <= dx) {
-				err += dx;
-				y0 += sy;
+	int GetFrameCount() {
+		return timeline.GetFrameCount();
+	}
+
+	int GetCurrentFrame() {
+		return playing ? playFrame : currentFrame;
+	}
+
+	size_t GetUniqueTiles() {
+		return timeline.UniqueTiles();
+	}
+
+	// Tilemap mode with tiles of size pixels, or off for 0
+	void SetTilemap(int size, bool flips) {
+		CommitTransform();
+		tilemapSize = size;
+		tilemapFlips = flips;
+		RebuildTilemap();
+	}
+
+	int GetTilemapSize() {
+		return tilemapSize;
+	}
+
+	bool GetTilemapFlips() {
+		return tilemapFlips;
+	}
+
+	const Tilemap& GetTilemap() {
+		return tilemap;
+	}
+
+	// FNV-1a over the palette and every frame. Every frame is hashed as its width*height pixels, so the sum doesn't
+	// depend on which one is current.
+	Uint64 Checksum() {
+		Uint64 hash = 0xCBF29CE484222325ULL;
+		auto add = [&](const Uint8* bytes, size_t size) {
+			for (size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+		};
+
+		StoreFrame();
+		add((const Uint8*)palette, sizeof(SDL_Colour) * 256);
+		std::vector<Uint8>& image = ScratchBuffer<Uint8>((size_t)width * height);
+		for (int f = 0; f < timeline.GetFrameCount(); f++) {
+			timeline.Extract(f, image.data());
+			add(image.data(), (size_t)width * height);
+		}
+		return hash;
+	}
+
+	// Writes edits made since the current frame was last stored into its tiles
+	void StoreFrame() {
+		timeline.Store(currentFrame, modifiedData, unstored);
+		unstored = { 0,0,0,0 };
+	}
+
+	// Only the tiles that differ between the two frames are copied into the image and re-uploaded
+	void SelectFrame(int index) {
+		playing = false;
+		index = std::max(0, std::min(index, timeline.GetFrameCount() - 1));
+		if (index == currentFrame) return;
+
+		CommitTransform();
+		StoreFrame();
+		MarkDirty(timeline.Load(currentFrame, index, modifiedData));
+		currentFrame = index;
+		unstored = { 0,0,0,0 };
+		RebuildTilemap();
+	}
+
+	// Inserts a copy of the current frame after it and moves to it
+	void AddFrame() {
+		SetPlaying(false);
+		CommitTransform();
+		StoreFrame();
+		timeline.Insert(currentFrame + 1, currentFrame);
+		currentFrame++;
+	}
+
+	void DeleteFrame() {
+		if (timeline.GetFrameCount() <= 1) return;
+
+		SetPlaying(false);
+		CommitTransform();
+		StoreFrame();
+		int next = currentFrame > 0 ? currentFrame - 1 : 1;
+		MarkDirty(timeline.Load(currentFrame, next, modifiedData));
+		unstored = { 0,0,0,0 };
+
+		timeline.Remove(currentFrame);
+		if (next > currentFrame) next--;
+		currentFrame = next;
+		RebuildTilemap();
+	}
+
+	const onionSettings& GetOnionSettings() {
+		return onion;
+	}
+
+	void SetOnionSettings(const onionSettings& settings) {
+		onion = settings;
+		onionSettingsVersion++;
+	}
+
+	// The image is opaque, so the ghosts go over it, showing only where neighbouring frames differ from this one.
+	// They follow the stored frames, so edits show up in them once the frame has been stored.
+	void RenderOnionSkin() {
+		if (!onion.enabled || timeline.GetFrameCount() < 2) return;
+
+		int first = std::max(0, currentFrame - onion.before);
+		int last = std::min(timeline.GetFrameCount() - 1, currentFrame + onion.after);
+
+		onionKey.clear();
+		onionKey.push_back(currentFrame);
+		onionKey.push_back(paletteVersion);
+		onionKey.push_back(onionSettingsVersion);
+		for (int f = first; f <= last; f++) onionKey.push_back(timeline.GetFrame(f).version);
+
+		if (onionTexture == NULL || onionKey != onionBuilt) {
+			if (onionTexture == NULL) {
+				onionTexture = SDL_CreateTexture(gameRenderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC, width, height);
+				TrackTexture(onionTexture, MemoryTag::Textures, true);
+				SDL_SetTextureBlendMode(onionTexture, SDL_BLENDMODE_BLEND);
 			}
+
+			onionPixels.resize((size_t)width * height);
+			ComposeOnionSkin(timeline, currentFrame, palette, onion, onionPixels.data(), width * 4);
+			SDL_UpdateTexture(onionTexture, NULL, onionPixels.data(), width * 4);
+			onionBuilt = onionKey;
 		}
+
+		DrawTexture(onionTexture, GetFrameRect(canvasArea));
+	}
+
+	// Writes every frame to a looping GIF
+	bool ExportAnimation(const char* path) {
+		CommitTransform();
+		StoreFrame();
+
+		bool exported = ExportGIF(timeline, palette, path);
+#ifdef ERROR_LOGGING
+		if (!exported) MakeLog("Unable to export animation: " + std::string(path));
+#endif // ERROR_LOGGING
+		return exported;
+	}
+
+	// Writes every frame, trimmed of the background index, to a sprite sheet and its JSON atlas
+	bool ExportSheet(const char* imagePath, const char* jsonPath, Uint8 background) {
+		CommitTransform();
+		StoreFrame();
+
+		bool exported = ExportSpriteSheet(timeline, palette, background, imagePath, jsonPath);
+#ifdef ERROR_LOGGING
+		if (!exported) MakeLog("Unable to export sprite sheet: " + std::string(imagePath));
+#endif // ERROR_LOGGING
+		return exported;
+	}
+
+	bool IsPlaying() {
+		return playing;
+	}
+
+	// Stopping leaves the editor on whichever frame was showing
+	void SetPlaying(bool play) {
+		if (play == playing) return;
+
+		if (play) {
+			CommitTransform();
+			StoreFrame();
+			playFrame = currentFrame;
+			playNext = currentTime + timeline.GetFrame(playFrame).duration;
+		}
+		playing = play;
+		if (!play) SelectFrame(playFrame);
+	}
+
+	void RenderPlayback() {
+		int count = timeline.GetFrameCount();
+
+		// Fall back into step rather than racing to catch up after a stall
+		if ((Sint32)(currentTime - playNext) > 1000) playNext = currentTime;
+		while ((Sint32)(currentTime - playNext) >= 0) {
+			playFrame = (playFrame + 1) % count;
+			playNext += timeline.GetFrame(playFrame).duration;
+		}
+
+		DrawTexture(FrameTexture(playFrame), GetFrameRect(canvasArea));
 	}
 
 	SDL_Point MapToTexture(SDL_Point screenspace) {
@@ -323,6 +1319,116 @@ public:
 		};
 	}
 
+	// Loads any image SDL_image understands, quantising it onto the palette. Loading runs on a worker, so a large
+	// file doesn't hold up the window, and the palette it's quantised onto is the one at the time of the call.
+	// Once it's loaded the canvas takes the size of the image and the unlocked palette entries are rebuilt.
+	void ImportImage(const std::string& path, QuantiseOptions options) {
+		struct importJob {
+			indexedImage image;
+			bool loaded = false;
+			std::string error;
+		};
+		auto import = std::make_shared<importJob>();
+		memcpy(import->image.palette, palette, sizeof(palette));
+		memcpy(import->image.locked, paletteLocked, sizeof(paletteLocked));
+
+		Jobs().RunAsync([import, path, options] {
+			import->loaded = LoadIndexedImage(path.c_str(), import->image, options, false);
+			if (!import->loaded) import->error = SDL_GetError();
+		}, [this, import] {
+			if (!import->loaded) {
+#ifdef ERROR_LOGGING
+				MakeLog("Unable to load image: " + import->error);
+#endif // ERROR_LOGGING
+				return;
+			}
+			TakeImage(import->image);
+		});
+	}
+
+	// Replaces the canvas with a loaded image and its palette
+	void TakeImage(const indexedImage& image) {
+		AllocateImage(image.width, image.height);
+		memcpy(modifiedData, image.pixels.data(), image.pixels.size());
+		memcpy(palette, image.palette, sizeof(palette));
+
+		memcpy(appliedData, modifiedData, width * height);
+		SDL_SetPaletteColors(surfacePalette, palette, 0, 256);
+		timeline.SetPaletteSize(PaletteSize(palette));
+		RebuildTilemap();
+
+		int fit = std::min(windowWidth / (int)width, windowHeight / (int)height);
+		SetZoom(fit);
+	}
+
+	// Every frame resized to W*H by resample(src, srcW, srcH, dst), keeping the current frame and the timings.
+	// Frames are stored as tiles, so they're taken out whole before the canvas is reallocated at the new size.
+	template <class F>
+	void ResampleFrames(unsigned W, unsigned H, F&& resample) {
+		if (W == 0 || H == 0) return;
+		if (W > CANVAS_MAX_SIZE || H > CANVAS_MAX_SIZE) {
+#ifdef ERROR_LOGGING
+			MakeLog("Canvas of " + std::to_string(W) + "x" + std::to_string(H) + " is too large");
+#endif // ERROR_LOGGING
+			return;
+		}
+
+		SetPlaying(false);
+		CommitTransform();
+		StoreFrame();
+
+		int count = timeline.GetFrameCount(), current = currentFrame;
+		int oldW = width, oldH = height;
+		size_t oldSize = (size_t)oldW * oldH;
+		std::vector<Uint8> frames(oldSize * count);
+		std::vector<int> durations(count);
+		for (int f = 0; f < count; f++) {
+			timeline.Extract(f, frames.data() + f * oldSize);
+			durations[f] = timeline.GetFrame(f).duration;
+		}
+
+		AllocateImage(W, H);
+		for (int f = 0; f < count; f++) {
+			resample(frames.data() + f * oldSize, oldW, oldH, modifiedData);
+			if (f == 0) timeline.Reset(modifiedData, W, H);
+			else {
+				timeline.Insert(f, f - 1);
+				timeline.Store(f, modifiedData, { 0,0,(int)W,(int)H });
+			}
+			timeline.SetFrameDuration(f, durations[f]);
+		}
+
+		currentFrame = current;
+		timeline.Extract(currentFrame, modifiedData);
+		memcpy(appliedData, modifiedData, (size_t)W * H);
+		unstored = { 0,0,0,0 };
+		RebuildTilemap();
+		MarkAllDirty();
+
+		int fit = std::min(windowWidth / (int)width, windowHeight / (int)height);
+		SetZoom(fit);
+	}
+
+	// Scales every frame up by a whole number with one of the pixel art modes
+	void ScaleCanvas(ScaleMode mode, int factor) {
+		if (factor <= 1) return;
+
+		std::vector<Uint8> scaled, scratch;
+		ResampleFrames(width * factor, height * factor, [&](const Uint8* src, int w, int h, Uint8* dst) {
+			UpscaleIndices(mode, src, w, h, factor, scaled, scratch);
+			memcpy(dst, scaled.data(), scaled.size());
+		});
+	}
+
+	// Scales every frame down by a whole number, each block taking the index most of it has
+	void ShrinkCanvas(int factor) {
+		if (factor <= 1 || width <= 1 || height <= 1) return;
+
+		ResampleFrames((width + factor - 1) / factor, (height + factor - 1) / factor, [&](const Uint8* src, int w, int h, Uint8* dst) {
+			DownscaleMajority(src, w, h, factor, dst);
+		});
+	}
+
 	void ApplyChanges() {
 
 	}
@@ -337,34 +1443,21 @@ protected:
 	SDL_FRect frameRect{ 0,0,0,0 };
 	frame drawFrame;
 	SDL_Colour pPalette[256];
-	SDL_Surface* rawPaletteSurface;
 	SDL_Texture* paletteArea = NULL;
 	SDL_Texture* transparentLayer = NULL;
 	SDL_Colour gridColour = {12, 23, 39, 255};
 
 	unsigned scale = 0;
 
-	void CreatePaletteSurface() {
-		rawPaletteSurface = SDL_CreateRGBSurface(0, 16, 16, 8, 0, 0, 0, 0);
-		if (rawPaletteSurface->format->palette == NULL) SDL_SetSurfacePalette(rawPaletteSurface, SDL_AllocPalette(256));
-		SDL_SetPaletteColors(rawPaletteSurface->format->palette, pPalette, 0, 256);
-		Uint8* ptr = (Uint8*)(rawPaletteSurface->pixels);
-		for (int i = 0; i < 256; i++) *(ptr++) = i;
-	}
-
+	// The palette is already 16x16 RGBA32 pixels, so it's uploaded as it is into a texture made once
 	void RenderPalette() {
-		SDL_SetPaletteColors(rawPaletteSurface->format->palette, pPalette, 0, 256);
-
-		SDL_Surface* tmpSurface = SDL_CreateRGBSurfaceWithFormat(0, 16, 16, 32, SDL_PIXELFORMAT_RGBA32);
-		SDL_FillRect(tmpSurface, NULL, 0);
-		SDL_Rect src{ 0,0,16,16 };
-		SDL_BlitSurface(rawPaletteSurface, &src, tmpSurface, &src);
-		
-		if (paletteArea != NULL) SDL_DestroyTexture(paletteArea);
+		if (paletteArea == NULL) {
+			paletteArea = SDL_CreateTexture(gameRenderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC, 16, 16);
+			SDL_SetTextureBlendMode(paletteArea, SDL_BlendMode::SDL_BLENDMODE_BLEND);
+			TrackTexture(paletteArea, MemoryTag::UI, true);
+		}
 
-		paletteArea = SDL_CreateTextureFromSurface(gameRenderer, tmpSurface);
-		SDL_SetTextureBlendMode(paletteArea, SDL_BlendMode::SDL_BLENDMODE_BLEND);
-		SDL_FreeSurface(tmpSurface);
+		SDL_UpdateTexture(paletteArea, NULL, pPalette, 16 * sizeof(SDL_Colour));
 	}
 
 	void RenderTransparentLayer() {
@@ -379,10 +1472,12 @@ protected:
 
 		transparentLayer = SDL_CreateTextureFromSurface(gameRenderer, tmpSurface);
 		SDL_SetTextureBlendMode(transparentLayer, SDL_BlendMode::SDL_BLENDMODE_BLEND);
+		TrackTexture(transparentLayer, MemoryTag::UI, true);
+		SDL_FreeSurface(tmpSurface);
 	}
 
 	bool PaletteChanged() {
-		bool changes;
+		bool changes = false;
 		for (int i = 0; i < 256; i++) {
 			SDL_Colour pColour = pPalette[i];
 			SDL_Colour colour = parent->GetPaletteColour(i);
@@ -396,97 +1491,348 @@ protected:
 				pPalette[i] = colour;
 			}
 		}
-		return changes;
+		return changes;
+	}
+
+	// Every line of the grid goes in one call, as a one pixel wide rectangle
+	void DrawGrid() {
+		SetDrawColour(gridColour);
+
+		SDL_FRect lines[34];
+		for (int i = 0; i < 17; i++) {
+			lines[i] = { frameRect.x, frameRect.y + i * 17, 273, 1 };
+			lines[17 + i] = { frameRect.x + i * 17, frameRect.y, 1, 273 };
+		}
+		SDL_RenderFillRectsF(gameRenderer, lines, 34);
+	}
+
+	void DrawShadow() {
+		SDL_SetRenderDrawBlendMode(gameRenderer, SDL_BLENDMODE_BLEND);
+		SetDrawColour(shadowColour);
+
+		FillRect(SDL_FRect{
+			frameRect.x + shadowOffset.x,
+			frameRect.y + shadowOffset.y,
+			frameRect.w,
+			frameRect.h
+			});
+	}
+
+	// The palette, its frame and its shadow, which is all of what it draws
+	SDL_Rect GetCacheBounds() {
+		SDL_FRect area = GetFrameRect(drawFrame);
+		float x0 = area.x + std::min(shadowOffset.x, 0.0f), y0 = area.y + std::min(shadowOffset.y, 0.0f);
+		float x1 = area.x + area.w + std::max(shadowOffset.x, 0.0f), y1 = area.y + area.h + std::max(shadowOffset.y, 0.0f);
+		int x = (int)floor(x0), y = (int)floor(y0);
+		return { x, y, (int)ceil(x1) - x + 1, (int)ceil(y1) - y + 1 };
+	}
+
+	// The palette lives in the canvas, so changes to it are found by comparison
+	bool CacheChanged() {
+		if (!PaletteChanged()) return false;
+		RenderPalette();
+		return true;
+	}
+
+public:
+	DrawCanvas* parent;
+	bool visible = true;
+	SDL_Colour shadowColour = {0,0,0,127}; // Call MarkDirty after changing
+	SDL_FPoint shadowOffset = {8,8};
+
+	void SetScale(unsigned s) {
+		if (s != scale) {
+			drawFrame = {
+				{1, 1},
+				{1, 1},
+
+				{0,0},
+
+				{ s * 16.0f + 1, s * 16.0f + 1 },
+				{ -16, -16 }
+			};
+			MarkDirty();
+		}
+	}
+
+	// Nothing it draws changes from frame to frame unless the palette does, so it's drawn from a cached texture
+	PaletteRenderer(DrawCanvas& p, unsigned s = 17) : parent(&p) {
+		RenderTransparentLayer();
+		PaletteChanged();
+		RenderPalette();
+
+		SetScale(s);
+		cached = true;
+	}
+
+	~PaletteRenderer() {
+		TrackTexture(paletteArea, MemoryTag::UI, false);
+		TrackTexture(transparentLayer, MemoryTag::UI, false);
+		SDL_DestroyTexture(paletteArea);
+		SDL_DestroyTexture(transparentLayer);
+	}
+
+	void render(SDL_Renderer* r) {
+		if (!cached && PaletteChanged()) RenderPalette();
+		frameRect = GetFrameRect(drawFrame);
+		frameRect.x -= renderOrigin.x;
+		frameRect.y -= renderOrigin.y;
+		DrawShadow();
+		DrawTexture(transparentLayer, frameRect);
+		DrawTexture(paletteArea, frameRect);
+		DrawGrid();
+	}
+
+	SDL_Rect GetBounds() {
+		return ToRect(GetFrameRect(drawFrame));
+	}
+};
+
+// Saturation/value square above a hue strip, editing one palette entry of the canvas
+class ColourPicker : public InteractiveElement {
+protected:
+	enum class Drag {
+		None,
+		Square,
+		Strip
+	};
+
+	frame drawFrame;
+	SDL_Texture* svSquare = NULL;
+	SDL_Texture* hueStrip = NULL;
+	int resolution;
+
+	std::vector<Sint16> hueRow;
+	std::vector<Sint16> saturationRow;
+
+	int squareHue = -1; // Hue the square was last generated for
+	Drag dragging = Drag::None;
+	SDL_Colour lastColour = { 0,0,0,0 };
+
+	DrawCanvas* parent;
+	Uint8* target;
+
+	static const int stripHeight = 16;
+	static const int stripGap = 8;
+
+	SDL_FRect SquareRect(SDL_FRect area) {
+		return { area.x, area.y, area.w, area.h - stripHeight - stripGap };
+	}
+
+	SDL_FRect StripRect(SDL_FRect area) {
+		return { area.x, area.y + area.h - stripHeight, area.w, (float)stripHeight };
+	}
+
+	// Only the hue changes the square, so saturation and value edits never touch the texture
+	void RenderSquare() {
+		if (squareHue == hue) return;
+
+		Uint32* pixels;
+		int pitch;
+		if (SDL_LockTexture(svSquare, NULL, (void**)&pixels, &pitch) != 0) return;
+
+		std::fill(hueRow.begin(), hueRow.end(), (Sint16)hue);
+		for (int y = 0; y < resolution; y++)
+			HSVToRGBA(hueRow.data(), saturationRow.data(), 255 - y * 255 / (resolution - 1), (Uint32*)((Uint8*)pixels + y * pitch), resolution);
+
+		SDL_UnlockTexture(svSquare);
+		squareHue = hue;
+	}
+
+	void RenderStrip() {
+		std::vector<Sint16> hues(resolution);
+		std::vector<Sint16> full(resolution, 255);
+		std::vector<Uint32> pixels(resolution);
+
+		for (int x = 0; x < resolution; x++) hues[x] = (Sint16)(x * (HUE_RANGE - 1) / (resolution - 1));
+		HSVToRGBA(hues.data(), full.data(), 255, pixels.data(), resolution);
+
+		hueStrip = SDL_CreateTexture(gameRenderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC, resolution, 1);
+		TrackTexture(hueStrip, MemoryTag::UI, true);
+		SDL_UpdateTexture(hueStrip, NULL, pixels.data(), resolution * 4);
+	}
+
+	void ApplyColour() {
+		Uint32 pixel = HSVPixel(hue, saturation, value);
+		lastColour = { (Uint8)pixel, (Uint8)(pixel >> 8), (Uint8)(pixel >> 16), parent->GetPaletteColour(*target).a };
+		parent->SetPaletteColour(lastColour, *target);
+	}
+
+	void DrawMarker(SDL_FRect r) {
+		SetDrawColour(0, 0, 0);
+		DrawRect(r);
+		SetDrawColour(255, 255, 255);
+		DrawRect(SDL_FRect{ r.x + 1, r.y + 1, r.w - 2, r.h - 2 });
+	}
+
+public:
+	int hue = 0;
+	int saturation = 255;
+	int value = 255;
+
+	ColourPicker(DrawCanvas& p, Uint8& index, int size = 192, int res = 512) : resolution(res), parent(&p), target(&index) {
+		drawFrame = {
+			{1, 0},
+			{1, 0},
+
+			{0, 0},
+
+			{ (float)size, (float)(size + stripHeight + stripGap) },
+			{ -16, 16 }
+		};
+
+		hueRow.resize(resolution);
+		saturationRow.resize(resolution);
+		for (int x = 0; x < resolution; x++) saturationRow[x] = (Sint16)(x * 255 / (resolution - 1));
+
+		svSquare = SDL_CreateTexture(gameRenderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, resolution, resolution);
+		TrackTexture(svSquare, MemoryTag::UI, true);
+		RenderStrip();
+	}
+
+	~ColourPicker() {
+		TrackTexture(svSquare, MemoryTag::UI, false);
+		TrackTexture(hueStrip, MemoryTag::UI, false);
+		SDL_DestroyTexture(svSquare);
+		SDL_DestroyTexture(hueStrip);
+	}
+
+	SDL_Rect GetBounds() {
+		return ToRect(GetFrameRect(drawFrame));
+	}
+
+	void update() {
+		InteractiveElement::update();
+
+		SDL_FRect area = GetFrameRect(drawFrame);
+		clickArea = ToRect(area);
+
+		SDL_FRect square = SquareRect(area);
+		SDL_FRect strip = StripRect(area);
+
+		if (interactive && buttonPressed(SDL_BUTTON_LEFT)) {
+			if (InBounds(ToRect(square), mouseX, mouseY)) dragging = Drag::Square;
+			else if (InBounds(ToRect(strip), mouseX, mouseY)) dragging = Drag::Strip;
+		}
+		if (buttonReleased(SDL_BUTTON_LEFT)) dragging = Drag::None;
+
+		// Setting the entry redraws the whole canvas, so a drag only does it when the colour moves
+		switch (dragging)
+		{
+		case Drag::Square: {
+			int s = std::min(255, std::max(0, (int)((mouseX - square.x) * 255 / square.w)));
+			int v = 255 - std::min(255, std::max(0, (int)((mouseY - square.y) * 255 / square.h)));
+			if (s != saturation || v != value) {
+				saturation = s;
+				value = v;
+				ApplyColour();
+			}
+		}
+			break;
+		case Drag::Strip: {
+			int h = std::min(HUE_RANGE - 1, std::max(0, (int)((mouseX - strip.x) * (HUE_RANGE - 1) / strip.w)));
+			if (h != hue) {
+				hue = h;
+				ApplyColour();
+			}
+		}
+			break;
+		case Drag::None: {
+			// Follow the entry when it is changed or swapped from elsewhere
+			SDL_Colour c = parent->GetPaletteColour(*target);
+			if (c.r != lastColour.r || c.g != lastColour.g || c.b != lastColour.b) {
+				RGBToHSV(c, hue, saturation, value);
+				lastColour = c;
+			}
+		}
+			break;
+		}
 	}
 
-	void DrawGrid() {
-		SetDrawColour(gridColour);
-
-		SDL_Point upperleft = { frameRect.x, frameRect.y };
-
-		// Horizontal
-		for (int y = 0; y < 17; y++) DrawLine(upperleft.x, upperleft.y + y * 17, upperleft.x + 272, upperleft.y + y * 17);
+	void render(SDL_Renderer* r) {
+		RenderSquare();
 
-		// Vertical
-		for (int x = 0; x < 17; x++) DrawLine(upperleft.x + x * 17, upperleft.y, upperleft.x + x * 17, upperleft.y + 272);
-	}
+		SDL_FRect area = GetFrameRect(drawFrame);
+		SDL_FRect square = SquareRect(area);
+		SDL_FRect strip = StripRect(area);
 
-	void DrawShadow() {
-		SDL_SetRenderDrawBlendMode(gameRenderer, SDL_BLENDMODE_BLEND);
-		SetDrawColour(shadowColour);
+		DrawTexture(svSquare, square);
+		DrawTexture(hueStrip, strip);
 
-		FillRect(SDL_FRect{
-			frameRect.x + shadowOffset.x,
-			frameRect.y + shadowOffset.y,
-			frameRect.w,
-			frameRect.h
+		DrawMarker({
+			square.x + saturation * square.w / 255 - 3,
+			square.y + (255 - value) * square.h / 255 - 3,
+			7, 7
 			});
+		DrawMarker({ strip.x + hue * strip.w / (HUE_RANGE - 1) - 2, strip.y - 2, 5, strip.h + 4 });
 	}
+};
 
-public:
-	DrawCanvas* parent;
-	bool visible = true;
-	SDL_Colour shadowColour = {0,0,0,127};
-	SDL_FPoint shadowOffset = {8,8};
-
-	void SetScale(unsigned s) {
-		if (s != scale) {
-			drawFrame = {
-				{1, 1},
-				{1, 1},
+DrawCanvas* canvas;
+PaletteRenderer* palette;
+ColourPicker* picker;
 
-				{0,0},
+QuantiseOptions importOptions;
+ScaleMode scaleMode = ScaleMode::Scale2x;
 
-				{ s * 16.0f + 1, s * 16.0f + 1 },
-				{ -16, -16 }
-			};
-		}
+// Dropping an image file onto the window imports it, in the background
+class ImportDropCallback : public EventCallback {
+public:
+	void Callback(SDL_Event& e) {
+		canvas->ImportImage(e.drop.file, importOptions);
+		SDL_free(e.drop.file);
 	}
+};
 
-	PaletteRenderer(DrawCanvas& p, unsigned s = 17) : parent(&p) {
-		RenderTransparentLayer();
-		CreatePaletteSurface();
-		RenderPalette();
+ImportDropCallback importDrop;
 
-		SetScale(s);
-	}
+class TargetsResetCallback : public EventCallback {
+public:
+	void Callback(SDL_Event& e) {
+		RenderableElement::InvalidateCaches();
 
-	~PaletteRenderer() {
-		SDL_DestroyTexture(paletteArea);
-		SDL_DestroyTexture(transparentLayer);
-		SDL_FreeSurface(rawPaletteSurface);
+		// A lost device takes the atlas texture with it
+		if (e.type == SDL_RENDER_DEVICE_RESET) uiIcons.Build(SpriteAtlas::ListImages("icons"), "icons.cache");
 	}
+};
 
-	void render(SDL_Renderer* r) {
-		if (PaletteChanged()) RenderPalette();
-		frameRect = GetFrameRect(drawFrame);
-		DrawShadow();
-		DrawTexture(transparentLayer, frameRect);
-		DrawTexture(paletteArea, frameRect);
-		DrawGrid();
-	}
+TargetsResetCallback targetsReset;
 
-	SDL_Rect GetBounds() {
-		return ToRect(GetFrameRect(drawFrame));
-	}
-};
+textFont uiFont;
+TextRenderer* uiText;
 
-DrawCanvas* canvas;
-PaletteRenderer* palette;
+std::string HexColour(SDL_Colour c) {
+	char hex[8];
+	snprintf(hex, sizeof(hex), "#%02X%02X%02X", c.r, c.g, c.b);
+	return hex;
+}
 
 enum class ToolType {
 	Pencil,
 	Line,
-	Fill
+	Fill,
+	Rectangle,
+	Ellipse,
+	Polygon,
+	Select,
+	Lasso,
+	Wand,
+	Transform
 };
 
 ToolType currentTool = ToolType::Pencil;
+
+// One icon per tool in ToolType order, looked up in the UI atlas at startup
+const char* toolIconNames[] = { "pencil", "line", "fill", "rectangle", "ellipse", "polygon", "select", "lasso", "wand", "transform" };
+sprite toolIcons[SDL_arraysize(toolIconNames)];
+
 Uint8 LeftColour = 1;
 Uint8 RightColour = 2;
 bool LeftDrawing = false;
 bool RightDrawing = false;
 
 int mouseTarget = 0;
+bool showMemory = false;
 
 void DisablePencil() {
 	LeftDrawing = false;
@@ -495,6 +1841,46 @@ void DisablePencil() {
 
 void DisableFill() {}
 
+SDL_Point dragStart;
+std::vector<span> dragSpans;
+bool shapeFilled = false;
+
+void DisableDrag() {
+	LeftDrawing = false;
+	RightDrawing = false;
+	canvas->ClearPreview();
+}
+
+std::vector<SDL_Point> polygonPoints;
+
+void DisablePolygon() {
+	polygonPoints.clear();
+	DisableDrag();
+}
+
+SelectionMask selectionBase;
+SelectionOp selectionOp = SelectionOp::Replace;
+std::vector<SDL_Point> lassoPoints;
+
+void DisableSelect() {
+	LeftDrawing = false;
+	lassoPoints.clear();
+}
+
+SDL_Point transformGrab;
+float rotateStartAngle = 0;
+float rotateGrabAngle = 0;
+
+void EnableTransform() {
+	canvas->BeginTransform(RightColour);
+}
+
+void DisableTransform() {
+	canvas->CommitTransform();
+	LeftDrawing = false;
+	RightDrawing = false;
+}
+
 void EnablePencil() {}
 
 void EnableFill() {}
@@ -542,16 +1928,256 @@ void PencilLogic() {
 	}
 }
 
+SDL_Rect ImageRect() {
+	return { 0,0,(int)canvas->GetImageWidth(),(int)canvas->GetImageHeight() };
+}
+
+// Spans of the line or shape being dragged from dragStart to end
+void DragSpans(SDL_Point end, std::vector<span>& out) {
+	out.clear();
+
+	switch (currentTool)
+	{
+	case ToolType::Line:
+		canvas->brush.Stroke(dragStart.x, dragStart.y, end.x, end.y, ImageRect(), out);
+		break;
+	case ToolType::Rectangle:
+		RectSpans(dragStart.x, dragStart.y, end.x, end.y, shapeFilled, ImageRect(), out);
+		break;
+	case ToolType::Ellipse:
+		EllipseSpans(dragStart.x, dragStart.y, end.x, end.y, shapeFilled, ImageRect(), out);
+		break;
+	default:
+		break;
+	}
+}
+
+// Line, rectangle and ellipse tools. Drag to preview, release to commit. Pressing the other button cancels.
+void DragLogic() {
+	SDL_Point coords = canvas->MapToTexture({ mouseX, mouseY });
+
+	if ((LeftDrawing && buttonPressed(SDL_BUTTON_RIGHT)) || (RightDrawing && buttonPressed(SDL_BUTTON_LEFT))) {
+		DisableDrag();
+		return;
+	}
+
+	bool started = false;
+	if (mouseTarget == 1 && !LeftDrawing && !RightDrawing) {
+		if (buttonPressed(SDL_BUTTON_LEFT)) LeftDrawing = started = true;
+		else if (buttonPressed(SDL_BUTTON_RIGHT)) RightDrawing = started = true;
+		if (started) dragStart = coords;
+	}
+
+	if (!LeftDrawing && !RightDrawing) return;
+
+	Uint8 colour = LeftDrawing ? LeftColour : RightColour;
+
+	if ((LeftDrawing && buttonReleased(SDL_BUTTON_LEFT)) || (RightDrawing && buttonReleased(SDL_BUTTON_RIGHT))) {
+		canvas->ClearPreview();
+		if (currentTool == ToolType::Line) canvas->DrawLine(dragStart.x, dragStart.y, coords.x, coords.y, colour);
+		else {
+			DragSpans(coords, dragSpans);
+			canvas->DrawSpans(dragSpans, colour);
+		}
+		LeftDrawing = false;
+		RightDrawing = false;
+		return;
+	}
+
+	if (started || mouseXDelta || mouseYDelta) {
+		DragSpans(coords, dragSpans);
+		canvas->SetPreview(dragSpans, colour);
+	}
+}
+
+// Each press adds a vertex. Pressing on the first vertex or Enter commits, Escape or the other button cancels.
+void PolygonLogic() {
+	SDL_Point coords = canvas->MapToTexture({ mouseX, mouseY });
+
+	bool cancel = keyPressed(SDLK_ESCAPE) ||
+		(LeftDrawing && buttonPressed(SDL_BUTTON_RIGHT)) ||
+		(RightDrawing && buttonPressed(SDL_BUTTON_LEFT));
+	if (cancel) {
+		DisablePolygon();
+		return;
+	}
+
+	bool pressed = false;
+	if (mouseTarget == 1) {
+		if (!RightDrawing && buttonPressed(SDL_BUTTON_LEFT)) LeftDrawing = pressed = true;
+		else if (!LeftDrawing && buttonPressed(SDL_BUTTON_RIGHT)) RightDrawing = pressed = true;
+	}
+
+	if (!LeftDrawing && !RightDrawing) return;
+
+	Uint8 colour = LeftDrawing ? LeftColour : RightColour;
+
+	bool closing = pressed && polygonPoints.size() >= 3 &&
+		abs(coords.x - polygonPoints[0].x) <= 1 && abs(coords.y - polygonPoints[0].y) <= 1;
+
+	if (closing || (keyPressed(SDLK_RETURN) && polygonPoints.size() >= 2)) {
+		dragSpans.clear();
+		PolygonSpans(polygonPoints, shapeFilled, ImageRect(), dragSpans);
+		canvas->DrawSpans(dragSpans, colour);
+		DisablePolygon();
+		return;
+	}
+
+	if (pressed) polygonPoints.push_back(coords);
+
+	if (pressed || mouseXDelta || mouseYDelta) {
+		polygonPoints.push_back(coords);
+		dragSpans.clear();
+		PolygonSpans(polygonPoints, shapeFilled, ImageRect(), dragSpans);
+		polygonPoints.pop_back();
+		canvas->SetPreview(dragSpans, colour);
+	}
+}
+
+// Shift adds to the selection, Ctrl subtracts from it and both together intersect with it
+SelectionOp HeldSelectionOp() {
+	bool add = keyDown(SDLK_LSHIFT) || keyDown(SDLK_RSHIFT);
+	bool subtract = keyDown(SDLK_LCTRL) || keyDown(SDLK_RCTRL);
+
+	if (add && subtract) return SelectionOp::Intersect;
+	if (add) return SelectionOp::Add;
+	if (subtract) return SelectionOp::Subtract;
+	return SelectionOp::Replace;
+}
+
+// Rectangle and lasso selection. The selection follows the drag, combined with the selection from before it started.
+// Clicking without dragging deselects, and the right button cancels.
+void SelectLogic() {
+	SDL_Point coords = canvas->MapToTexture({ mouseX, mouseY });
+
+	if (LeftDrawing && buttonPressed(SDL_BUTTON_RIGHT)) {
+		canvas->SetSelection(selectionBase);
+		DisableSelect();
+		return;
+	}
+
+	bool started = false;
+	if (mouseTarget == 1 && !LeftDrawing && buttonPressed(SDL_BUTTON_LEFT)) {
+		LeftDrawing = started = true;
+		selectionOp = HeldSelectionOp();
+		selectionBase = canvas->GetSelection();
+		dragStart = coords;
+		lassoPoints.assign(1, coords);
+	}
+
+	if (!LeftDrawing) return;
+
+	if (buttonReleased(SDL_BUTTON_LEFT)) {
+		if (selectionOp == SelectionOp::Replace && coords.x == dragStart.x && coords.y == dragStart.y)
+			canvas->ClearSelection();
+		DisableSelect();
+		return;
+	}
+
+	if (!started && !mouseXDelta && !mouseYDelta) return;
+
+	dragSpans.clear();
+	if (currentTool == ToolType::Select)
+		RectSpans(dragStart.x, dragStart.y, coords.x, coords.y, true, ImageRect(), dragSpans);
+	else {
+		SDL_Point last = lassoPoints.back();
+		if (coords.x != last.x || coords.y != last.y) lassoPoints.push_back(coords);
+		PolygonSpans(lassoPoints, true, ImageRect(), dragSpans);
+	}
+	canvas->Select(dragSpans, selectionOp, selectionBase);
+}
+
+void WandLogic() {
+	if (mouseTarget != 1 || !buttonPressed(SDL_BUTTON_LEFT)) return;
+
+	SDL_Point coords = canvas->MapToTexture({ mouseX,mouseY });
+	canvas->SelectRegion(coords.x, coords.y, HeldSelectionOp());
+}
+
+// Angle from the centre of the floating pixels to the cursor
+float TransformGrabAngle(SDL_Point coords) {
+	SDL_Rect bounds = canvas->GetFloating().GetBounds();
+	return atan2f(coords.y - (bounds.y + bounds.h / 2.0f), coords.x - (bounds.x + bounds.w / 2.0f));
+}
+
+// Left drag moves and right drag rotates freely, with Shift snapping to 15 degrees.
+// , and . turn by 90 degrees, j and k flip, - and = scale, o toggles RotSprite-style rotation.
+// Enter commits and Escape puts the pixels back. Pressing on the canvas afterwards lifts the selection again.
+void TransformLogic() {
+	if (!canvas->IsTransforming()) {
+		if (mouseTarget != 1 || !buttonPressed(SDL_BUTTON_LEFT)) return;
+		canvas->BeginTransform(RightColour);
+	}
+
+	if (keyPressed(SDLK_RETURN)) {
+		DisableTransform();
+		return;
+	}
+	if (keyPressed(SDLK_ESCAPE)) {
+		canvas->CancelTransform();
+		LeftDrawing = false;
+		RightDrawing = false;
+		return;
+	}
+
+	FloatingSelection& floating = canvas->GetFloating();
+	SDL_Point coords = canvas->MapToTexture({ mouseX, mouseY });
+
+	if (keyPressed(SDLK_COMMA)) floating.Rotate90(-1);
+	if (keyPressed(SDLK_PERIOD)) floating.Rotate90(1);
+	if (keyPressed(SDLK_j)) floating.FlipHorizontal();
+	if (keyPressed(SDLK_k)) floating.FlipVertical();
+	if (keyPressed(SDLK_MINUS)) floating.SetScale(std::max(0.25f, floating.GetScale() - 0.25f));
+	if (keyPressed(SDLK_EQUALS)) floating.SetScale(floating.GetScale() + 0.25f);
+	if (keyPressed(SDLK_o)) floating.SetRotSprite(!floating.GetRotSprite());
+
+	if (mouseTarget == 1 && !RightDrawing && buttonPressed(SDL_BUTTON_LEFT)) {
+		LeftDrawing = true;
+		transformGrab = coords;
+	}
+	if (LeftDrawing) {
+		if (coords.x != transformGrab.x || coords.y != transformGrab.y) {
+			floating.Move(coords.x - transformGrab.x, coords.y - transformGrab.y);
+			transformGrab = coords;
+		}
+		if (buttonReleased(SDL_BUTTON_LEFT)) LeftDrawing = false;
+	}
+
+	if (mouseTarget == 1 && !LeftDrawing && buttonPressed(SDL_BUTTON_RIGHT)) {
+		RightDrawing = true;
+		rotateStartAngle = floating.GetAngle();
+		rotateGrabAngle = TransformGrabAngle(coords);
+	}
+	if (RightDrawing) {
+		if (mouseXDelta || mouseYDelta) {
+			float angle = rotateStartAngle + TransformGrabAngle(coords) - rotateGrabAngle;
+			if (keyDown(SDLK_LSHIFT) || keyDown(SDLK_RSHIFT)) {
+				const float snap = 3.14159265f / 12;
+				angle = floorf(angle / snap + 0.5f) * snap;
+			}
+			floating.SetAngle(angle);
+		}
+		if (buttonReleased(SDL_BUTTON_RIGHT)) RightDrawing = false;
+	}
+}
+
 void FillLogic() {
 	if (mouseTarget != 1) return;
 
 	SDL_Point coords = canvas->MapToTexture({ mouseX,mouseY });
 
-	if (buttonPressed(SDL_BUTTON_LEFT))
-		canvas->Fill(coords.x, coords.y, LeftColour);
+	// Shift replaces the colour everywhere instead of just the region under the cursor
+	bool global = keyDown(SDLK_LSHIFT) || keyDown(SDLK_RSHIFT);
+
+	if (buttonPressed(SDL_BUTTON_LEFT)) {
+		if (global) canvas->ReplaceColour(coords.x, coords.y, LeftColour);
+		else canvas->Fill(coords.x, coords.y, LeftColour);
+	}
 
-	if (buttonPressed(SDL_BUTTON_RIGHT))
-		canvas->Fill(coords.x, coords.y, RightColour);
+	if (buttonPressed(SDL_BUTTON_RIGHT)) {
+		if (global) canvas->ReplaceColour(coords.x, coords.y, RightColour);
+		else canvas->Fill(coords.x, coords.y, RightColour);
+	}
 }
 
 void SwitchTool(ToolType type) {
@@ -563,6 +2189,19 @@ void SwitchTool(ToolType type) {
 		DisablePencil();
 		break;
 	case ToolType::Line:
+	case ToolType::Rectangle:
+	case ToolType::Ellipse:
+		DisableDrag();
+		break;
+	case ToolType::Polygon:
+		DisablePolygon();
+		break;
+	case ToolType::Select:
+	case ToolType::Lasso:
+		DisableSelect();
+		break;
+	case ToolType::Transform:
+		DisableTransform();
 		break;
 	case ToolType::Fill:
 		DisableFill();
@@ -581,6 +2220,9 @@ void SwitchTool(ToolType type) {
 	case ToolType::Fill:
 		EnableFill();
 		break;
+	case ToolType::Transform:
+		EnableTransform();
+		break;
 	default:
 		break;
 	}
@@ -592,12 +2234,30 @@ void DrawLogic() {
 	if (mouseWheelYDelta)
 		canvas->SetZoom(canvas->GetZoom() + mouseWheelYDelta);
 
+	if (canvas->IsPlaying()) return;
+
 	switch (currentTool)
 	{
 	case ToolType::Pencil:
 		PencilLogic();
 		break;
 	case ToolType::Line:
+	case ToolType::Rectangle:
+	case ToolType::Ellipse:
+		DragLogic();
+		break;
+	case ToolType::Polygon:
+		PolygonLogic();
+		break;
+	case ToolType::Select:
+	case ToolType::Lasso:
+		SelectLogic();
+		break;
+	case ToolType::Wand:
+		WandLogic();
+		break;
+	case ToolType::Transform:
+		TransformLogic();
 		break;
 	case ToolType::Fill:
 		FillLogic();
@@ -605,57 +2265,33 @@ void DrawLogic() {
 	}
 }
 
-SDL_Colour HSVColour(float h, float saturation, float value) {
-	//   _    _
-	//R:  \__/
-
-	//    __
-	//G: /  \__
-
-	//      __
-	//B: __/  \
+// The selected colours follow their entries, so they pick out the same colours afterwards
+void RemapPalette(const paletteRemap& remap) {
+	canvas->RemapPalette(remap);
+	LeftColour = remap.lut[LeftColour];
+	RightColour = remap.lut[RightColour];
+}
 
-	//Hue ->
+void PaletteLogic() {
+	bool shift = keyDown(SDLK_LSHIFT) || keyDown(SDLK_RSHIFT);
+	bool ctrl = keyDown(SDLK_LCTRL) || keyDown(SDLK_RCTRL);
+	const SDL_Colour* colours = canvas->GetPalette();
+	const bool* locked = canvas->GetPaletteLocks();
 
-	int hue = ((int)floor(h * 1536)) % 1536;
+	if (keyPressed(SDLK_F1))
+		RemapPalette(SortPaletteRemap(colours, locked, shift ? PaletteSortKey::Hue : PaletteSortKey::Luminance));
 
-	Uint8 R = 0, G = 0, B = 0;
-	hue = (hue % (255 * 6)) + (255 * 6) % (255 * 6);
+	if (keyPressed(SDLK_F2))
+		RemapPalette(MergePaletteRemap(colours, locked));
 
-	if (hue < 256) {
-		R = 255;
-		G = hue;
+	if (keyPressed(SDLK_F3)) {
+		bool used[256];
+		canvas->GetUsedIndices(used);
+		RemapPalette(CompactPaletteRemap(colours, locked, used));
 	}
-	else if ((hue -= 255) < 256) {
-		R = 255 - hue;
-		G = 255;
-	}
-	else if ((hue -= 255) < 256) {
-		G = 255;
-		B = hue;
-	}
-	else if ((hue -= 255) < 256) {
-		G = 255 - hue;
-		B = 255;
-	}
-	else if ((hue -= 255) < 256) {
-		R = hue;
-		B = 255;
-	}
-	else {
-		R = 255;
-		B = 255 - hue;
-	}
-
-	R = 255 - (255 - R) * saturation;
-	G = 255 - (255 - G) * saturation;
-	B = 255 - (255 - B) * saturation;
-
-	R *= value;
-	G *= value;
-	B *= value;
 
-	return { R,G,B,255 };
+	if (keyPressed(SDLK_F4) && LeftColour != RightColour)
+		RemapPalette(ctrl ? MovePaletteRemap(colours, locked, LeftColour, RightColour) : SwapPaletteRemap(colours, locked, LeftColour, RightColour));
 }
 
 void DoLogic() {
@@ -669,22 +2305,213 @@ void DoLogic() {
 	if (keyPressed(SDLK_p))
 		SwitchTool(ToolType::Pencil);
 
+	if (keyPressed(SDLK_l))
+		SwitchTool(ToolType::Line);
+
+	if (keyPressed(SDLK_r))
+		SwitchTool(ToolType::Rectangle);
+
+	if (keyPressed(SDLK_e))
+		SwitchTool(ToolType::Ellipse);
+
+	if (keyPressed(SDLK_n))
+		SwitchTool(ToolType::Polygon);
+
+	if (keyPressed(SDLK_s))
+		SwitchTool(ToolType::Select);
+
+	if (keyPressed(SDLK_a))
+		SwitchTool(ToolType::Lasso);
+
+	if (keyPressed(SDLK_w))
+		SwitchTool(ToolType::Wand);
+
+	if (keyPressed(SDLK_m))
+		SwitchTool(ToolType::Transform);
+
+	if (keyPressed(SDLK_LEFT))
+		canvas->SelectFrame(canvas->GetCurrentFrame() - 1);
+
+	if (keyPressed(SDLK_RIGHT))
+		canvas->SelectFrame(canvas->GetCurrentFrame() + 1);
+
+	if (keyPressed(SDLK_g))
+		canvas->AddFrame();
+
+	if (keyPressed(SDLK_DELETE))
+		canvas->DeleteFrame();
+
+	if (keyPressed(SDLK_SPACE))
+		canvas->SetPlaying(!canvas->IsPlaying());
+
+	if (keyPressed(SDLK_u)) {
+		onionSettings onion = canvas->GetOnionSettings();
+		onion.enabled = !onion.enabled;
+		canvas->SetOnionSettings(onion);
+	}
+
+	if (keyPressed(SDLK_t)) {
+		onionSettings onion = canvas->GetOnionSettings();
+		onion.before = onion.after = onion.before % 3 + 1;
+		canvas->SetOnionSettings(onion);
+	}
+
+	if (keyPressed(SDLK_F5))
+		canvas->ExportAnimation("animation.gif");
+
+	if (keyPressed(SDLK_F6))
+		canvas->ExportSheet("animation.png", "animation.json", RightColour);
+
+	if (keyPressed(SDLK_F7))
+		SetFramePacing((FramePacing)(((int)framePacing + 1) % 4));
+
+	if (keyPressed(SDLK_F8))
+		showMemory = !showMemory;
+
+	if (keyPressed(SDLK_F9))
+		DumpMemory("memory.txt");
+
+	if (keyPressed(SDLK_i))
+		canvas->InvertSelection();
+
+	if (keyPressed(SDLK_x))
+		canvas->ClearSelection();
+
+	if (keyPressed(SDLK_h))
+		shapeFilled = !shapeFilled;
+
+	if (keyPressed(SDLK_LEFTBRACKET))
+		canvas->brush.SetSize(canvas->brush.GetSize() - 1);
+
+	if (keyPressed(SDLK_RIGHTBRACKET))
+		canvas->brush.SetSize(canvas->brush.GetSize() + 1);
+
+	if (keyPressed(SDLK_b))
+		canvas->brush.SetShape(canvas->brush.GetShape() == BrushShape::Square ? BrushShape::Circle : BrushShape::Square);
+
+	if (keyPressed(SDLK_d))
+		importOptions.dither = !importOptions.dither;
+
+	if (keyPressed(SDLK_v))
+		canvas->showGrid = !canvas->showGrid;
+
+	if (keyPressed(SDLK_c))
+		canvas->showChecker = !canvas->showChecker;
+
+	// Cycles tilemap mode through 8, 16 and 32 pixel tiles and off. Shift toggles matching flipped tiles.
+	if (keyPressed(SDLK_F10) && !canvas->IsPlaying()) {
+		if (keyDown(SDLK_LSHIFT) || keyDown(SDLK_RSHIFT))
+			canvas->SetTilemap(canvas->GetTilemapSize(), !canvas->GetTilemapFlips());
+		else {
+			int size = canvas->GetTilemapSize();
+			canvas->SetTilemap(size == 0 ? 8 : size == 32 ? 0 : size * 2, canvas->GetTilemapFlips());
+		}
+	}
+
+	// Scales the whole animation up by the resample mode's own factor, or down by half with shift.
+	// Ctrl cycles the mode.
+	if (keyPressed(SDLK_F11) && !canvas->IsPlaying()) {
+		if (keyDown(SDLK_LCTRL) || keyDown(SDLK_RCTRL))
+			scaleMode = (ScaleMode)(((int)scaleMode + 1) % ((int)ScaleMode::XBR + 1));
+		else if (keyDown(SDLK_LSHIFT) || keyDown(SDLK_RSHIFT))
+			canvas->ShrinkCanvas(2);
+		else
+			canvas->ScaleCanvas(scaleMode, std::max(2, ScaleModeFactor(scaleMode)));
+	}
+
+	if (!canvas->IsPlaying()) PaletteLogic();
+
 	mouseTarget = 0;
 	SDL_Point mousePos = { mouseX, mouseY };
 	if (InBounds(canvas->GetBounds(), mousePos)) mouseTarget = 1;
 	if (InBounds(palette->GetBounds(), mousePos)) mouseTarget = 2;
+	if (InBounds(picker->GetBounds(), mousePos)) mouseTarget = 3;
 
 	switch (gameState)
 	{
 	case ScreenState::CreateImage:
 		break;
 	case ScreenState::DrawImage:
-		canvas->SetPaletteColour(HSVColour(currentTime / 5000.0, 1, 1), 1);
 		DrawLogic();
 		break;
 	}
 }
 
+// Cursor coordinates and the two selected colours, along the bottom of the window
+void DrawStatus() {
+	float y = windowHeight - uiText->textScale - 8.0f;
+	float x = 8;
+
+	// Every tool, with the current one lit. Left out when no icons were found.
+	if (uiIcons.GetTexture() != NULL) {
+		const float size = 16;
+		for (int i = 0; i < (int)SDL_arraysize(toolIcons); i++) {
+			frame icon = { { 0,0 }, { 0,0 }, { 0,0 }, { size,size }, { x, y + (uiText->textScale - size) / 2 } };
+			RenderSprite(toolIcons[i], icon, i == (int)currentTool ? SDL_Colour{ 255,255,255,255 } : SDL_Colour{ 96,96,96,255 });
+			x += size + 2;
+		}
+		x += uiText->textScale;
+	}
+
+	std::string left = "L " + HexColour(canvas->GetPaletteColour(LeftColour));
+	uiText->RenderText(left, x, y, canvas->GetPaletteColour(LeftColour));
+	x += uiText->MeasureText(left).x + uiText->textScale;
+
+	std::string right = "R " + HexColour(canvas->GetPaletteColour(RightColour));
+	uiText->RenderText(right, x, y, canvas->GetPaletteColour(RightColour));
+	x += uiText->MeasureText(right).x + uiText->textScale;
+
+	// Built in place, as strings this long would otherwise be allocated every frame
+	char frame[64];
+	snprintf(frame, sizeof(frame), "Frame %d/%d (%u tiles)", canvas->GetCurrentFrame() + 1, canvas->GetFrameCount(), (unsigned)canvas->GetUniqueTiles());
+	uiText->RenderText(frame, x, y);
+	x += uiText->MeasureText(frame).x + uiText->textScale;
+
+	static const char* pacingNames[] = { "VSync", "Capped", "Uncapped", "Late" };
+	frameStats stats = GetFrameStats();
+	char timing[64];
+	snprintf(timing, sizeof(timing), "%s %.1fms p99 %.1fms input %.1fms", pacingNames[(int)framePacing], stats.meanMs, stats.p99Ms, stats.latencyMs);
+	uiText->RenderText(timing, x, y);
+	x += uiText->MeasureText(timing).x + uiText->textScale;
+
+	char scaling[32];
+	snprintf(scaling, sizeof(scaling), "Scale %s", ScaleModeName(scaleMode));
+	uiText->RenderText(scaling, x, y);
+	x += uiText->MeasureText(scaling).x + uiText->textScale;
+
+	const Tilemap& tilemap = canvas->GetTilemap();
+	if (!tilemap.IsEmpty()) {
+		char tiles[64];
+		snprintf(tiles, sizeof(tiles), "Tilemap %dpx%s: %d unique of %d", tilemap.GetTileSize(), tilemap.GetMatchFlips() ? " +flips" : "",
+			tilemap.UniqueTiles(), tilemap.GetTilesX() * tilemap.GetTilesY());
+		uiText->RenderText(tiles, x, y);
+		x += uiText->MeasureText(tiles).x + uiText->textScale;
+	}
+
+	if (mouseTarget == 1) {
+		SDL_Point coords = canvas->MapToTexture({ mouseX, mouseY });
+		char position[32];
+		snprintf(position, sizeof(position), "%d, %d", coords.x, coords.y);
+		uiText->RenderText(position, x, y);
+	}
+}
+
+// Memory held by each subsystem, down the top left of the window
+void DrawMemory() {
+	float y = 8;
+	char line[96];
+
+	for (int i = 0; i < (int)MemoryTag::Count; i++) {
+		const memoryCounter& counter = MemoryCounters()[i];
+		snprintf(line, sizeof(line), "%s %.2f MB (peak %.2f MB)", MemoryTagName((MemoryTag)i), counter.current / 1048576.0, counter.peak / 1048576.0);
+		uiText->RenderText(line, 8, y);
+		y += uiText->textScale;
+	}
+
+	snprintf(line, sizeof(line), "Frame arena %u KB used of %u KB", (unsigned)(FrameMemory().PeakUse() / 1024), (unsigned)(FrameMemory().Capacity() / 1024));
+	uiText->RenderText(line, 8, y);
+}
+
 void DoDraw() {
 	switch (gameState)
 	{
@@ -740,14 +2567,34 @@ void DoDraw() {
 	}
 
 	RenderableElement::RenderAllElements(gameRenderer);
+
+	if (gameState == ScreenState::DrawImage) DrawStatus();
+	if (showMemory) DrawMemory();
+
+	uiSprites.Flush();
+	uiText->Flush();
 }
 
 void SDLG::OnStart() {
-	minFrameDelta = 1000 / 60;
+	SetFramePacing(FramePacing::Late);
 	gameState = ScreenState::DrawImage;
 	canvas = new DrawCanvas(100, 100);
 
 	palette = new PaletteRenderer(*canvas);
+	picker = new ColourPicker(*canvas, LeftColour);
+
+	callbacks[SDL_DROPFILE].push_back(&importDrop);
+	callbacks[SDL_RENDER_TARGETS_RESET].push_back(&targetsReset);
+	callbacks[SDL_RENDER_DEVICE_RESET].push_back(&targetsReset);
+	replayChecksum = [] { return canvas->Checksum(); };
+
+	CreateBuiltinFont(uiFont);
+	TrackTexture(uiFont.atlas, MemoryTag::UI, true);
+	uiText = new TextRenderer(&uiFont.atlas, uiFont.layout);
+
+	// Unchanged icons load from the one cache file
+	uiIcons.Build(SpriteAtlas::ListImages("icons"), "icons.cache");
+	for (int i = 0; i < (int)SDL_arraysize(toolIcons); i++) toolIcons[i] = uiIcons.MakeSprite(toolIconNames[i]);
 }
 
 void SDLG::OnFrame() {
@@ -759,5 +2606,10 @@ void SDLG::OnFrame() {
 }
 
 void SDLG::OnQuit() {
+	delete picker;
+	delete uiText;
+	TrackTexture(uiFont.atlas, MemoryTag::UI, false);
+	SDL_DestroyTexture(uiFont.atlas);
+	uiIcons.Release();
 	delete canvas;
 }
\ No newline at end of file
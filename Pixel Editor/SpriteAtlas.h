@@ -0,0 +1,334 @@
+#pragma once
+
+#include <SDL.h>
+#include <SDL_image.h>
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+
+#include "SDLG.h"
+#include "Generic.h"
+#include "Skyline.h"
+
+// Loose images packed into one texture. Packing is cached on disk along with the size and modification time of
+// every source, so a startup where none of them has changed reads the cache file and opens nothing else.
+#define ATLAS_MAGIC "SDLGATL1"
+#define ATLAS_PADDING 1
+
+struct atlasSprite {
+	std::string name; // File name without its extension
+	SDL_Rect src;
+};
+
+class SpriteAtlas {
+private:
+	struct sourceStamp {
+		std::string path;
+		Uint64 size;
+		Sint64 modified;
+
+		bool operator==(const sourceStamp& other) const {
+			return path == other.path && size == other.size && modified == other.modified;
+		}
+	};
+
+	std::vector<atlasSprite> sprites;
+	SDL_Texture* texture = NULL;
+	int width = 0, height = 0;
+
+	static bool Stamp(const std::string& path, sourceStamp& out) {
+		std::error_code error;
+		out.path = path;
+		out.size = (Uint64)std::filesystem::file_size(path, error);
+		if (error) return false;
+		out.modified = (Sint64)std::filesystem::last_write_time(path, error).time_since_epoch().count();
+		return !error;
+	}
+
+	static std::string SpriteName(const std::string& path) {
+		return std::filesystem::path(path).stem().string();
+	}
+
+	template <class T>
+	static void Put(std::vector<Uint8>& out, const T& value) {
+		const Uint8* bytes = (const Uint8*)&value;
+		out.insert(out.end(), bytes, bytes + sizeof(T));
+	}
+
+	template <class T>
+	static bool Get(const std::vector<Uint8>& in, size_t& cursor, T& value) {
+		if (cursor + sizeof(T) > in.size()) return false;
+		memcpy(&value, in.data() + cursor, sizeof(T));
+		cursor += sizeof(T);
+		return true;
+	}
+
+	bool Upload(const void* pixels) {
+		Release();
+		texture = SDL_CreateTexture(SDLG::gameRenderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC, width, height);
+		if (texture == NULL) return false;
+
+		SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+		SDL_UpdateTexture(texture, NULL, pixels, width * 4);
+		SDLG::TrackTexture(texture, SDLG::MemoryTag::UI, true);
+		return true;
+	}
+
+	// The cache holds the stamps, the packed rects and the raw pixels, so loading it needs no decoding
+	bool LoadCache(const char* cachePath, const std::vector<sourceStamp>& stamps) {
+		SDL_RWops* file = SDL_RWFromFile(cachePath, "rb");
+		if (file == NULL) return false;
+
+		std::vector<Uint8> data((size_t)std::max<Sint64>(SDL_RWsize(file), 0));
+		bool read = SDL_RWread(file, data.data(), 1, data.size()) == data.size();
+		SDL_RWclose(file);
+		if (!read || data.size() < 8 || memcmp(data.data(), ATLAS_MAGIC, 8) != 0) return false;
+
+		size_t cursor = 8;
+		Uint32 count;
+		if (!Get(data, cursor, count) || count != stamps.size()) return false;
+
+		for (const sourceStamp& expected : stamps) {
+			sourceStamp stamp;
+			Uint32 length;
+			if (!Get(data, cursor, length) || cursor + length > data.size()) return false;
+			stamp.path.assign((const char*)data.data() + cursor, length);
+			cursor += length;
+			if (!Get(data, cursor, stamp.size) || !Get(data, cursor, stamp.modified)) return false;
+			if (!(stamp == expected)) return false;
+		}
+
+		Sint32 w, h;
+		if (!Get(data, cursor, w) || !Get(data, cursor, h) || w <= 0 || h <= 0) return false;
+
+		std::vector<atlasSprite> loaded(count);
+		for (Uint32 i = 0; i < count; i++) {
+			loaded[i].name = SpriteName(stamps[i].path);
+			if (!Get(data, cursor, loaded[i].src)) return false;
+		}
+
+		if (cursor + (size_t)w * h * 4 != data.size()) return false;
+
+		sprites = loaded;
+		width = w;
+		height = h;
+		return Upload(data.data() + cursor);
+	}
+
+	void SaveCache(const char* cachePath, const std::vector<sourceStamp>& stamps, const std::vector<Uint32>& pixels) {
+		std::vector<Uint8> out;
+		out.insert(out.end(), ATLAS_MAGIC, ATLAS_MAGIC + 8);
+		Put(out, (Uint32)stamps.size());
+		for (const sourceStamp& stamp : stamps) {
+			Put(out, (Uint32)stamp.path.size());
+			out.insert(out.end(), stamp.path.begin(), stamp.path.end());
+			Put(out, stamp.size);
+			Put(out, stamp.modified);
+		}
+		Put(out, (Sint32)width);
+		Put(out, (Sint32)height);
+		for (const atlasSprite& s : sprites) Put(out, s.src);
+		const Uint8* bytes = (const Uint8*)pixels.data();
+		out.insert(out.end(), bytes, bytes + pixels.size() * 4);
+
+		SDL_RWops* file = SDL_RWFromFile(cachePath, "wb");
+		if (file == NULL) {
+#ifdef ERROR_LOGGING
+			SDLG::MakeLog("Unable to write atlas cache: " + std::string(SDL_GetError()));
+#endif // ERROR_LOGGING
+			return;
+		}
+		SDL_RWwrite(file, out.data(), 1, out.size());
+		SDL_RWclose(file);
+	}
+
+	// Loads every image and skyline packs them, tallest first, into a power of two wide sheet
+	bool Pack(const std::vector<sourceStamp>& stamps, std::vector<Uint32>& pixels) {
+		std::vector<SDL_Surface*> images(stamps.size(), NULL);
+		std::vector<size_t> order(stamps.size());
+		int area = 0, widest = 1;
+
+		for (size_t i = 0; i < stamps.size(); i++) {
+			order[i] = i;
+			SDL_Surface* loaded = IMG_Load(stamps[i].path.c_str());
+			if (loaded != NULL) {
+				images[i] = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_RGBA32, 0);
+				SDL_FreeSurface(loaded);
+			}
+			if (images[i] == NULL) {
+#ifdef ERROR_LOGGING
+				SDLG::MakeLog("Unable to load sprite " + stamps[i].path + ": " + std::string(SDL_GetError()));
+#endif // ERROR_LOGGING
+				continue;
+			}
+			area += (images[i]->w + ATLAS_PADDING) * (images[i]->h + ATLAS_PADDING);
+			widest = std::max(widest, images[i]->w + ATLAS_PADDING);
+		}
+
+		std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+			int ha = images[a] != NULL ? images[a]->h : 0;
+			int hb = images[b] != NULL ? images[b]->h : 0;
+			return ha > hb;
+		});
+
+		width = 64;
+		while (width * width < area || width < widest) width *= 2;
+
+		SkylinePacker packer(width);
+		sprites.assign(stamps.size(), {});
+		for (size_t i : order) {
+			sprites[i].name = SpriteName(stamps[i].path);
+			sprites[i].src = { 0,0,0,0 };
+			if (images[i] == NULL) continue;
+
+			SDL_Point at = packer.Insert(images[i]->w + ATLAS_PADDING, images[i]->h + ATLAS_PADDING);
+			sprites[i].src = { at.x, at.y, images[i]->w, images[i]->h };
+		}
+		height = std::max(1, packer.Height());
+
+		pixels.assign((size_t)width * height, 0);
+		for (size_t i = 0; i < stamps.size(); i++) {
+			SDL_Surface* image = images[i];
+			if (image == NULL) continue;
+
+			SDL_LockSurface(image);
+			const SDL_Rect& r = sprites[i].src;
+			for (int y = 0; y < r.h; y++)
+				memcpy(&pixels[(size_t)(r.y + y) * width + r.x], (Uint8*)image->pixels + y * image->pitch, (size_t)r.w * 4);
+			SDL_UnlockSurface(image);
+			SDL_FreeSurface(image);
+		}
+		return true;
+	}
+
+public:
+	~SpriteAtlas() {
+		Release();
+	}
+
+	// Packs the images at paths into the atlas, or takes the packing from cachePath if it was made from the same files
+	bool Build(const std::vector<std::string>& paths, const char* cachePath) {
+		std::vector<sourceStamp> stamps;
+		for (const std::string& path : paths) {
+			sourceStamp stamp;
+			if (Stamp(path, stamp)) stamps.push_back(stamp);
+		}
+		if (stamps.empty()) return false;
+
+		if (cachePath != NULL && LoadCache(cachePath, stamps)) return true;
+
+		std::vector<Uint32> pixels;
+		if (!Pack(stamps, pixels)) return false;
+		if (cachePath != NULL) SaveCache(cachePath, stamps, pixels);
+		return Upload(pixels.data());
+	}
+
+	// Every PNG in a directory, sorted so the packing doesn't depend on the order the system lists them in
+	static std::vector<std::string> ListImages(const char* directory) {
+		std::vector<std::string> paths;
+		std::error_code error;
+		for (const auto& entry : std::filesystem::directory_iterator(directory, error))
+			if (entry.is_regular_file(error) && entry.path().extension() == ".png") paths.push_back(entry.path().string());
+
+		std::sort(paths.begin(), paths.end());
+		return paths;
+	}
+
+	void Release() {
+		if (texture == NULL) return;
+		SDLG::TrackTexture(texture, SDLG::MemoryTag::UI, false);
+		SDL_DestroyTexture(texture);
+		texture = NULL;
+	}
+
+	// Index of the sprite with this name, or -1. Look sprites up once and keep the index.
+	int Find(const char* name) const {
+		for (size_t i = 0; i < sprites.size(); i++)
+			if (sprites[i].name == name) return (int)i;
+		return -1;
+	}
+
+	const atlasSprite& GetSprite(int index) const {
+		return sprites[index];
+	}
+
+	// The named sprite as RenderSprite takes it, drawn from the atlas texture. A missing name gives a sprite with no
+	// texture, which RenderSprite shows as a placeholder.
+	sprite MakeSprite(const char* name) {
+		int index = Find(name);
+		if (index < 0) return { { 0,0,0,0 }, NULL };
+		return { sprites[index].src, &texture };
+	}
+
+	int GetSpriteCount() const {
+		return (int)sprites.size();
+	}
+
+	SDL_Texture* GetTexture() const {
+		return texture;
+	}
+};
+
+// Sprites queued through a frame and drawn in one SDL_RenderGeometry call per texture. Textures are drawn in the
+// order they were first used, so sprites that overlap each other should come from the same atlas.
+class SpriteBatch {
+private:
+	struct textureBatch {
+		SDL_Texture* texture;
+		std::vector<SDL_Vertex> vertices;
+		std::vector<int> indices;
+	};
+
+	std::vector<textureBatch> batches;
+	size_t used = 0; // Batches hold on to their buffers between frames
+
+	textureBatch& BatchFor(SDL_Texture* texture) {
+		for (size_t i = 0; i < used; i++)
+			if (batches[i].texture == texture) return batches[i];
+
+		if (used == batches.size()) batches.emplace_back();
+		textureBatch& b = batches[used++];
+		b.texture = texture;
+		return b;
+	}
+
+public:
+	void Add(SDL_Texture* texture, SDL_Rect src, SDL_FRect dst, SDL_Colour tint = { 255,255,255,255 }) {
+		if (texture == NULL) return;
+
+		int tw, th;
+		if (SDL_QueryTexture(texture, NULL, NULL, &tw, &th) != 0) return;
+
+		float u0 = src.x / (float)tw, v0 = src.y / (float)th;
+		float u1 = (src.x + src.w) / (float)tw, v1 = (src.y + src.h) / (float)th;
+
+		textureBatch& b = BatchFor(texture);
+		int base = (int)b.vertices.size();
+		b.vertices.push_back({ { dst.x, dst.y }, tint, { u0, v0 } });
+		b.vertices.push_back({ { dst.x + dst.w, dst.y }, tint, { u1, v0 } });
+		b.vertices.push_back({ { dst.x + dst.w, dst.y + dst.h }, tint, { u1, v1 } });
+		b.vertices.push_back({ { dst.x, dst.y + dst.h }, tint, { u0, v1 } });
+
+		const int quad[6] = { 0, 1, 2, 0, 2, 3 };
+		for (int i : quad) b.indices.push_back(base + i);
+	}
+
+	void Add(const SpriteAtlas& atlas, int sprite, SDL_FRect dst, SDL_Colour tint = { 255,255,255,255 }) {
+		if (sprite < 0 || sprite >= atlas.GetSpriteCount()) return;
+		Add(atlas.GetTexture(), atlas.GetSprite(sprite).src, dst, tint);
+	}
+
+	void Flush() {
+		for (size_t i = 0; i < used; i++) {
+			textureBatch& b = batches[i];
+			if (!b.indices.empty())
+				SDL_RenderGeometry(SDLG::gameRenderer, b.texture, b.vertices.data(), (int)b.vertices.size(), b.indices.data(), (int)b.indices.size());
+			b.vertices.clear();
+			b.indices.clear();
+		}
+		used = 0;
+	}
+};
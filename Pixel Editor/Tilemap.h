@@ -0,0 +1,258 @@
+#pragma once
+
+#include <SDL.h>
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+
+#include "Jobs.h"
+#include "Memory.h"
+
+// Tilemap mode splits the image on a grid of square tiles. Every cell is an instance of a unique tile, flipped
+// or not, and each unique tile's pixels are kept once however many cells show it. Editing one instance edits
+// its tile, and every other instance is rewritten from it. Pixels past the last whole tile aren't part of the map.
+#define TILEMAP_FLIP_X 1
+#define TILEMAP_FLIP_Y 2
+
+struct tileInstance {
+	int tile;
+	Uint8 flip; // TILEMAP_FLIP_X and TILEMAP_FLIP_Y, applied to the tile to give the cell
+};
+
+class Tilemap {
+private:
+	int size = 0, tilesX = 0, tilesY = 0;
+	bool matchFlips = false;
+
+	std::vector<Uint8> tiles; // Unique tiles of size*size pixels, one after another
+	std::vector<tileInstance> cells;
+
+	// Cells showing each tile, from instanceCells[instanceStart[tile]] up to the next tile's start
+	std::vector<int> instanceStart, instanceCells;
+
+	// Tiles edited by the current Propagate, and their pixels from before it
+	std::vector<int> touched, touchedSlot;
+	std::vector<Uint8> original;
+
+	Sint64 tracked = 0;
+
+	// Same word at a time hash as the timeline's tiles. Tiles are 8, 16 or 32 pixels square, so always a whole number of words.
+	static Uint64 Hash(const Uint8* bytes, size_t size) {
+		Uint64 h = 0x9E3779B97F4A7C15ULL;
+		for (size_t i = 0; i < size; i += 8) {
+			Uint64 w;
+			memcpy(&w, bytes + i, 8);
+			h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+			h ^= h >> 29;
+		}
+		return h;
+	}
+
+	// Copies the cell whose top left pixel is at cell into out with flip undone. Flips are their own inverse,
+	// so this also gives a tile the way a cell with that flip shows it.
+	static void ReadCell(const Uint8* cell, int pitch, int size, Uint8 flip, Uint8* out) {
+		for (int y = 0; y < size; y++) {
+			const Uint8* row = cell + (size_t)(flip & TILEMAP_FLIP_Y ? size - 1 - y : y) * pitch;
+			if (flip & TILEMAP_FLIP_X) std::reverse_copy(row, row + size, out + y * size);
+			else memcpy(out + y * size, row, size);
+		}
+	}
+
+	static void WriteCell(const Uint8* tile, int size, Uint8 flip, Uint8* cell, int pitch) {
+		for (int y = 0; y < size; y++) {
+			Uint8* row = cell + (size_t)(flip & TILEMAP_FLIP_Y ? size - 1 - y : y) * pitch;
+			if (flip & TILEMAP_FLIP_X) std::reverse_copy(tile + y * size, tile + (y + 1) * size, row);
+			else memcpy(row, tile + y * size, size);
+		}
+	}
+
+	size_t CellOffset(int cell, int pitch) const {
+		return (size_t)(cell / tilesX) * size * pitch + (size_t)(cell % tilesX) * size;
+	}
+
+	Uint8* TilePixels(int tile) {
+		return tiles.data() + (size_t)tile * size * size;
+	}
+
+	// Groups the cells by the tile they show
+	void Link() {
+		int count = UniqueTiles();
+		instanceStart.assign(count + 1, 0);
+		for (const tileInstance& c : cells) instanceStart[c.tile + 1]++;
+		for (int t = 0; t < count; t++) instanceStart[t + 1] += instanceStart[t];
+
+		instanceCells.resize(cells.size());
+		std::vector<int> next(instanceStart.begin(), instanceStart.end() - 1);
+		for (size_t c = 0; c < cells.size(); c++) instanceCells[next[cells[c].tile]++] = (int)c;
+
+		touchedSlot.assign(count, -1);
+	}
+
+	void Track() {
+		Sint64 bytes = (Sint64)(tiles.capacity() + cells.capacity() * sizeof(tileInstance)
+			+ (instanceStart.capacity() + instanceCells.capacity() + touchedSlot.capacity()) * sizeof(int));
+		SDLG::TrackMemory(SDLG::MemoryTag::Tilemap, bytes - tracked);
+		tracked = bytes;
+	}
+
+public:
+	~Tilemap() {
+		Clear();
+	}
+
+	// Splits a width*height image into tiles of tileSize. Tiles are told apart by hash, a cell checking only
+	// the tiles sharing one of its hashes, so the time taken follows the number of cells rather than its square.
+	// With flips, a cell matching a tile mirrored either or both ways becomes a flipped instance of it.
+	void Build(const Uint8* image, int width, int height, int tileSize, bool flips) {
+		Clear();
+		size = tileSize;
+		matchFlips = flips;
+		tilesX = width / size;
+		tilesY = height / size;
+
+		int count = tilesX * tilesY;
+		int variants = flips ? 4 : 1;
+		size_t bytes = (size_t)size * size;
+		cells.resize(count);
+
+		// Hashing every orientation of every cell is the bulk of the work, and independent between cells
+		std::vector<Uint64> cellHashes((size_t)count * variants);
+		SDLG::ParallelFor(0, count, [&](int first, int last) {
+			std::vector<Uint8>& pixels = SDLG::ScratchBuffer<Uint8>(bytes);
+			for (int c = first; c < last; c++)
+				for (int f = 0; f < variants; f++) {
+					ReadCell(image + CellOffset(c, width), width, size, (Uint8)f, pixels.data());
+					cellHashes[(size_t)c * variants + f] = Hash(pixels.data(), bytes);
+				}
+		});
+
+		std::unordered_multimap<Uint64, int> byHash;
+		std::vector<Uint8>& pixels = SDLG::ScratchBuffer<Uint8>(bytes);
+		for (int c = 0; c < count; c++) {
+			int found = -1;
+			Uint8 flip = 0;
+
+			for (int f = 0; f < variants && found < 0; f++) {
+				auto range = byHash.equal_range(cellHashes[(size_t)c * variants + f]);
+				if (range.first == range.second) continue;
+
+				ReadCell(image + CellOffset(c, width), width, size, (Uint8)f, pixels.data());
+				for (auto it = range.first; it != range.second; ++it)
+					if (memcmp(TilePixels(it->second), pixels.data(), bytes) == 0) {
+						found = it->second;
+						flip = (Uint8)f;
+						break;
+					}
+			}
+
+			if (found < 0) {
+				found = UniqueTiles();
+				ReadCell(image + CellOffset(c, width), width, size, 0, pixels.data());
+				tiles.insert(tiles.end(), pixels.begin(), pixels.end());
+				byHash.emplace(cellHashes[(size_t)c * variants], found);
+			}
+			cells[c] = { found, flip };
+		}
+
+		Link();
+		Track();
+	}
+
+	void Clear() {
+		std::vector<Uint8>().swap(tiles);
+		std::vector<tileInstance>().swap(cells);
+		std::vector<int>().swap(instanceStart);
+		std::vector<int>().swap(instanceCells);
+		std::vector<int>().swap(touchedSlot);
+		touched.clear();
+		original.clear();
+		tilesX = tilesY = 0;
+		Track();
+	}
+
+	// Takes the edits within area of the image into the tiles of the cells they touch, then rewrites every
+	// instance of those tiles to match. Instances edited differently at once all keep their changes, the later
+	// cell winning where they disagree. The rects of rewritten cells are added to updated.
+	void Propagate(Uint8* image, int width, SDL_Rect area, std::vector<SDL_Rect>& updated) {
+		if (cells.empty() || area.w <= 0 || area.h <= 0) return;
+
+		int cx0 = std::max(0, area.x / size), cy0 = std::max(0, area.y / size);
+		int cx1 = std::min(tilesX, (area.x + area.w + size - 1) / size);
+		int cy1 = std::min(tilesY, (area.y + area.h + size - 1) / size);
+		size_t bytes = (size_t)size * size;
+
+		std::vector<Uint8>& pixels = SDLG::ScratchBuffer<Uint8>(bytes);
+		touched.clear();
+		original.clear();
+
+		for (int cy = cy0; cy < cy1; cy++)
+			for (int cx = cx0; cx < cx1; cx++) {
+				int c = cy * tilesX + cx;
+				const tileInstance& cell = cells[c];
+				ReadCell(image + CellOffset(c, width), width, size, cell.flip, pixels.data());
+
+				// Compared with the tile as it was before this edit, so instances left alone don't undo the others
+				Uint8* tile = TilePixels(cell.tile);
+				int slot = touchedSlot[cell.tile];
+				const Uint8* before = slot >= 0 ? original.data() + slot * bytes : tile;
+				if (memcmp(pixels.data(), before, bytes) == 0) continue;
+
+				if (slot < 0) {
+					slot = (int)touched.size();
+					touchedSlot[cell.tile] = slot;
+					touched.push_back(cell.tile);
+					original.insert(original.end(), tile, tile + bytes);
+					before = original.data() + slot * bytes;
+				}
+				for (size_t i = 0; i < bytes; i++)
+					if (pixels[i] != before[i]) tile[i] = pixels[i];
+			}
+
+		for (int t : touched) {
+			touchedSlot[t] = -1;
+			for (int i = instanceStart[t]; i < instanceStart[t + 1]; i++) {
+				int c = instanceCells[i];
+				WriteCell(TilePixels(t), size, cells[c].flip, image + CellOffset(c, width), width);
+				updated.push_back(CellRect(c % tilesX, c / tilesX));
+			}
+		}
+	}
+
+	bool IsEmpty() const {
+		return cells.empty();
+	}
+
+	int GetTileSize() const {
+		return size;
+	}
+
+	bool GetMatchFlips() const {
+		return matchFlips;
+	}
+
+	int GetTilesX() const {
+		return tilesX;
+	}
+
+	int GetTilesY() const {
+		return tilesY;
+	}
+
+	int UniqueTiles() const {
+		return size > 0 ? (int)(tiles.size() / ((size_t)size * size)) : 0;
+	}
+
+	const tileInstance& GetCell(int cx, int cy) const {
+		return cells[cy * tilesX + cx];
+	}
+
+	int InstanceCount(int tile) const {
+		return instanceStart[tile + 1] - instanceStart[tile];
+	}
+
+	SDL_Rect CellRect(int cx, int cy) const {
+		return { cx * size, cy * size, size, size };
+	}
+};
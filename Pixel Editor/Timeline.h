@@ -0,0 +1,493 @@
+#pragma once
+
+#include <SDL.h>
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+
+#include "Jobs.h"
+#include "Memory.h"
+#include "Packed.h"
+#include "Palette.h"
+
+// Frames are stored as 64x64 tiles of palette indices. Identical tiles are kept once and shared between
+// frames by reference count, so frames that mostly match each other cost little more than one frame.
+// Tiles are packed at the bits per pixel the palette's size needs, so low colour art takes 2-8x less.
+#define FRAME_TILE 64
+#define FRAME_TILE_BYTES (FRAME_TILE * FRAME_TILE)
+
+struct frameTile {
+	std::vector<Uint8> pixels; // Packed rows of PackedRowBytes(FRAME_TILE, depth)
+	Uint64 hash;
+	int refs;
+	int depth; // Bits per pixel it was packed at
+	Uint64 used[4]; // Bit per palette index appearing in the tile
+};
+
+class TilePool {
+private:
+	std::vector<frameTile> tiles;
+	std::vector<int> freeSlots;
+	std::unordered_multimap<Uint64, int> byHash;
+	frameTile pending;
+
+	// Number of live tiles each index appears in, so the indices in use are known without a pass over the pixels
+	int usage[256] = {};
+
+	// Bits per pixel every tile is packed at. It follows the palette size, and is raised past it when a tile holds
+	// a higher index, so packing never loses one. Without a palette size it is just what the indices need.
+	int depth = 1;
+
+	static size_t TileBytes(int depth) {
+		return PackedRowBytes(FRAME_TILE, depth) * FRAME_TILE;
+	}
+
+	// Word at a time multiply and rotate hash of the packed tile. Collisions are resolved by comparing contents.
+	static Uint64 Hash(const Uint8* bytes, size_t size, int depth) {
+		Uint64 h = 0x9E3779B97F4A7C15ULL ^ depth;
+		for (size_t i = 0; i < size; i += 8) {
+			Uint64 w;
+			memcpy(&w, bytes + i, 8);
+			h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+			h ^= h >> 29;
+		}
+		return h;
+	}
+
+	// Packs FRAME_TILE_BYTES pixels, each below 1 << depth, into t, setting everything but its references
+	void Encode(const Uint8* pixels, frameTile& t) const {
+		t.depth = depth;
+		size_t row = PackedRowBytes(FRAME_TILE, t.depth);
+		size_t size = TileBytes(t.depth);
+
+		t.pixels.resize(size);
+		for (int y = 0; y < FRAME_TILE; y++) PackRow(pixels + y * FRAME_TILE, FRAME_TILE, t.depth, t.pixels.data() + y * row);
+		t.hash = Hash(t.pixels.data(), size, t.depth);
+
+		// Plain stores to a byte per index, as setting bits would chain every pixel through the same few words
+		Uint8 seen[256] = {};
+		for (int i = 0; i < FRAME_TILE_BYTES; i++) seen[pixels[i]] = 1;
+		memset(t.used, 0, sizeof(t.used));
+		for (int i = 0; i <= 255; i++)
+			if (seen[i]) t.used[i >> 6] |= 1ULL << (i & 63);
+	}
+
+	// Every tile is packed at the pool's depth, so equal tiles have equal bytes
+	int Find(const frameTile& t) const {
+		auto range = byHash.equal_range(t.hash);
+		for (auto it = range.first; it != range.second; ++it) {
+			const frameTile& other = tiles[it->second];
+			if (other.depth == t.depth && other.pixels == t.pixels) return it->second;
+		}
+		return -1;
+	}
+
+	void CountUsage(const frameTile& t, int change) {
+		for (int w = 0; w < 4; w++)
+			for (Uint64 bits = t.used[w]; bits != 0; bits &= bits - 1)
+				usage[w * 64 + CountTrailingZeros(bits)] += change;
+	}
+
+	int HighestUsed() const {
+		int highest = 0;
+		for (int i = 0; i < 256; i++)
+			if (usage[i] > 0) highest = i;
+		return highest;
+	}
+
+	// Packs every tile again at bits bits per pixel, tiles spread over the job system. Packing is exact at any
+	// depth that holds the indices, so no two tiles become equal and references stay where they are.
+	void Repack(int bits) {
+		depth = bits;
+
+		SDLG::ParallelFor(0, (int)tiles.size(), [&](int first, int last) {
+			std::vector<Uint8>& pixels = SDLG::ScratchBuffer<Uint8, 2>(FRAME_TILE_BYTES);
+			for (int id = first; id < last; id++) {
+				frameTile& t = tiles[id];
+				if (t.pixels.empty()) continue;
+				Sint64 before = (Sint64)t.pixels.size();
+
+				Unpack(id, pixels.data());
+				Encode(pixels.data(), t);
+				SDLG::TrackMemory(SDLG::MemoryTag::Frames, (Sint64)t.pixels.size() - before);
+			}
+		});
+
+		byHash.clear();
+		for (size_t id = 0; id < tiles.size(); id++)
+			if (!tiles[id].pixels.empty()) byHash.emplace(tiles[id].hash, (int)id);
+	}
+
+	void Free(int id) {
+		frameTile& t = tiles[id];
+		CountUsage(t, -1);
+		SDLG::TrackMemory(SDLG::MemoryTag::Frames, -(Sint64)t.pixels.size());
+		std::vector<Uint8>().swap(t.pixels);
+		freeSlots.push_back(id);
+	}
+
+public:
+	// Id of a tile holding these pixels, shared if one already exists. The caller holds a reference to it.
+	int Intern(const Uint8* pixels) {
+		int needed = PackedDepth(MaxIndex(pixels, FRAME_TILE_BYTES) + 1);
+		if (needed > depth) Repack(needed);
+		Encode(pixels, pending);
+
+		int found = Find(pending);
+		if (found >= 0) {
+			tiles[found].refs++;
+			return found;
+		}
+
+		int id;
+		if (!freeSlots.empty()) {
+			id = freeSlots.back();
+			freeSlots.pop_back();
+		}
+		else {
+			id = (int)tiles.size();
+			tiles.push_back({});
+		}
+
+		tiles[id] = pending;
+		tiles[id].refs = 1;
+		SDLG::TrackMemory(SDLG::MemoryTag::Frames, (Sint64)pending.pixels.size());
+		CountUsage(pending, 1);
+		byHash.emplace(pending.hash, id);
+		return id;
+	}
+
+	void Retain(int id) {
+		tiles[id].refs++;
+	}
+
+	void Release(int id) {
+		frameTile& t = tiles[id];
+		if (--t.refs > 0) return;
+
+		auto range = byHash.equal_range(t.hash);
+		for (auto it = range.first; it != range.second; ++it)
+			if (it->second == id) {
+				byHash.erase(it);
+				break;
+			}
+
+		Free(id);
+	}
+
+	// Sends every tile through a palette remap, tiles spread over the job system. Tiles the remap makes identical
+	// are merged: the returned table gives the id each old id now lives on, which has taken over its references.
+	std::vector<int> Remap(const Uint8* lut) {
+		// Indices can move above what the current depth holds
+		int highest = 0;
+		for (int i = 0; i < 256; i++)
+			if (usage[i] > 0) highest = std::max<int>(highest, lut[i]);
+		depth = std::max(depth, PackedDepth(highest + 1));
+
+		std::vector<int> forward(tiles.size(), -1);
+		std::vector<bool> live(tiles.size(), false);
+		for (size_t id = 0; id < tiles.size(); id++) live[id] = !tiles[id].pixels.empty();
+
+		SDLG::ParallelFor(0, (int)tiles.size(), [&](int first, int last) {
+			std::vector<Uint8>& pixels = SDLG::ScratchBuffer<Uint8, 2>(FRAME_TILE_BYTES);
+			for (int id = first; id < last; id++) {
+				if (!live[id]) continue;
+				frameTile& t = tiles[id];
+				Sint64 before = (Sint64)t.pixels.size();
+
+				Unpack(id, pixels.data());
+				RemapRow(pixels.data(), FRAME_TILE_BYTES, lut);
+				Encode(pixels.data(), t);
+				SDLG::TrackMemory(SDLG::MemoryTag::Frames, (Sint64)t.pixels.size() - before);
+			}
+		});
+
+		byHash.clear();
+		for (size_t id = 0; id < tiles.size(); id++) {
+			if (!live[id]) continue;
+
+			int found = Find(tiles[id]);
+			if (found >= 0) {
+				tiles[found].refs += tiles[id].refs;
+				forward[id] = found;
+				Free((int)id);
+			}
+			else {
+				forward[id] = (int)id;
+				byHash.emplace(tiles[id].hash, (int)id);
+			}
+		}
+
+		// Usage was counted for the tiles before the remap
+		std::fill(usage, usage + 256, 0);
+		for (const frameTile& t : tiles)
+			if (!t.pixels.empty()) CountUsage(t, 1);
+		return forward;
+	}
+
+	// Whether any stored tile uses index
+	bool IndexUsed(Uint8 index) const {
+		return usage[index] > 0;
+	}
+
+	// The first count pixels of row y, as 8-bit indices
+	void UnpackRow(int id, int y, int count, Uint8* out) const {
+		const frameTile& t = tiles[id];
+		::UnpackRow(t.pixels.data() + PackedRowBytes(FRAME_TILE, t.depth) * y, count, t.depth, out);
+	}
+
+	// The whole tile as FRAME_TILE_BYTES 8-bit indices
+	void Unpack(int id, Uint8* out) const {
+		for (int y = 0; y < FRAME_TILE; y++) UnpackRow(id, y, FRAME_TILE, out + y * FRAME_TILE);
+	}
+
+	int Depth(int id) const {
+		return tiles[id].depth;
+	}
+
+	// Packs at the depth a palette of colours entries needs, or more if a stored index needs it
+	void SetPaletteSize(int colours) {
+		int bits = std::max(PackedDepth(colours), PackedDepth(HighestUsed() + 1));
+		if (bits != depth) Repack(bits);
+	}
+
+	// Bytes of packed pixels held
+	size_t PackedBytes() const {
+		size_t total = 0;
+		for (const frameTile& t : tiles) total += t.pixels.size();
+		return total;
+	}
+
+	// Number of distinct tiles held
+	size_t UniqueTiles() const {
+		return tiles.size() - freeSlots.size();
+	}
+
+	void Clear() {
+		SDLG::TrackMemory(SDLG::MemoryTag::Frames, -(Sint64)PackedBytes());
+		tiles.clear();
+		freeSlots.clear();
+		byHash.clear();
+		std::fill(usage, usage + 256, 0);
+	}
+};
+
+struct animationFrame {
+	std::vector<int> tiles; // Row major tile ids
+	int duration = 100;     // Milliseconds shown during playback
+	unsigned version = 0;   // Unique across the timeline, changes whenever the frame's pixels do
+};
+
+// The frames of an animation, sharing one palette and one tile pool
+class Timeline {
+private:
+	int width = 0, height = 0;
+	int tilesX = 0, tilesY = 0;
+	TilePool pool;
+	std::vector<animationFrame> frames;
+	std::vector<Uint8> scratch;
+	unsigned nextVersion = 1;
+
+	// Edge tiles are padded by repeating their last column and row, which adds no index the image doesn't use
+	int InternTile(const Uint8* image, int tx, int ty) {
+		SDL_Rect r = TileRect(tx, ty);
+		scratch.resize(FRAME_TILE_BYTES);
+		for (int y = 0; y < FRAME_TILE; y++) {
+			Uint8* row = scratch.data() + y * FRAME_TILE;
+			if (y >= r.h) {
+				memcpy(row, row - FRAME_TILE, FRAME_TILE);
+				continue;
+			}
+			memcpy(row, image + (size_t)(r.y + y) * width + r.x, r.w);
+			memset(row + r.w, row[r.w - 1], FRAME_TILE - r.w);
+		}
+		return pool.Intern(scratch.data());
+	}
+
+	void CopyTile(int id, int tx, int ty, Uint8* image) const {
+		SDL_Rect r = TileRect(tx, ty);
+		for (int y = 0; y < r.h; y++)
+			pool.UnpackRow(id, y, r.w, image + (size_t)(r.y + y) * width + r.x);
+	}
+
+public:
+	// Starts over with a single frame holding image
+	void Reset(const Uint8* image, int w, int h) {
+		width = w;
+		height = h;
+		tilesX = (w + FRAME_TILE - 1) / FRAME_TILE;
+		tilesY = (h + FRAME_TILE - 1) / FRAME_TILE;
+
+		frames.clear();
+		pool.Clear();
+
+		frames.emplace_back();
+		frames[0].tiles.resize((size_t)tilesX * tilesY);
+		frames[0].version = nextVersion++;
+		for (int ty = 0; ty < tilesY; ty++)
+			for (int tx = 0; tx < tilesX; tx++)
+				frames[0].tiles[(size_t)ty * tilesX + tx] = InternTile(image, tx, ty);
+	}
+
+	int GetTilesX() const {
+		return tilesX;
+	}
+
+	int GetTilesY() const {
+		return tilesY;
+	}
+
+	// Image area covered by a tile, smaller than a full tile along the right and bottom edges
+	SDL_Rect TileRect(int tx, int ty) const {
+		int x = tx * FRAME_TILE, y = ty * FRAME_TILE;
+		return { x, y, std::min(FRAME_TILE, width - x), std::min(FRAME_TILE, height - y) };
+	}
+
+	// Unpacks a tile into FRAME_TILE_BYTES indices. Tiles are FRAME_TILE pixels wide whatever part of them is inside the image.
+	void UnpackTile(int id, Uint8* out) const {
+		pool.Unpack(id, out);
+	}
+
+	// Bits per pixel a tile is stored at
+	int TileDepth(int id) const {
+		return pool.Depth(id);
+	}
+
+	int GetFrameCount() const {
+		return (int)frames.size();
+	}
+
+	const animationFrame& GetFrame(int index) const {
+		return frames[index];
+	}
+
+	void SetFrameDuration(int index, int milliseconds) {
+		frames[index].duration = std::max(1, milliseconds);
+	}
+
+	size_t UniqueTiles() const {
+		return pool.UniqueTiles();
+	}
+
+	// Re-stores the tiles of a frame that overlap area, which is all that can have changed
+	void Store(int index, const Uint8* image, SDL_Rect area) {
+		if (area.w <= 0 || area.h <= 0) return;
+
+		animationFrame& frame = frames[index];
+		int tx0 = std::max(area.x, 0) / FRAME_TILE;
+		int ty0 = std::max(area.y, 0) / FRAME_TILE;
+		int tx1 = std::min((area.x + area.w - 1) / FRAME_TILE, tilesX - 1);
+		int ty1 = std::min((area.y + area.h - 1) / FRAME_TILE, tilesY - 1);
+
+		for (int ty = ty0; ty <= ty1; ty++)
+			for (int tx = tx0; tx <= tx1; tx++) {
+				int& id = frame.tiles[(size_t)ty * tilesX + tx];
+				int stored = InternTile(image, tx, ty);
+				pool.Release(id);
+				id = stored;
+			}
+
+		frame.version = nextVersion++;
+	}
+
+	// Re-stores only the listed tiles of a frame, given by row major tile index
+	void StoreTiles(int index, const Uint8* image, const std::vector<int>& changed) {
+		if (changed.empty()) return;
+
+		animationFrame& frame = frames[index];
+		for (int i : changed) {
+			int& id = frame.tiles[i];
+			int stored = InternTile(image, i % tilesX, i / tilesX);
+			pool.Release(id);
+			id = stored;
+		}
+
+		frame.version = nextVersion++;
+	}
+
+	// Turns an image holding frame from into frame to. Only tiles that differ between the two are copied,
+	// and the area they cover is returned.
+	SDL_Rect Load(int from, int to, Uint8* image) const {
+		const std::vector<int>& a = frames[from].tiles;
+		const std::vector<int>& b = frames[to].tiles;
+
+		SDL_Rect changed = { 0,0,0,0 };
+		for (int ty = 0; ty < tilesY; ty++)
+			for (int tx = 0; tx < tilesX; tx++) {
+				size_t i = (size_t)ty * tilesX + tx;
+				if (a[i] == b[i]) continue;
+
+				CopyTile(b[i], tx, ty, image);
+				SDL_Rect r = TileRect(tx, ty);
+				if (changed.w <= 0) changed = r;
+				else SDL_UnionRect(&changed, &r, &changed);
+			}
+		return changed;
+	}
+
+	// Copies a whole frame out as a width*height image
+	void Extract(int index, Uint8* image) const {
+		const std::vector<int>& tiles = frames[index].tiles;
+		for (int ty = 0; ty < tilesY; ty++)
+			for (int tx = 0; tx < tilesX; tx++)
+				CopyTile(tiles[(size_t)ty * tilesX + tx], tx, ty, image);
+	}
+
+	int GetWidth() const {
+		return width;
+	}
+
+	int GetHeight() const {
+		return height;
+	}
+
+	// Inserts a copy of frame source at index, sharing all of its tiles
+	void Insert(int index, int source) {
+		animationFrame copy = frames[source];
+		copy.version = nextVersion++;
+		for (int id : copy.tiles) pool.Retain(id);
+		frames.insert(frames.begin() + index, copy);
+	}
+
+	void Remove(int index) {
+		for (int id : frames[index].tiles) pool.Release(id);
+		frames.erase(frames.begin() + index);
+	}
+
+	// Applies a palette remap to every frame. Each distinct tile is remapped once, however many frames share it.
+	void Remap(const Uint8* lut) {
+		std::vector<int> forward = pool.Remap(lut);
+		for (animationFrame& frame : frames) {
+			for (int& id : frame.tiles) id = forward[id];
+			frame.version = nextVersion++;
+		}
+	}
+
+	bool IndexUsed(Uint8 index) const {
+		return pool.IndexUsed(index);
+	}
+
+	// Tiles are packed at the bits per pixel a palette of this many entries needs
+	void SetPaletteSize(int colours) {
+		pool.SetPaletteSize(colours);
+	}
+
+	// Expands a frame through the palette into RGBA32 pixels, tiles spread over the job system
+	void Expand(int index, const SDL_Colour* palette, Uint32* out, int pitch) const {
+		Uint32 colours[256];
+		memcpy(colours, palette, sizeof(colours));
+
+		const animationFrame& frame = frames[index];
+		SDLG::ParallelForTiles({ 0, 0, width, height }, FRAME_TILE, FRAME_TILE, [&](SDL_Rect r) {
+			int id = frame.tiles[(size_t)(r.y / FRAME_TILE) * tilesX + r.x / FRAME_TILE];
+			Uint8 in[FRAME_TILE];
+			for (int y = 0; y < r.h; y++) {
+				Uint32* row = (Uint32*)((Uint8*)out + (size_t)(r.y + y) * pitch) + r.x;
+				pool.UnpackRow(id, y, r.w, in);
+				for (int x = 0; x < r.w; x++) row[x] = colours[in[x]];
+			}
+		});
+	}
+};
@@ -0,0 +1,305 @@
+#pragma once
+
+#include <SDL.h>
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "Jobs.h"
+#include "Memory.h"
+#include "Selection.h"
+#include "Resample.h"
+
+// RotSprite-style rotation samples an 8x upscale of the selection, 64 times its area held twice over while it's
+// built. Past this many source pixels the transform rotates nearest neighbour instead.
+#define ROTSPRITE_MAX_AREA (256 * 256)
+
+// Pixels lifted off the canvas so they can be moved, flipped, scaled and rotated before being put down again.
+// Destination pixels are mapped back into the source with an inverse affine and sampled nearest neighbour,
+// stepping along each row in 16.16 fixed point. Quarter turns, flips and whole number scales land exactly
+// on source pixel centres.
+class FloatingSelection {
+private:
+	int width = 0, height = 0;
+	std::vector<Uint8> pixels;
+	std::vector<Uint8> mask; // 1 where the pixel was selected
+	SDL_Point origin = { 0,0 };
+
+	// RotSprite-style mode samples from the source upscaled 8x with Scale2x, which keeps edges clean under rotation
+	std::vector<Uint8> bigPixels, bigMask;
+
+	int offsetX = 0, offsetY = 0;
+	float scaleX = 1, scaleY = 1;
+	float angle = 0; // Free rotation in radians, clockwise, applied on top of the quarter turns
+	int quarterTurns = 0;
+	bool flipX = false, flipY = false;
+	bool rotSprite = false;
+
+	unsigned version = 0;
+
+	// Derived from the parameters by Update
+	SDL_Rect bounds = { 0,0,0,0 };
+	double centreX = 0, centreY = 0;
+	double inv00 = 1, inv01 = 0, inv10 = 0, inv11 = 1;
+	Sint64 stepU = 65536, stepV = 0;
+
+	// RotSprite is turned on and the selection is small enough for it
+	bool UsingRotSprite() const {
+		return rotSprite && (Sint64)width * height <= ROTSPRITE_MAX_AREA;
+	}
+
+	static int FloorDiv2(int x) {
+		return x >= 0 ? x / 2 : -((1 - x) / 2);
+	}
+
+	void BuildRotSpriteSource() {
+		int w = width, h = height;
+		std::vector<Uint16> a((size_t)w * h), b;
+		for (size_t i = 0; i < a.size(); i++) a[i] = mask[i] ? pixels[i] : 0x100;
+
+		for (int pass = 0; pass < 3; pass++) {
+			b.resize((size_t)w * h * 4);
+			Scale2xIndices(a.data(), w, h, b.data());
+			a.swap(b);
+			w *= 2;
+			h *= 2;
+		}
+
+		bigPixels.resize(a.size());
+		bigMask.resize(a.size());
+		for (size_t i = 0; i < a.size(); i++) {
+			bigPixels[i] = (Uint8)a[i];
+			bigMask[i] = a[i] < 0x100;
+		}
+	}
+
+	void Update() {
+		const double quarter = 1.57079632679489661923;
+
+		// Rotations that are whole quarter turns use exact sines so they stay lossless
+		int turns = quarterTurns;
+		double extra = angle;
+		double nearest = std::floor(extra / quarter + 0.5);
+		if (std::fabs(extra - nearest * quarter) < 1e-6) {
+			turns += (int)nearest;
+			extra = 0;
+		}
+		turns = ((turns % 4) + 4) % 4;
+
+		double c, s;
+		if (extra == 0) {
+			static const int cosines[4] = { 1, 0, -1, 0 };
+			static const int sines[4] = { 0, 1, 0, -1 };
+			c = cosines[turns];
+			s = sines[turns];
+		}
+		else {
+			c = std::cos(turns * quarter + extra);
+			s = std::sin(turns * quarter + extra);
+		}
+
+		// Forward map is rotate * scale * flip
+		double fx = (flipX ? -1.0 : 1.0) * scaleX;
+		double fy = (flipY ? -1.0 : 1.0) * scaleY;
+		double m00 = c * fx, m01 = -s * fy;
+		double m10 = s * fx, m11 = c * fy;
+
+		int dw = std::max(1, (int)std::ceil(std::fabs(m00) * width + std::fabs(m01) * height - 1e-6));
+		int dh = std::max(1, (int)std::ceil(std::fabs(m10) * width + std::fabs(m11) * height - 1e-6));
+		bounds = {
+			origin.x + offsetX + FloorDiv2(width - dw),
+			origin.y + offsetY + FloorDiv2(height - dh),
+			dw, dh
+		};
+		centreX = bounds.x + dw / 2.0;
+		centreY = bounds.y + dh / 2.0;
+
+		// Inverse, in units of whichever source is sampled
+		int factor = UsingRotSprite() ? 8 : 1;
+		double det = m00 * m11 - m01 * m10;
+		inv00 = m11 / det * factor;
+		inv01 = -m01 / det * factor;
+		inv10 = -m10 / det * factor;
+		inv11 = m00 / det * factor;
+		stepU = std::llround(inv00 * 65536.0);
+		stepV = std::llround(inv10 * 65536.0);
+
+		if (UsingRotSprite() && bigPixels.empty()) BuildRotSpriteSource();
+
+		version++;
+	}
+
+public:
+	// Copies the pixels of area out of an image, filling the holes with background.
+	// With a selection only its pixels are taken, otherwise the whole area is.
+	void Lift(Uint8* image, int imageW, SDL_Rect area, const SelectionMask* selection, Uint8 background) {
+		width = area.w;
+		height = area.h;
+		origin = { area.x, area.y };
+		pixels.resize((size_t)width * height);
+		mask.resize((size_t)width * height);
+		bigPixels.clear();
+		bigMask.clear();
+
+		for (int y = 0; y < height; y++) {
+			Uint8* in = image + (size_t)(area.y + y) * imageW + area.x;
+			for (int x = 0; x < width; x++) {
+				size_t k = (size_t)y * width + x;
+				bool taken = selection == NULL || selection->Get(area.x + x, area.y + y);
+				pixels[k] = in[x];
+				mask[k] = taken;
+				if (taken) in[x] = background;
+			}
+		}
+
+		offsetX = offsetY = 0;
+		scaleX = scaleY = 1;
+		angle = 0;
+		quarterTurns = 0;
+		flipX = flipY = false;
+		rotSprite = false;
+		Update();
+	}
+
+	// Puts the lifted pixels back where they were taken from
+	void Restore(Uint8* image, int imageW) const {
+		for (int y = 0; y < height; y++) {
+			Uint8* out = image + (size_t)(origin.y + y) * imageW + origin.x;
+			for (int x = 0; x < width; x++) {
+				size_t k = (size_t)y * width + x;
+				if (mask[k]) out[x] = pixels[k];
+			}
+		}
+	}
+
+	SDL_Rect GetSourceRect() const {
+		return { origin.x, origin.y, width, height };
+	}
+
+	// Where the transformed pixels land, in image coordinates
+	SDL_Rect GetBounds() const {
+		return bounds;
+	}
+
+	// Changes every time the transform does
+	unsigned GetVersion() const {
+		return version;
+	}
+
+	void Move(int dx, int dy) {
+		offsetX += dx;
+		offsetY += dy;
+		Update();
+	}
+
+	float GetAngle() const {
+		return angle;
+	}
+
+	void SetAngle(float radians) {
+		angle = radians;
+		Update();
+	}
+
+	// Turns clockwise by a number of quarter turns
+	void Rotate90(int turns) {
+		quarterTurns += turns;
+		Update();
+	}
+
+	// Flips as seen on screen, so the direction of any rotation is mirrored too
+	void FlipHorizontal() {
+		flipX = !flipX;
+		angle = -angle;
+		quarterTurns = -quarterTurns;
+		Update();
+	}
+
+	void FlipVertical() {
+		flipY = !flipY;
+		angle = -angle;
+		quarterTurns = -quarterTurns;
+		Update();
+	}
+
+	float GetScale() const {
+		return scaleX;
+	}
+
+	void SetScale(float scale) {
+		scaleX = scaleY = std::max(scale, 1.0f / 64);
+		Update();
+	}
+
+	bool GetRotSprite() const {
+		return rotSprite;
+	}
+
+	void SetRotSprite(bool enabled) {
+		rotSprite = enabled;
+		Update();
+	}
+
+	// Samples x0 <= x < x1 of destination row y. covered is 0 where no source pixel lands.
+	void SampleRow(int y, int x0, int x1, Uint8* index, Uint8* covered) const {
+		bool big = UsingRotSprite();
+		int factor = big ? 8 : 1;
+		int sw = width * factor, sh = height * factor;
+		const Uint8* src = big ? bigPixels.data() : pixels.data();
+		const Uint8* srcMask = big ? bigMask.data() : mask.data();
+
+		double rx = x0 + 0.5 - centreX;
+		double ry = y + 0.5 - centreY;
+		Sint64 u = std::llround((inv00 * rx + inv01 * ry + sw * 0.5) * 65536.0);
+		Sint64 v = std::llround((inv10 * rx + inv11 * ry + sh * 0.5) * 65536.0);
+
+		for (int i = 0; i < x1 - x0; i++, u += stepU, v += stepV) {
+			Sint64 sx = u >> 16, sy = v >> 16;
+			if (sx >= 0 && sy >= 0 && sx < sw && sy < sh) {
+				size_t k = (size_t)sy * sw + (size_t)sx;
+				index[i] = src[k];
+				covered[i] = srcMask[k];
+			}
+			else covered[i] = 0;
+		}
+	}
+
+	// Resamples the whole transform into the image at full resolution, a band of rows per thread,
+	// and replaces selection with the pixels that were put down. Returns the area written.
+	SDL_Rect Stamp(Uint8* image, int imageW, int imageH, SelectionMask& selection) const {
+		SDL_Rect imageRect = { 0, 0, imageW, imageH };
+		SDL_Rect area;
+		selection.Resize(imageW, imageH);
+		if (!SDL_IntersectRect(&bounds, &imageRect, &area)) return { 0,0,0,0 };
+
+		std::vector<Uint8>& covered = SDLG::ScratchBuffer<Uint8, 0>((size_t)area.w * area.h);
+
+		SDLG::ParallelFor(0, area.h, [&](int y0, int y1) {
+			std::vector<Uint8>& index = SDLG::ScratchBuffer<Uint8, 1>(area.w);
+			for (int y = y0; y < y1; y++) {
+				Uint8* cov = covered.data() + (size_t)y * area.w;
+				SampleRow(area.y + y, area.x, area.x + area.w, index.data(), cov);
+
+				Uint8* out = image + (size_t)(area.y + y) * imageW + area.x;
+				for (int x = 0; x < area.w; x++)
+					if (cov[x]) out[x] = index[x];
+			}
+		}, 16);
+
+		std::vector<span> spans;
+		for (int y = 0; y < area.h; y++) {
+			const Uint8* cov = covered.data() + (size_t)y * area.w;
+			int x = 0;
+			while (x < area.w) {
+				while (x < area.w && !cov[x]) x++;
+				int start = x;
+				while (x < area.w && cov[x]) x++;
+				if (start < x) spans.push_back({ area.y + y, area.x + start, area.x + x });
+			}
+		}
+		selection.SetSpans(spans, true);
+
+		return area;
+	}
+};